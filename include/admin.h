@@ -0,0 +1,34 @@
+#ifndef ADMIN_H
+#define ADMIN_H
+
+/*
+ * Admin interface: a minimal HTTP/1.0 server on a port of its own, kept apart
+ * from the client protocol, for operators and metrics scrapers.
+ *
+ * Requests are served one at a time, by a single thread, and every response
+ * is plain text followed by closing the connection.  The paths served are:
+ *
+ *   GET /metrics  The statistics, as written by stats_dump().
+ *   GET /locks    The lock profile (see lockprof.h), if it is built in.
+ *   GET /loglevel The log level (see log.h); with ?level=<name>, sets it
+ *                 first.
+ *   GET /flight   The flight recorder (see flight.h), oldest event first.
+ */
+
+/*
+ * Address the admin interface listens on when none is given.  Nothing on it
+ * is authenticated, so by default it is only reachable from the same host.
+ */
+#define ADMIN_DEFAULT_HOST "127.0.0.1"
+
+/*
+ * Start the thread that serves the admin interface.
+ *
+ * @param addr  The port to listen on, optionally preceded by an address and
+ * a colon ("8080", "0.0.0.0:8080", "[::1]:8080").  Without an address,
+ * the interface listens on ADMIN_DEFAULT_HOST.
+ * @return 0 if successful, otherwise -1.
+ */
+int admin_init(char *addr);
+
+#endif
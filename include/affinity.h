@@ -0,0 +1,15 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#include <pthread.h>
+
+/*
+ * Pin a thread to a single CPU.
+ *
+ * @param tid  The thread to pin.
+ * @param cpu  The CPU number, taken modulo the number of CPUs online.
+ * @return 0 if successful, otherwise -1.
+ */
+int pin_thread(pthread_t tid, int cpu);
+
+#endif
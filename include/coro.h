@@ -0,0 +1,41 @@
+#ifndef CORO_H
+#define CORO_H
+
+/*
+ * Coroutine server mode.
+ *
+ * Each connection is serviced by the same sequential loop as in thread mode,
+ * but run as a coroutine with a small stack of its own instead of a thread.
+ * A fixed set of scheduler threads each own an epoll(7) instance; a coroutine
+ * whose socket has no input parks itself on that instance and the scheduler
+ * switches to whichever coroutine has input next.  A coroutine stays on one
+ * scheduler for its whole lifetime, so the commands of a TU are still
+ * carried out one at a time and in order.
+ */
+
+/*
+ * Bytes of address space reserved for the stack of each coroutine, below
+ * which a guard page is mapped.  Only the pages a coroutine actually
+ * touches (typically two or three) are ever backed by memory.
+ */
+#define CORO_STACK_SIZE (64 * 1024)
+
+/*
+ * Start the scheduler threads.
+ *
+ * @param nthreads  The number of scheduler threads to run.
+ * @return 0 if the schedulers were started, otherwise -1.
+ */
+int coro_init(int nthreads);
+
+/*
+ * Register a newly accepted connection with the PBX and start a coroutine
+ * to service it on one of the schedulers.
+ *
+ * @param connfd  The file descriptor of the accepted connection.
+ * @return 0 if the coroutine was started, otherwise -1 (in which case the
+ * connection has been closed).
+ */
+int coro_add(int connfd);
+
+#endif
@@ -171,6 +171,19 @@ void Pthread_once(pthread_once_t *once_control, void (*init_function)());
 void Sem_init(sem_t *sem, int pshared, unsigned int value);
 void P(sem_t *sem);
 void V(sem_t *sem);
+int Sem_trywait(sem_t *sem);
+
+/*
+ * In a LOCK_PROFILE build, the semaphore wrappers are replaced by versions
+ * that record how each semaphore is used (see lockprof.h).
+ */
+#ifdef LOCK_PROFILE
+#include "lockprof.h"
+#define Sem_init(sem, pshared, value) lockprof_init((sem), (pshared), (value), LOCK_SITE_HERE(sem))
+#define P(sem) lockprof_P((sem), LOCK_SITE_HERE(sem))
+#define V(sem) lockprof_V((sem), LOCK_SITE_HERE(sem))
+#define Sem_trywait(sem) lockprof_trywait((sem), LOCK_SITE_HERE(sem))
+#endif
 
 /* Rio (Robust I/O) package */
 ssize_t rio_readn(int fd, void *usrbuf, size_t n);
@@ -189,10 +202,13 @@ ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
 /* Reentrant protocol-independent client/server helpers */
 int open_clientfd(char *hostname, char *port);
 int open_listenfd(char *port);
+int open_listenfd_host(char *host, char *port);
+int open_listenfd_reuseport(char *port);
 
 /* Wrappers for reentrant protocol-independent client/server helpers */
 int Open_clientfd(char *hostname, char *port);
 int Open_listenfd(char *port);
+int Open_listenfd_reuseport(char *port);
 
 
 #endif /* __CSAPP_H__ */
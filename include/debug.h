@@ -3,6 +3,8 @@
 
 #include <stdio.h>
 
+#include "log.h"
+
 #define NL "\n"
 
 #ifdef COLOR
@@ -35,54 +37,16 @@
 #define SUCCESS
 #endif
 
-#ifdef DEBUG
-#define debug(S, ...)                                                          \
-  do {                                                                         \
-    fprintf(stderr, KMAG "DEBUG: %s:%s:%d " KNRM S NL, __FILE__,               \
-            __extension__ __FUNCTION__, __LINE__, ##__VA_ARGS__);                \
-  } while (0)
-#else
-#define debug(S, ...)
-#endif
-
-#ifdef INFO
-#define info(S, ...)                                                           \
-  do {                                                                         \
-    fprintf(stderr, KBLU "INFO: %s:%s:%d " KNRM S NL, __FILE__,                \
-            __extension__ __FUNCTION__, __LINE__, ##__VA_ARGS__);                \
-  } while (0)
-#else
-#define info(S, ...)
-#endif
-
-#ifdef WARN
-#define warn(S, ...)                                                           \
-  do {                                                                         \
-    fprintf(stderr, KYEL "WARN: %s:%s:%d " KNRM S NL, __FILE__,                \
-            __extension__ __FUNCTION__, __LINE__, ##__VA_ARGS__);                \
-  } while (0)
-#else
-#define warn(S, ...)
-#endif
-
-#ifdef SUCCESS
-#define success(S, ...)                                                        \
-  do {                                                                         \
-    fprintf(stderr, KGRN "SUCCESS: %s:%s:%d " KNRM S NL, __FILE__,             \
-            __extension__ __FUNCTION__, __LINE__, ##__VA_ARGS__);                \
-  } while (0)
-#else
-#define success(S, ...)
-#endif
-
-#ifdef ERROR
-#define error(S, ...)                                                          \
-  do {                                                                         \
-    fprintf(stderr, KRED "ERROR: %s:%s:%d " KNRM S NL, __FILE__,               \
-            __extension__ __FUNCTION__, __LINE__, ##__VA_ARGS__);                \
-  } while (0)
-#else
-#define error(S, ...)
-#endif
+/*
+ * Logging macros.  Each takes a printf-style format and arguments, and hands
+ * the message to the asynchronous logger in log.h, which writes it to stderr
+ * if its level is enabled at the time.  The flags above only decide which
+ * level is enabled to begin with.
+ */
+#define debug(S, ...) LOG_AT(LOG_DEBUG, KMAG "DEBUG: ", S, ##__VA_ARGS__)
+#define info(S, ...) LOG_AT(LOG_INFO, KBLU "INFO: ", S, ##__VA_ARGS__)
+#define success(S, ...) LOG_AT(LOG_INFO, KGRN "SUCCESS: ", S, ##__VA_ARGS__)
+#define warn(S, ...) LOG_AT(LOG_WARN, KYEL "WARN: ", S, ##__VA_ARGS__)
+#define error(S, ...) LOG_AT(LOG_ERROR, KRED "ERROR: ", S, ##__VA_ARGS__)
 
 #endif /* DEBUG_H */
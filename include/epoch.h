@@ -0,0 +1,21 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+/*
+ * Epoch-based protection for read-mostly data.
+ *
+ * Readers bracket their accesses with epoch_enter() and epoch_exit().
+ * These only touch a record private to the calling thread, so read-side
+ * critical sections never contend with each other.  A writer that unpublishes
+ * an object calls epoch_synchronize(), which waits until every reader that
+ * might still hold a pointer to the object has left its critical section;
+ * after that the object may be released.
+ *
+ * Read-side critical sections may block, but must not nest and must not call
+ * epoch_synchronize().
+ */
+void epoch_enter(void);
+void epoch_exit(void);
+void epoch_synchronize(void);
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef EVENT_H
+#define EVENT_H
+
+/*
+ * Event-loop server mode.
+ *
+ * Instead of dedicating a thread to each client, a small fixed set of
+ * event-loop threads multiplex all client connections using epoll(7).
+ * Each connection is owned by exactly one loop for its whole lifetime,
+ * so the commands of a TU are still carried out one at a time and in order.
+ */
+
+/*
+ * Default number of event-loop threads, used when none is specified.
+ */
+#define EVENT_DEFAULT_LOOPS 4
+
+/*
+ * Start the event-loop threads.
+ *
+ * @param nloops  The number of event-loop threads to run.
+ * @return 0 if the loops were started, otherwise -1.
+ */
+int event_loop_init(int nloops);
+
+/*
+ * Hand a newly accepted connection to one of the event loops.
+ * The connection is registered with the PBX and serviced until EOF.
+ *
+ * @param connfd  The file descriptor of the accepted connection.
+ * @return 0 if the connection was added, otherwise -1 (in which case
+ * the connection has been closed).
+ */
+int event_loop_add(int connfd);
+
+#endif
@@ -0,0 +1,84 @@
+#ifndef EXT_H
+#define EXT_H
+
+#include <stdio.h>
+
+/*
+ * Allocator of extension numbers.
+ *
+ * Extensions are handed out from a configured range, lowest free number
+ * first, so the numbers in use stay dense and the registry tables stay small
+ * whatever file descriptors the connections happen to get.  The range is
+ * kept as a bitmap with one bit per number, set while the number is
+ * assigned; a specific number can therefore be claimed with a single bit
+ * test.
+ *
+ * A number that is given back is not reused straight away: it stays in
+ * quarantine, still marked in the bitmap, for a configured time, so that
+ * a client dialing the extension of someone who has just hung up does not
+ * reach whoever connects next.  Quarantined numbers are released in the order
+ * they were given back.  Only when the range would otherwise be exhausted is
+ * a number taken out of quarantine early.
+ */
+
+/*
+ * Default range of extension numbers, and time (in milliseconds) that a
+ * number given back is kept out of use.
+ */
+#define EXT_DEFAULT_FIRST 0
+#define EXT_DEFAULT_QUARANTINE_MS 1000
+
+/*
+ * Set the range of extension numbers to allocate from and the quarantine
+ * time.  Without a call to this function (which must come before the first
+ * allocation, and before pbx_init(), which indexes the registry from the
+ * bottom of the range) the range is EXT_DEFAULT_FIRST onwards,
+ * PBX_MAX_EXTENSIONS numbers long, with a quarantine of
+ * EXT_DEFAULT_QUARANTINE_MS.
+ *
+ * @param first  The lowest number in the range.
+ * @param last  The highest number in the range.
+ * @param quarantine_ms  How long a number given back is kept out of use.
+ * @return 0 if successful, otherwise -1 (if the range is empty or invalid,
+ * or the bitmap cannot be allocated).
+ */
+int ext_init(int first, int last, unsigned long quarantine_ms);
+
+/*
+ * The lowest number in the range.
+ */
+int ext_base(void);
+
+/*
+ * Assign the lowest free extension number.
+ *
+ * @return the number, or -1 if every number in the range is assigned.
+ */
+int ext_alloc(void);
+
+/*
+ * Assign a specific extension number.
+ *
+ * @return 0 if successful, otherwise -1 (if the number is outside the range,
+ * assigned, or in quarantine).
+ */
+int ext_claim(int ext);
+
+/*
+ * Give back an extension number, which is put in quarantine.
+ */
+void ext_free(int ext);
+
+/*
+ * Give back an extension number that was claimed but never given to a
+ * client, which is free again at once: no one can have dialed it.
+ */
+void ext_unclaim(int ext);
+
+/*
+ * Write the allocator statistics: the size of the range, the numbers assigned
+ * and in quarantine, and the allocations and claims that failed.
+ */
+void ext_stats(FILE *out);
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef FLIGHT_H
+#define FLIGHT_H
+
+#include <stdio.h>
+
+#include "tu.h"
+
+/*
+ * Flight recorder: the most recent TU events, kept so that the history of a
+ * stuck call can be looked at after the fact.
+ *
+ * Events go into a single fixed-size ring, overwriting the oldest.  Recording
+ * one takes a slot with an atomic increment of the ring's counter and fills
+ * it in with plain stores, bracketed by the slot's sequence number so that a
+ * reader can tell a slot that was being written while it read from one that
+ * was not; nothing ever waits.  Timestamps come from the coarse monotonic
+ * clock, which is cheap to read, and the sequence numbers give the exact
+ * order of events.  The recorder is always on.
+ *
+ * The ring is written out on SIGUSR1 (see stats.h) and served by the admin
+ * interface at /flight.
+ */
+#define FLIGHT_EVENTS 4096
+
+/*
+ * What an event records.  Each operation is recorded for the TU it was
+ * carried out on, whether or not it changed its state, and again for any
+ * other TU whose state it changed.  A ring timeout is a hangup made by the
+ * ring timer.
+ */
+typedef enum flight_op {
+    FLIGHT_REGISTER, FLIGHT_UNREGISTER, FLIGHT_DIAL, FLIGHT_PICKUP,
+    FLIGHT_HANGUP, FLIGHT_RING_TIMEOUT, FLIGHT_CHAT
+} FLIGHT_OP;
+
+/*
+ * State recorded by events that are not transitions (registrations).
+ */
+#define FLIGHT_NO_STATE (-1)
+
+/*
+ * Record an event.
+ *
+ * @param op  What happened.
+ * @param tu  The TU it happened to.
+ * @param ext  Its extension.
+ * @param old  Its state before, or FLIGHT_NO_STATE.
+ * @param new  Its state after, or FLIGHT_NO_STATE.
+ * @param peer  Its peer afterwards, or before if the event took it away, or
+ * NULL if it had none.
+ * @param peer_ext  The extension of the peer, or -1.
+ */
+void flight_record(FLIGHT_OP op, TU *tu, int ext, int old, int new, TU *peer, int peer_ext);
+
+/*
+ * Write the events in the ring, oldest first, one per line.
+ *
+ * @return the number of events written.
+ */
+int flight_dump(FILE *out);
+
+#endif
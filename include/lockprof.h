@@ -0,0 +1,51 @@
+#ifndef LOCKPROF_H
+#define LOCKPROF_H
+
+#include <stdio.h>
+#include <semaphore.h>
+
+/*
+ * Lock contention profiler, built into the semaphore wrappers of csapp.h
+ * when the server is built with LOCK_PROFILE defined (make LOCK_PROFILE=1,
+ * after a make clean).
+ *
+ * Semaphores are profiled by class rather than one by one, so that the
+ * per-TU locks show up as a single entry.  The class of a semaphore is named
+ * after the file it is used in and the member it is kept in: Sem_init(),
+ * P() and V() on &tu->out_lock in tu.c, or on &peer->out_lock, are all
+ * counted as "tu->out_lock", and &shard->w in pbx.c as "pbx->w".  Each call
+ * site works out its class the first time it runs and keeps it.
+ *
+ * For each class the profiler counts acquisitions, acquisitions that had to
+ * wait, and the total and longest waits.  Semaphores that Sem_init() starts
+ * at 1 are locks: the time from P() to V() on the same thread is also
+ * recorded, as total and longest hold time.  Other semaphores are signals
+ * (posted by one thread and waited on by another), for which only waits are
+ * counted.
+ */
+
+typedef struct lock_site {
+    const char *file;
+    const char *expr;
+    struct lock_class *cls;  // Set on first use.
+} LOCK_SITE;
+
+/*
+ * The profiling record of the call site it is used at.
+ */
+#define LOCK_SITE_HERE(sem) ({ static LOCK_SITE site_ = { __FILE__, #sem }; &site_; })
+
+void lockprof_init(sem_t *sem, int pshared, unsigned int value, LOCK_SITE *site);
+void lockprof_P(sem_t *sem, LOCK_SITE *site);
+void lockprof_V(sem_t *sem, LOCK_SITE *site);
+int lockprof_trywait(sem_t *sem, LOCK_SITE *site);
+
+/*
+ * Write the statistics of every lock class, one metric per line.
+ *
+ * @return the number of classes written, or -1 if the server was built
+ * without LOCK_PROFILE (in which case nothing is written).
+ */
+int lockprof_stats(FILE *out);
+
+#endif
@@ -0,0 +1,100 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdio.h>
+
+/*
+ * Asynchronous logging, behind the debug(), info(), success(), warn() and
+ * error() macros of debug.h.
+ *
+ * Logging a message does not format it or write it anywhere.  The calling
+ * thread copies the arguments into a binary record in a ring buffer of its
+ * own: a fixed description of the call site (level, file, function, line and
+ * format string) and the argument values, with strings copied (truncated to
+ * LOG_STRING_MAX bytes).  Each ring has a single writer, its thread, and a
+ * single reader, a drain thread that formats the records and writes them to
+ * stderr, so neither side takes a lock.  A message that does not fit in its
+ * thread's ring is dropped and counted, rather than making the thread wait.
+ *
+ * Every message is compiled in; the level below which messages are skipped
+ * can be changed at runtime, and costs a single load and compare to check.
+ * Messages from different threads may come out in a different order than
+ * they were logged; each line starts with the time it was logged.
+ *
+ * Formats may use the d, i, o, u, x, X, c, s, p, e, f, g and a conversions,
+ * with flags, a numeric width and precision and any length modifier but L,
+ * but not '*' widths or precisions.
+ */
+typedef enum log_level {
+    LOG_DEBUG, LOG_INFO, LOG_WARN, LOG_ERROR, LOG_OFF
+} LOG_LEVEL;
+
+/*
+ * Messages below this level are skipped.  It starts out at the lowest level
+ * the build enables (LOG_DEBUG with -DDEBUG), or LOG_WARN.
+ */
+extern int log_level;
+
+typedef struct log_site {
+    LOG_LEVEL level;
+    const char *prefix;
+    const char *file;
+    const char *function;
+    int line;
+    const char *format;
+} LOG_SITE;
+
+/*
+ * Log a message, if its level is enabled.  The call to printf() is never
+ * made; it only has the compiler check the format against the arguments.
+ */
+#define LOG_AT(lvl, pfx, S, ...)                                               \
+  do {                                                                         \
+    if (__builtin_expect((lvl) >= __atomic_load_n(&log_level, __ATOMIC_RELAXED), 0)) { \
+      static const LOG_SITE site_ = { lvl, pfx, __FILE__, __FUNCTION__, __LINE__, S }; \
+      if (0)                                                                   \
+        printf(S, ##__VA_ARGS__);                                              \
+      log_write(&site_, ##__VA_ARGS__);                                        \
+    }                                                                          \
+  } while (0)
+
+#define LOG_STRING_MAX 256
+
+/*
+ * Record a message, whose arguments follow the site, in the calling thread's
+ * ring.
+ */
+void log_write(const LOG_SITE *site, ...);
+
+/*
+ * Start the drain thread.  It blocks every signal, so this may be called
+ * before stats_signal_init() sets up the signal mask for the other threads.
+ *
+ * @return 0 if successful, otherwise -1.
+ */
+int log_init(void);
+
+/*
+ * Format and write every message recorded so far, on the calling thread.
+ */
+void log_flush(void);
+
+/*
+ * Set the level by name: "debug", "info", "warn", "error" or "off".
+ *
+ * @return 0 if successful, or -1 if the name is not a level.
+ */
+int log_set_level(const char *name);
+
+/*
+ * The name of the current level.
+ */
+const char *log_level_name(void);
+
+/*
+ * Write the logging statistics: messages recorded, and messages dropped for
+ * lack of room in a ring.
+ */
+void log_stats(FILE *out);
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+
+#include "server.h"
+
+/*
+ * Per-command latency histograms and event counters.
+ *
+ * Each thread records into its own block of histograms and counters, with
+ * plain (relaxed) stores, so recording never takes a lock or bounces a cache
+ * line between threads.  The blocks are kept on a list that only grows, and
+ * the statistics are produced by summing all of them without locks; a block
+ * whose thread has exited is handed to the next thread that needs one, and
+ * its counts stay in the totals.
+ *
+ * Latencies are kept in nanoseconds in HDR-style log-linear buckets: each
+ * power of two is split into METRICS_SUB_BUCKETS equal buckets, so that every
+ * value is recorded to within 1 part in METRICS_SUB_BUCKETS, from a few
+ * nanoseconds up to about a minute (longer latencies fall in the last
+ * bucket).
+ */
+#define METRICS_SUB_BITS 3
+#define METRICS_SUB_BUCKETS (1 << METRICS_SUB_BITS)
+#define METRICS_MAX_BITS 36
+#define METRICS_BUCKETS ((METRICS_MAX_BITS - METRICS_SUB_BITS + 1) * METRICS_SUB_BUCKETS)
+
+/*
+ * Histograms are kept for the commands carried out on behalf of clients,
+ * indexed by their TU_COMMAND.
+ */
+#define METRICS_COMMANDS (TU_CHAT_CMD + 1)
+
+typedef enum metrics_counter {
+    METRICS_REGISTRATIONS,  // TUs registered with the PBX.
+    METRICS_CALLS,          // Calls answered.
+    METRICS_CHATS,          // Chat messages sent to a peer.
+    METRICS_COUNTERS
+} METRICS_COUNTER;
+
+/*
+ * Take the start time of a command, to be passed to metrics_record() once
+ * it has been carried out.
+ */
+long metrics_start(void);
+
+/*
+ * Record the time taken by a command since metrics_start() returned start.
+ */
+void metrics_record(TU_COMMAND cmd, long start);
+
+/*
+ * Count an event.
+ */
+void metrics_count(METRICS_COUNTER counter);
+
+/*
+ * Write the event counters and, for each command, the number of times it was
+ * carried out, the total and maximum time taken, estimated quantiles and the
+ * cumulative counts of the histogram buckets that are in use.
+ */
+void metrics_stats(FILE *out);
+
+#endif
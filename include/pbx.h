@@ -1,6 +1,7 @@
 #ifndef PBX_H
 #define PBX_H
 
+#include <stdio.h>
 #include <unistd.h>
 #include <sys/select.h>
 
@@ -24,6 +25,11 @@ typedef struct pbx PBX;
  */
 #define PBX_MAX_EXTENSIONS FD_SETSIZE
 
+/*
+ * Number of registry shards used by pbx_init().
+ */
+#define PBX_DEFAULT_SHARDS 8
+
 /*
  * End-of-line sequence used in communication with client.
  */
@@ -35,9 +41,12 @@ typedef struct pbx PBX;
 extern PBX *pbx;
 
 PBX *pbx_init();
+PBX *pbx_init_sharded(int nshards);
 void pbx_shutdown(PBX *pbx);
 int pbx_register(PBX *pbx, TU *tu, int ext);
 int pbx_unregister(PBX *pbx, TU *tu);
+int pbx_renumber(PBX *pbx, TU *tu, int ext);
 int pbx_dial(PBX *pbx, TU *tu, int ext);
+void pbx_stats(PBX *pbx, FILE *out);
 
 #endif
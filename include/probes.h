@@ -0,0 +1,44 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+/*
+ * Static tracepoints (USDT probes), for measuring live calls with perf,
+ * bpftrace or SystemTap without rebuilding or restarting the server.
+ *
+ * Each PBX_PROBE(name, args...) becomes a "pbx:name" probe through
+ * STAP_PROBEV() of <sys/sdt.h>: a single nop in the code, with the location
+ * of the probe and of its arguments described in an ELF note.  Nothing is
+ * done unless a tracer attaches to the probe, but the arguments are still
+ * computed, so they should be values already at hand.  Where <sys/sdt.h> is
+ * not installed (it comes with the systemtap-sdt-dev package), or the server
+ * is built with NO_PROBES defined, the probes compile to nothing.
+ *
+ * The probes, and their arguments:
+ *
+ *   command_receive(tu, ext, line)   A text command line, before it is parsed.
+ *   frame_receive(tu, ext, op, arg)  A binary protocol frame (see proto.h).
+ *   lookup_start(tu, ext)            pbx_dial() looking up an extension...
+ *   lookup_done(tu, ext, target)     ...and the TU found, or NULL.
+ *   tu_state(tu, ext, op, old, new)  An operation on a TU (see flight.h for
+ *                                    the operations), with its state before
+ *                                    and after.
+ *   notify_queue(tu, state)          A state notification queued for output.
+ *   notify_send(tu, fd, bytes, n)    A write of queued output to a client:
+ *                                    bytes written and messages gathered.
+ *
+ * The TU arguments are pointers, for matching up the probes of one call.
+ */
+#if !defined(PBX_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define PBX_PROBES_ENABLED
+#endif
+#endif
+
+#ifdef PBX_PROBES_ENABLED
+#define PBX_PROBE(name, ...) STAP_PROBEV(pbx, name, ##__VA_ARGS__)
+#else
+#define PBX_PROBE(name, ...) do { } while (0)
+#endif
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef PROTO_H
+#define PROTO_H
+
+#include <stdint.h>
+
+/*
+ * Binary framing of the client protocol.
+ *
+ * A connection starts out speaking the CRLF-terminated text protocol.  A
+ * client that sends the text command PROTO_BINARY_CMD switches its connection
+ * to binary framing, from the next byte after that line on, in both
+ * directions.  The server confirms the switch by sending the current state of
+ * the TU as a binary frame.
+ *
+ * Every frame starts with a fixed-size header, in network byte order:
+ *
+ *   op     (1 byte)  From the client, a TU_COMMAND (TU_PICKUP_CMD,
+ *                    TU_HANGUP_CMD, TU_DIAL_CMD or TU_CHAT_CMD), or
+ *                    PROTO_EXTENSION.  From the server, PROTO_STATE or
+ *                    PROTO_CHAT.
+ *   state  (1 byte)  In PROTO_STATE frames, the TU_STATE of the TU.
+ *                    Zero otherwise.
+ *   (2 bytes)        Reserved; zero.
+ *   arg    (4 bytes) For TU_DIAL_CMD, the extension to dial, and for
+ *                    PROTO_EXTENSION, the extension asked for.  For
+ *                    TU_CHAT_CMD and PROTO_CHAT, the length of the chat
+ *                    payload, which follows the header.  In PROTO_STATE
+ *                    frames, the TU's own extension for TU_ON_HOOK and the
+ *                    peer's for TU_CONNECTED.  Zero otherwise.
+ *
+ * Chat payloads are arbitrary bytes, up to PROTO_CHAT_MAX (defined in
+ * server.h) of them.  Longer chat frames are discarded.  A chat to a peer
+ * that speaks the text protocol has any CR, LF and NUL bytes in its payload
+ * replaced by spaces, so that it stays on its one CHAT line.
+ */
+#define PROTO_BINARY_CMD "proto binary"
+
+#define PROTO_STATE 0
+#define PROTO_CHAT 1
+
+/*
+ * Binary counterpart of the PBX_EXTENSION_CMD text command.
+ */
+#define PROTO_EXTENSION 4
+
+typedef struct proto_header {
+    uint8_t op;
+    uint8_t state;
+    uint16_t reserved;
+    uint32_t arg;
+} PROTO_HEADER;
+
+#define PROTO_HEADER_LEN ((int) sizeof(PROTO_HEADER))
+
+_Static_assert(sizeof(PROTO_HEADER) == 8, "Protocol header must be 8 bytes");
+
+#endif
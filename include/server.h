@@ -1,6 +1,14 @@
 #ifndef SERVER_H
 #define SERVER_H
 
+#include <stddef.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "tu.h"
+#include "proto.h"
+#include "worker.h"
+
 /*
  * Definitions of the commands that can be issued by a client.
  */
@@ -8,7 +16,8 @@ typedef enum tu_command {
     TU_PICKUP_CMD, TU_HANGUP_CMD, TU_DIAL_CMD, TU_CHAT_CMD,
     // Below are special values used in grading tests.
     TU_NO_CMD = 100, TU_CONNECT_CMD = 101, TU_DISCONNECT_CMD = 102,
-    TU_AWAIT_CMD = 103, TU_DELAY_CMD = 104, TU_EOF_CMD = 105
+    TU_AWAIT_CMD = 103, TU_DELAY_CMD = 104, TU_EOF_CMD = 105,
+    TU_SEND_CMD = 106, TU_EXPECT_CMD = 107
 } TU_COMMAND;
 
 /*
@@ -19,6 +28,14 @@ typedef enum tu_command {
  */
 extern char *tu_command_names[];
 
+/*
+ * Command with which a client asks for a specific extension number, as in
+ * "extension 1234".  If the number is free, the TU is moved to it and the
+ * client is notified as it was on registration; otherwise the client is sent
+ * its current state.
+ */
+#define PBX_EXTENSION_CMD "extension"
+
 /*
  * Thread function for the thread that handles a particular client.
  *
@@ -37,4 +54,80 @@ extern char *tu_command_names[];
  */
 void *pbx_client_service(void *arg);
 
+/*
+ * Longest command line, including its EOL sequence, that a client may send.
+ * Longer lines are discarded.
+ */
+#define PBX_LINE_MAX 2048
+#define PROTO_CHAT_MAX (PBX_LINE_MAX - PROTO_HEADER_LEN)
+
+/*
+ * Per-connection framing state for the client protocol.  Input is read
+ * directly into the free space at the end of the buffer; once every complete
+ * line (or, once the client has switched to the binary protocol described in
+ * proto.h, every complete frame) in it has been carried out, the trailing
+ * partial one is moved to the front, so the buffer never needs to grow and
+ * input that arrives split across reads is kept until the rest comes in.
+ * A binary frame always fits in the buffer, as chat payloads are limited to
+ * PROTO_CHAT_MAX bytes.
+ */
+typedef struct line_parser {
+    size_t len;      // Bytes of input held in the buffer.
+    size_t scan;     // Offset up to which the held input has been searched for EOL.
+    int discarding;  // Set while skipping the rest of an overlong line.
+    int binary;      // Set once the client has switched to binary framing.
+    size_t skip;     // Bytes still to be skipped of an oversized binary frame.
+    WORK_QUEUE *work;  // Commands waiting for the worker pool, if it is enabled.
+    char buf[PBX_LINE_MAX];
+} LINE_PARSER;
+
+/*
+ * Functions shared by the different ways of servicing client connections.
+ *
+ * pbx_client_attach() creates a TU for a newly accepted connection and
+ * registers it with the PBX, returning NULL (with the connection closed)
+ * on failure.
+ * pbx_client_dispatch() parses one command line (NUL-terminated, without
+ * the EOL sequence) and carries it out on behalf of the TU.
+ * pbx_client_space() returns where the next input for a connection should be
+ * placed, and how much room there is.
+ * pbx_client_frame() accounts for n bytes of input placed there and carries
+ * out, in order, every line that it completes (or, if the worker pool is
+ * enabled, hands the lines to it).
+ * pbx_client_serve() runs the sequential service loop of a connection:
+ * it reads input with the given function (read(2), or a replacement with the
+ * same contract that suspends only the caller) and frames it, until EOF.
+ * pbx_client_detach() unregisters the TU once its connection has seen EOF and
+ * the commands framed by its line parser (which may be NULL if it has not
+ * framed any) have been carried out.
+ */
+TU *pbx_client_attach(int connfd);
+void pbx_client_dispatch(TU *tu, char *line);
+char *pbx_client_space(LINE_PARSER *lp, size_t *room);
+void pbx_client_frame(TU *tu, LINE_PARSER *lp, size_t n);
+void pbx_client_serve(TU *tu, LINE_PARSER *lp, int fd, ssize_t (*rd)(int, void *, size_t));
+void pbx_client_detach(TU *tu, LINE_PARSER *lp);
+
+/*
+ * Admission control, applied by pbx_client_attach() in every mode.
+ *
+ * pbx_client_init() sets the most connections that may be attached at a time
+ * (PBX_MAX_EXTENSIONS if max_clients is not positive) and sets a descriptor
+ * aside to recover from descriptor exhaustion with.  Connections beyond the
+ * limit are sent "BUSY" and closed.
+ * pbx_client_accept() accepts a connection, riding out transient errors
+ * (such as a connection aborted before it was accepted, or running out of
+ * descriptors) rather than exiting as Accept() does.  It returns -1, with
+ * errno set, if the listening socket itself fails.
+ * pbx_client_accept_error() is called with the error when accepting a
+ * connection fails, by pbx_client_accept() or by modes that accept
+ * connections themselves.  It returns 0 if the error is transient, and -1
+ * if accepting should not be retried.
+ * pbx_client_stats() writes the admission statistics.
+ */
+void pbx_client_init(int max_clients);
+int pbx_client_accept(int listenfd);
+int pbx_client_accept_error(int err);
+void pbx_client_stats(FILE *out);
+
 #endif
@@ -0,0 +1,61 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+/*
+ * Fixed-size object pools.
+ *
+ * Each pool carves objects of one size out of large chunks obtained with
+ * mmap(2), so objects that are allocated and freed at a high rate (TUs,
+ * connection state, line buffers) stay off the general-purpose heap.
+ * Each thread keeps a small cache of free objects per pool and only takes
+ * the pool lock to move a batch of objects to or from the shared free list.
+ *
+ * Objects are aligned to at least 16 bytes.
+ */
+typedef struct slab_pool SLAB_POOL;
+
+/*
+ * Maximum number of pools that can be created.
+ */
+#define SLAB_MAX_POOLS 16
+
+/*
+ * If nonzero when a pool grows, its chunks are backed by huge pages when the
+ * system has them available (and transparent huge pages are requested
+ * otherwise).  Set from the -H option.
+ */
+extern int slab_hugepages;
+
+/*
+ * Create a pool of objects of the given size.
+ *
+ * @param name  Name of the pool, used in statistics.
+ * @param size  Size of each object.
+ * @return the new pool, or NULL if it could not be created.
+ */
+SLAB_POOL *slab_pool_create(char *name, size_t size);
+
+/*
+ * Allocate a zero-filled object from a pool.
+ *
+ * @return the object, or NULL if memory is exhausted.
+ */
+void *slab_alloc(SLAB_POOL *pool);
+
+/*
+ * Return an object to the pool it was allocated from.
+ */
+void slab_free(SLAB_POOL *pool, void *obj);
+
+/*
+ * Write the statistics of every pool: objects live (allocated and not yet
+ * freed), objects free (on the shared list or in thread caches), the
+ * high-water mark of live objects (sampled whenever a thread cache is
+ * refilled), and bytes reserved.
+ */
+void slab_stats(FILE *out);
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+
+/*
+ * Server statistics.
+ *
+ * Each module that keeps statistics provides a function that writes them to
+ * a stream, one "name{labels} value" metric per line.  stats_dump() collects
+ * the output of all of them.
+ */
+void stats_dump(FILE *out);
+
+/*
+ * Start a thread that writes the statistics to stderr whenever the server
+ * receives SIGUSR2, and the flight recorder (see flight.h) on SIGUSR1.  This
+ * must be called before any other threads are created, so that they all
+ * inherit the blocked signal mask.  The one exception is the log drain
+ * thread (see log.h), which log_init() starts first and which blocks every
+ * signal itself.
+ *
+ * @return 0 if successful, otherwise -1.
+ */
+int stats_signal_init(void);
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdio.h>
+
+/*
+ * Timers, kept in a hierarchical timing wheel driven by a single thread.
+ *
+ * Time advances in ticks of TIMER_TICK_MS.  A timer due within 256 ticks sits
+ * in one of 256 slots of the innermost wheel, one per tick; timers due later
+ * sit in one of the 64 slots of an outer wheel, each covering 64 times the
+ * span of a slot of the wheel inside it, and are moved inwards (cascaded)
+ * when the inner wheel comes round to them.  Arming and cancelling a timer
+ * are O(1) whatever the number of timers armed, and the timer thread only
+ * looks at the slots that are due.
+ *
+ * A TIMER is meant to be embedded in the object it belongs to.  Its function
+ * is called on the timer thread, without any lock held, once the timer has
+ * expired; by then the timer is no longer armed, so the function may arm it
+ * again.
+ */
+typedef struct timer {
+    struct timer *next;
+    struct timer **pprev;  // NULL while the timer is not armed.
+    unsigned long expires;
+    void (*fn)(struct timer *timer);
+} TIMER;
+
+#define TIMER_TICK_MS 10
+
+/*
+ * Start the timer thread.
+ *
+ * @return 0 if successful, otherwise -1.
+ */
+int timer_init(void);
+
+/*
+ * Arm a timer to expire after the given number of milliseconds (rounded up
+ * to a whole number of ticks, and capped at a little over a week), moving it
+ * if it is already armed.
+ *
+ * @param fn  The function to call when the timer expires.
+ * @return 1 if the timer was already armed, otherwise 0.
+ */
+int timer_arm(TIMER *timer, unsigned long ms, void (*fn)(TIMER *timer));
+
+/*
+ * Disarm a timer.  The timer's function may still be running (or about to
+ * run) on the timer thread if it had already expired.
+ *
+ * @return 1 if the timer was armed, otherwise 0.
+ */
+int timer_cancel(TIMER *timer);
+
+/*
+ * Milliseconds since the timer thread started, as of its latest tick.
+ * This is only a memory load, so it is cheap enough to call on every read.
+ */
+unsigned long timer_now(void);
+
+/*
+ * Write the timer statistics: timers armed, and timers that have expired or
+ * been moved to an inner wheel.
+ */
+void timer_stats(FILE *out);
+
+#endif
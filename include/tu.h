@@ -1,6 +1,8 @@
 #ifndef TU_H
 #define TU_H
 
+#include <stdio.h>
+
 /*
  * Structure types representing objects manipulated by the TU module.
  *
@@ -39,5 +41,103 @@ int tu_pickup(TU *tu);
 int tu_hangup(TU *tu);
 int tu_dial(TU *tu, TU *target);
 int tu_chat(TU *tu, char *msg);
+int tu_chat_bytes(TU *tu, char *msg, size_t len);
+void tu_set_binary(TU *tu);
+
+/*
+ * Notifications produced by the functions above are buffered.  Write out
+ * every notification produced so far by the calling thread.  This should be
+ * called after each batch of commands, and at least once before the thread
+ * exits.
+ */
+void tu_flush_pending(void);
+
+/*
+ * Output writes handed to an event loop.  A thread whose loop can submit
+ * writes and collect their completions, as a ring thread does, installs a
+ * submitter with tu_set_submitter(); the flushes it starts then hand each
+ * write to submit() rather than making it with sendmsg().  submit() is given
+ * the connection and the message to send on it, and returns 0 if the write
+ * was submitted, or -1 if it could not be, in which case the write is made
+ * directly.  Once the write completes, the loop passes the number of bytes
+ * written, or the negated error, to tu_send_done() with the handle that was
+ * given to submit(), on the same thread; the message stays valid until then.
+ * While a write is in flight, further output to the TU waits behind it.
+ */
+typedef struct tu_send TU_SEND;
+struct msghdr;
+
+void tu_set_submitter(int (*submit)(void *arg, int fd, struct msghdr *msg, TU_SEND *send),
+                      void *arg);
+void tu_send_done(TU_SEND *send, int res);
+
+/*
+ * Write statistics on the writes made by tu_flush_pending(): the number of
+ * flushes, writev() calls, messages and bytes, and a histogram of the number
+ * of messages gathered per flush.
+ */
+void tu_stats(FILE *out);
+
+/*
+ * Bound on the bytes queued for output to each client, and what to do with
+ * a message that would exceed it:
+ *   TU_OVERFLOW_DROP: chat messages are dropped; state notifications are
+ *     still queued.
+ *   TU_OVERFLOW_COALESCE: chat messages are dropped, and a state notification
+ *     replaces the state notifications still waiting to be written, as only
+ *     the most recent state matters to the client.
+ *   TU_OVERFLOW_DISCONNECT: the connection is shut down.
+ */
+typedef enum tu_overflow {
+    TU_OVERFLOW_DROP, TU_OVERFLOW_COALESCE, TU_OVERFLOW_DISCONNECT
+} TU_OVERFLOW;
+
+#define TU_DEFAULT_OUTPUT_LIMIT (64 * 1024)
+
+extern size_t tu_output_limit;
+extern TU_OVERFLOW tu_overflow_policy;
+
+/*
+ * If nonzero (the default), a chat message to a peer with no output waiting
+ * is written straight from the sender's input buffer, once the claims on the
+ * TUs have been released, rather than copied into the peer's outbound queue.
+ */
+extern int tu_relay_chat;
+
+/*
+ * Timeouts, in milliseconds, or 0 if disabled (the default):
+ *   tu_ring_timeout: a call not answered this long after it was dialed is
+ *     hung up, as if the caller had hung up.
+ *   tu_idle_timeout: a connection with no input for this long is shut down.
+ *   tu_keepalive_interval: a connection with no input for this long is sent
+ *     its current state, and again at this interval while it stays idle, so
+ *     that a dead connection is noticed.
+ * The timers are only run if timer_init() has been called.
+ */
+extern unsigned long tu_ring_timeout;
+extern unsigned long tu_idle_timeout;
+extern unsigned long tu_keepalive_interval;
+
+/*
+ * tu_watch() starts timing the inactivity of the connection of a TU, and
+ * tu_activity() records input on it.  tu_unwatch() stops all the timers of
+ * a TU, once its connection is being torn down.
+ */
+void tu_watch(TU *tu);
+void tu_activity(TU *tu);
+void tu_unwatch(TU *tu);
+
+/*
+ * Get the number of messages queued for output to the client of a TU,
+ * and set *bytes to their total size.
+ */
+int tu_queue_depth(TU *tu, size_t *bytes);
+
+/*
+ * In debug builds, write every TU that has not been freed, with the most
+ * recent changes to its reference count and the reasons given for them.
+ * Does nothing otherwise.
+ */
+void tu_dump_live(FILE *out);
 
 #endif
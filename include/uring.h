@@ -0,0 +1,28 @@
+#ifndef URING_H
+#define URING_H
+
+/*
+ * io_uring server mode.
+ *
+ * Each ring thread owns an io_uring instance on which it keeps a multishot
+ * accept armed on the listening socket and a multishot receive armed on each
+ * of its connections.  Received data lands in a ring of kernel-provided
+ * buffers, so a single submission covers every read on a connection.
+ * Commands are carried out through the same TU/PBX calls as the other modes,
+ * and the notifications they produce are sent by SENDMSG entries on the same
+ * ring, so the thread only enters the kernel once per batch of completions,
+ * to submit the sends of the batch and wait for the next one.
+ */
+
+/*
+ * Start a ring thread that accepts and services connections on a listening
+ * socket.  Several ring threads may share the same listening socket.
+ *
+ * @param listenfd  The listening socket.
+ * @param cpu  The CPU (modulo the number online) to pin the ring thread to,
+ * or -1 to leave it unpinned.
+ * @return 0 if the ring thread was started, otherwise -1.
+ */
+int uring_loop_start(int listenfd, int cpu);
+
+#endif
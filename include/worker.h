@@ -0,0 +1,73 @@
+#ifndef WORKER_H
+#define WORKER_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#include "tu.h"
+
+/*
+ * Worker pool for carrying out client commands.
+ *
+ * When the pool is enabled, the threads servicing connections only frame
+ * input: each command is copied into a job and appended to the work queue
+ * of its TU, and a fixed set of worker threads carry the jobs out.  A TU's
+ * work queue is scheduled on at most one worker at a time, and its jobs are
+ * run in the order they were submitted, so the commands of a TU are still
+ * carried out one at a time and in order.
+ *
+ * Each worker has a deque of the work queues that have jobs waiting.  A
+ * worker runs the queues in its own deque oldest first, and when that is
+ * empty it steals the newest queue from another worker's deque, so bursts of
+ * commands on a few connections still spread over every worker.
+ */
+
+/*
+ * Number of worker threads, or 0 (the default) if commands are carried out
+ * by the threads that frame them.  Set from the -w option.
+ */
+extern int worker_pool_size;
+
+/*
+ * Function that carries out a job on behalf of a TU, given a copy of the
+ * data submitted with it.
+ */
+typedef void (*WORK_FN)(TU *tu, char *data, size_t len);
+
+/*
+ * The queue of jobs submitted for one TU.  It is created by the first
+ * submission and freed once the job submitted by worker_finish() has run.
+ */
+typedef struct work_queue WORK_QUEUE;
+
+/*
+ * Start the worker threads.
+ *
+ * @param nworkers  The number of worker threads to run.
+ * @return 0 if the workers were started, otherwise -1.
+ */
+int worker_pool_init(int nworkers);
+
+/*
+ * Append a job to the work queue of a TU, creating the queue if *wqp is
+ * NULL.  Only one thread at a time may submit to a given queue.
+ *
+ * @param wqp  Where the caller keeps the work queue of the TU.
+ * @param fn  The function that carries out the job.
+ * @param data  Data to be copied into the job and passed to fn.
+ */
+void worker_submit(WORK_QUEUE **wqp, TU *tu, WORK_FN fn, char *data, size_t len);
+
+/*
+ * Append the last job to the work queue of a TU, after which the queue is
+ * freed.  If there is no queue, the job is run at once by the caller.
+ */
+void worker_finish(WORK_QUEUE **wqp, TU *tu, WORK_FN fn);
+
+/*
+ * Write the statistics of the worker pool: jobs run and queues stolen per
+ * worker, and the time jobs waited in their queues before they were run.
+ */
+void worker_stats(FILE *out);
+
+#endif
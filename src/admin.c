@@ -0,0 +1,209 @@
+/*
+ * Admin HTTP interface.
+ */
+#include <stdlib.h>
+#include <pthread.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+
+#include "csapp.h"
+#include "admin.h"
+#include "stats.h"
+#include "lockprof.h"
+#include "log.h"
+#include "flight.h"
+#include "debug.h"
+
+/*
+ * Longest request head that is read.  Anything after it is ignored.
+ */
+#define ADMIN_REQUEST_MAX 2048
+
+/*
+ * Seconds a client has to send its request before it is dropped, so that a
+ * stalled client cannot hold up the interface.
+ */
+#define ADMIN_TIMEOUT 2
+
+/*
+ * A handler writes the body of the response to the request for its path,
+ * given the query string (empty if there is none), and returns the HTTP
+ * status.
+ */
+typedef struct admin_route {
+    char *path;
+    int (*handler)(FILE *out, char *query);
+} ADMIN_ROUTE;
+
+static int serve_metrics(FILE *out, char *query) {
+    stats_dump(out);
+    return 200;
+}
+
+static int serve_locks(FILE *out, char *query) {
+    if (lockprof_stats(out) >= 0)
+        return 200;
+    fprintf(out, "Lock profiling is not built in; rebuild with make LOCK_PROFILE=1\n");
+    return 404;
+}
+
+static int serve_flight(FILE *out, char *query) {
+    flight_dump(out);
+    return 200;
+}
+
+/*
+ * Show the log level, after setting it if the query is "level=<name>".
+ */
+static int serve_loglevel(FILE *out, char *query) {
+    if (*query != '\0' && (strncmp(query, "level=", 6) || log_set_level(query + 6))) {
+        fprintf(out, "Expected level=debug|info|warn|error|off\n");
+        return 400;
+    }
+    fprintf(out, "%s\n", log_level_name());
+    return 200;
+}
+
+static ADMIN_ROUTE routes[] = {
+    { "/metrics", serve_metrics },
+    { "/locks", serve_locks },
+    { "/loglevel", serve_loglevel },
+    { "/flight", serve_flight },
+};
+
+static char *status_text(int status) {
+    switch (status) {
+        case 200: return "OK";
+        case 400: return "Bad Request";
+        case 404: return "Not Found";
+        case 405: return "Method Not Allowed";
+        default: return "Internal Server Error";
+    }
+}
+
+/*
+ * Read the head of a request, up to the blank line that ends it.
+ *
+ * @return the length read, or -1 if the client went away or timed out first.
+ */
+static ssize_t read_request(int fd, char *buf, size_t size) {
+    size_t len = 0;
+    while (len < size - 1) {
+        ssize_t n = read(fd, buf + len, size - 1 - len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        len += n;
+        buf[len] = '\0';
+        if (strstr(buf, "\r\n\r\n") != NULL || strstr(buf, "\n\n") != NULL)
+            break;
+    }
+    buf[len] = '\0';
+    return len;
+}
+
+/*
+ * Run the handler for a request line, writing its response body to out.
+ *
+ * @return the HTTP status.
+ */
+static int route(char *line, FILE *out) {
+    char *save;
+    char *method = strtok_r(line, " ", &save);
+    char *target = strtok_r(NULL, " \r\n", &save);
+    if (method == NULL || target == NULL)
+        return 400;
+    char *query = strchr(target, '?');
+    if (query != NULL)
+        *query++ = '\0';
+    else
+        query = "";
+    for (int i = 0; i < sizeof(routes) / sizeof(routes[0]); i++) {
+        if (strcmp(target, routes[i].path))
+            continue;
+        if (strcmp(method, "GET"))
+            return 405;
+        return routes[i].handler(out, query);
+    }
+    return 404;
+}
+
+/*
+ * Serve one request.  The body is produced in memory first, so that its
+ * length can be sent ahead of it.
+ */
+static void serve(int fd) {
+    char request[ADMIN_REQUEST_MAX];
+    struct timeval timeout = { .tv_sec = ADMIN_TIMEOUT };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    if (read_request(fd, request, sizeof(request)) < 0)
+        return;
+    char *body = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&body, &len);
+    if (out == NULL)
+        return;
+    int status = route(request, out);
+    if (status != 200)
+        fprintf(out, "%d %s\n", status, status_text(status));
+    fclose(out);
+    char head[256];
+    int n = snprintf(head, sizeof(head), "HTTP/1.0 %d %s\r\n"
+                     "Content-Type: text/plain; version=0.0.4\r\n"
+                     "Content-Length: %zu\r\n"
+                     "Connection: close\r\n\r\n", status, status_text(status), len);
+    if (send(fd, head, n, MSG_NOSIGNAL) == n)
+        send(fd, body, len, MSG_NOSIGNAL);
+    free(body);
+}
+
+static void *admin_thread(void *arg) {
+    int listenfd = (int) (long) arg;
+    while (1) {
+        int fd = accept(listenfd, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EINTR)
+                usleep(1000);
+            continue;
+        }
+        serve(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+int admin_init(char *addr) {
+    pthread_t tid;
+    char host[256] = ADMIN_DEFAULT_HOST;
+    char *port = strrchr(addr, ':');
+    if (port == NULL) {
+        port = addr;
+    }
+    else {
+        // Strip the brackets around an IPv6 address.
+        size_t len = port - addr;
+        char *start = addr;
+        if (len >= 2 && addr[0] == '[' && addr[len - 1] == ']') {
+            start++;
+            len -= 2;
+        }
+        if (len == 0 || len >= sizeof(host))
+            return -1;
+        memcpy(host, start, len);
+        host[len] = '\0';
+        port++;
+    }
+    int listenfd = open_listenfd_host(host, port);
+    if (listenfd < 0)
+        return -1;
+    if (pthread_create(&tid, NULL, admin_thread, (void *) (long) listenfd)) {
+        close(listenfd);
+        return -1;
+    }
+    pthread_detach(tid);
+    debug("Admin interface listening on %s port %s", host, port);
+    return 0;
+}
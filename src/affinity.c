@@ -0,0 +1,20 @@
+/*
+ * CPU affinity helpers.  Kept apart from the other modules because the
+ * affinity interfaces need _GNU_SOURCE, which conflicts with csapp.h.
+ */
+#define _GNU_SOURCE
+#include <sched.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "affinity.h"
+
+int pin_thread(pthread_t tid, int cpu) {
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpus <= 0)
+        return -1;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu % ncpus, &set);
+    return pthread_setaffinity_np(tid, sizeof(set), &set) ? -1 : 0;
+}
@@ -0,0 +1,236 @@
+/*
+ * Coroutine server mode: runs the sequential service loop of each connection
+ * as a coroutine, scheduled over a fixed set of threads using epoll.
+ */
+#include <stdlib.h>
+#include <pthread.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <ucontext.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include "pbx.h"
+#include "server.h"
+#include "coro.h"
+#include "slab.h"
+#include "debug.h"
+
+#define CORO_BATCH 64
+
+/*
+ * Number of reads a coroutine may do before it yields to the others on its
+ * scheduler, even if more input is waiting, so that a busy client cannot
+ * starve them.
+ */
+#define CORO_READ_BUDGET 16
+
+/*
+ * Number of freed stacks each scheduler keeps for reuse.
+ */
+#define CORO_STACK_CACHE 64
+
+typedef struct coro_sched CORO_SCHED;
+
+/*
+ * State kept for each connection serviced by a coroutine.  The stack is only
+ * allocated once the coroutine first runs, on its scheduler's thread.
+ */
+typedef struct coro {
+    int fd;
+    TU *tu;
+    CORO_SCHED *sched;
+    char *stack;
+    int done;
+    int reads;
+    ucontext_t ctx;
+    LINE_PARSER lines;
+} CORO;
+
+struct coro_sched {
+    int epfd;
+    pthread_t tid;
+    ucontext_t ctx;
+    int nstacks;
+    char *stacks[CORO_STACK_CACHE];
+};
+
+static SLAB_POOL *coro_pool;
+static pthread_once_t coro_pool_once = PTHREAD_ONCE_INIT;
+
+static void create_coro_pool(void) {
+    coro_pool = slab_pool_create("coro", sizeof(CORO));
+}
+
+static CORO_SCHED *scheds;
+static int num_scheds;
+static unsigned int next_sched;
+
+/*
+ * The coroutine running on this thread, if any.
+ */
+static __thread CORO *current;
+
+/*
+ * Get a stack for a coroutine, reusing one freed on the same scheduler if
+ * possible.  The lowest page of a new stack is left inaccessible, so that an
+ * overflow faults instead of overwriting whatever is mapped below it.
+ *
+ * @return the lowest address of the stack, or NULL if none could be mapped.
+ */
+static char *stack_get(CORO_SCHED *sched) {
+    if (sched->nstacks > 0)
+        return sched->stacks[--sched->nstacks];
+    char *stack = mmap(NULL, CORO_STACK_SIZE, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK | MAP_NORESERVE, -1, 0);
+    if (stack == MAP_FAILED)
+        return NULL;
+    mprotect(stack, sysconf(_SC_PAGESIZE), PROT_NONE);
+    return stack;
+}
+
+static void stack_put(CORO_SCHED *sched, char *stack) {
+    if (sched->nstacks < CORO_STACK_CACHE)
+        sched->stacks[sched->nstacks++] = stack;
+    else
+        munmap(stack, CORO_STACK_SIZE);
+}
+
+/*
+ * Suspend the running coroutine until its connection is readable.  The
+ * connection is rearmed before switching away; as only this thread waits on
+ * the scheduler's epoll instance, the event cannot be taken before the switch
+ * is complete.
+ */
+static void coro_park(CORO *co) {
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT, .data.ptr = co };
+    epoll_ctl(co->sched->epfd, EPOLL_CTL_MOD, co->fd, &ev);
+    co->reads = 0;
+    swapcontext(&co->ctx, &co->sched->ctx);
+}
+
+/*
+ * Replacement for read(2) used by the service loop of a coroutine.  It only
+ * ever blocks the calling coroutine, never the scheduler thread.
+ */
+static ssize_t coro_read(int fd, void *buf, size_t n) {
+    CORO *co = current;
+    if (co->reads >= CORO_READ_BUDGET)
+        coro_park(co);
+    while (1) {
+        ssize_t len = recv(fd, buf, n, MSG_DONTWAIT);
+        if (len >= 0) {
+            co->reads++;
+            return len;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            coro_park(co);
+        else if (errno != EINTR)
+            return -1;
+    }
+}
+
+/*
+ * Body of each coroutine.  When it returns, control passes back to the
+ * scheduler, which frees the stack it ran on.
+ */
+static void coro_main(void) {
+    CORO *co = current;
+    pbx_client_serve(co->tu, &co->lines, co->fd, coro_read);
+    epoll_ctl(co->sched->epfd, EPOLL_CTL_DEL, co->fd, NULL);
+    pbx_client_detach(co->tu, &co->lines);
+    co->done = 1;
+}
+
+/*
+ * Switch to a coroutine until it parks or finishes, first setting it up to
+ * run on a fresh stack if this is its first turn.
+ */
+static void coro_resume(CORO_SCHED *sched, CORO *co) {
+    if (co->stack == NULL) {
+        if ((co->stack = stack_get(sched)) == NULL) {
+            fprintf(stderr, "Failed to allocate coroutine stack\n");
+            epoll_ctl(sched->epfd, EPOLL_CTL_DEL, co->fd, NULL);
+            pbx_client_detach(co->tu, &co->lines);
+            slab_free(coro_pool, co);
+            return;
+        }
+        getcontext(&co->ctx);
+        co->ctx.uc_stack.ss_sp = co->stack;
+        co->ctx.uc_stack.ss_size = CORO_STACK_SIZE;
+        co->ctx.uc_link = &sched->ctx;
+        makecontext(&co->ctx, coro_main, 0);
+    }
+    current = co;
+    swapcontext(&sched->ctx, &co->ctx);
+    current = NULL;
+    if (co->done) {
+        stack_put(sched, co->stack);
+        slab_free(coro_pool, co);
+    }
+}
+
+static void *coro_sched_thread(void *arg) {
+    CORO_SCHED *sched = arg;
+    struct epoll_event events[CORO_BATCH];
+    while (1) {
+        int n = epoll_wait(sched->epfd, events, CORO_BATCH, -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "epoll_wait failed: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < n; i++)
+            coro_resume(sched, events[i].data.ptr);
+    }
+    return NULL;
+}
+
+/*
+ * Start the scheduler threads.
+ */
+int coro_init(int nthreads) {
+    scheds = calloc(nthreads, sizeof(CORO_SCHED));
+    if (scheds == NULL)
+        return -1;
+    for (int i = 0; i < nthreads; i++) {
+        if ((scheds[i].epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+            return -1;
+        if (pthread_create(&scheds[i].tid, NULL, coro_sched_thread, &scheds[i]) != 0)
+            return -1;
+        pthread_detach(scheds[i].tid);
+    }
+    num_scheds = nthreads;
+    debug("Started %d coroutine schedulers", nthreads);
+    return 0;
+}
+
+/*
+ * Register a new connection with the PBX and hand it to a scheduler, chosen
+ * round-robin.  The coroutine gets its first turn once the connection has
+ * input.
+ */
+int coro_add(int connfd) {
+    pthread_once(&coro_pool_once, create_coro_pool);
+    CORO *co = coro_pool ? slab_alloc(coro_pool) : NULL;
+    if (co == NULL) {
+        close(connfd);
+        return -1;
+    }
+    co->fd = connfd;
+    if ((co->tu = pbx_client_attach(connfd)) == NULL) {
+        slab_free(coro_pool, co);
+        return -1;
+    }
+    co->sched = &scheds[__atomic_fetch_add(&next_sched, 1, __ATOMIC_RELAXED) % num_scheds];
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT, .data.ptr = co };
+    if (epoll_ctl(co->sched->epfd, EPOLL_CTL_ADD, connfd, &ev) < 0) {
+        pbx_client_detach(co->tu, &co->lines);
+        slab_free(coro_pool, co);
+        return -1;
+    }
+    return 0;
+}
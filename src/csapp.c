@@ -720,6 +720,12 @@ void Pthread_once(pthread_once_t *once_control, void (*init_function)()) {
  * Wrappers for Posix semaphores
  *******************************/
 
+/* The profiling versions in lockprof.c are built on these */
+#undef Sem_init
+#undef P
+#undef V
+#undef Sem_trywait
+
 void Sem_init(sem_t *sem, int pshared, unsigned int value) 
 {
     if (sem_init(sem, pshared, value) < 0)
@@ -738,6 +744,12 @@ void V(sem_t *sem)
 	unix_error("V error");
 }
 
+/* Returns 0 if the semaphore was decremented, -1 if it would have blocked */
+int Sem_trywait(sem_t *sem) 
+{
+    return sem_trywait(sem) == 0 ? 0 : -1;
+}
+
 /****************************************
  * The Rio package - Robust I/O functions
  ****************************************/
@@ -994,7 +1006,7 @@ int open_clientfd(char *hostname, char *port) {
  *       -1 with errno set for other errors.
  */
 /* $begin open_listenfd */
-int open_listenfd(char *port) 
+static int open_listenfd_opt(char *host, char *port, int reuseport)
 {
     struct addrinfo hints, *listp, *p;
     int listenfd, rc, optval=1;
@@ -1002,9 +1014,10 @@ int open_listenfd(char *port)
     /* Get a list of potential server addresses */
     memset(&hints, 0, sizeof(struct addrinfo));
     hints.ai_socktype = SOCK_STREAM;             /* Accept connections */
-    hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG; /* ... on any IP address */
+    if (host == NULL)
+        hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG; /* ... on any IP address */
     hints.ai_flags |= AI_NUMERICSERV;            /* ... using port number */
-    if ((rc = getaddrinfo(NULL, port, &hints, &listp)) != 0) {
+    if ((rc = getaddrinfo(host, port, &hints, &listp)) != 0) {
         fprintf(stderr, "getaddrinfo failed (port %s): %s\n", port, gai_strerror(rc));
         return -2;
     }
@@ -1019,6 +1032,13 @@ int open_listenfd(char *port)
         setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR,    //line:netp:csapp:setsockopt
                    (const void *)&optval , sizeof(int));
 
+        /* Let several sockets bind the same port, load-balanced by the kernel */
+        if (reuseport && setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT,
+                                    (const void *)&optval, sizeof(int)) < 0) {
+            close(listenfd);
+            continue;
+        }
+
         /* Bind the descriptor to the address */
         if (bind(listenfd, p->ai_addr, p->ai_addrlen) == 0)
             break; /* Success */
@@ -1041,6 +1061,30 @@ int open_listenfd(char *port)
     }
     return listenfd;
 }
+
+int open_listenfd(char *port)
+{
+    return open_listenfd_opt(NULL, port, 0);
+}
+
+/*
+ * open_listenfd_host - Like open_listenfd, but listening only on the given
+ *     address (which may be a host name) rather than on every interface.
+ */
+int open_listenfd_host(char *host, char *port)
+{
+    return open_listenfd_opt(host, port, 0);
+}
+
+/*
+ * open_listenfd_reuseport - Like open_listenfd, but with SO_REUSEPORT set
+ *     so that several listening sockets can share the port, with the
+ *     kernel distributing incoming connections among them.
+ */
+int open_listenfd_reuseport(char *port)
+{
+    return open_listenfd_opt(NULL, port, 1);
+}
 /* $end open_listenfd */
 
 /****************************************************
@@ -1064,6 +1108,15 @@ int Open_listenfd(char *port)
     return rc;
 }
 
+int Open_listenfd_reuseport(char *port)
+{
+    int rc;
+
+    if ((rc = open_listenfd_reuseport(port)) < 0)
+	unix_error("Open_listenfd_reuseport error");
+    return rc;
+}
+
 /* $end csapp.c */
 
 
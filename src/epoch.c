@@ -0,0 +1,92 @@
+/*
+ * Epoch-based protection for read-mostly data.
+ */
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "epoch.h"
+#include "debug.h"
+
+/*
+ * Per-thread reader record.  The sequence number is odd while the thread is
+ * inside a read-side critical section.  Records are never freed: when a
+ * thread exits its record is released for reuse by a later thread.
+ */
+typedef struct epoch_record {
+    unsigned long seq;
+    int in_use;
+    struct epoch_record *next;
+} __attribute__((aligned(64))) EPOCH_RECORD;
+
+static EPOCH_RECORD *records;
+static pthread_mutex_t records_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t record_key;
+static pthread_once_t record_once = PTHREAD_ONCE_INIT;
+static __thread EPOCH_RECORD *my_record;
+
+static void release_record(void *arg) {
+    EPOCH_RECORD *rec = arg;
+    __atomic_store_n(&rec->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void make_key(void) {
+    pthread_key_create(&record_key, release_record);
+}
+
+/*
+ * Find a free record, or add a new one, for the calling thread.
+ */
+static EPOCH_RECORD *acquire_record(void) {
+    pthread_once(&record_once, make_key);
+    EPOCH_RECORD *rec;
+    for (rec = __atomic_load_n(&records, __ATOMIC_ACQUIRE); rec != NULL; rec = rec->next) {
+        int expected = 0;
+        if (__atomic_compare_exchange_n(&rec->in_use, &expected, 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+    }
+    if (rec == NULL) {
+        if ((rec = calloc(1, sizeof(EPOCH_RECORD))) == NULL) {
+            fprintf(stderr, "Failed to allocate epoch record\n");
+            abort();
+        }
+        rec->in_use = 1;
+        pthread_mutex_lock(&records_lock);
+        rec->next = records;
+        __atomic_store_n(&records, rec, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&records_lock);
+    }
+    pthread_setspecific(record_key, rec);
+    return rec;
+}
+
+void epoch_enter(void) {
+    EPOCH_RECORD *rec = my_record;
+    if (rec == NULL)
+        rec = my_record = acquire_record();
+    // Sequentially consistent so that the loads that follow cannot be
+    // reordered before the record is seen to be active.
+    __atomic_store_n(&rec->seq, rec->seq + 1, __ATOMIC_SEQ_CST);
+}
+
+void epoch_exit(void) {
+    EPOCH_RECORD *rec = my_record;
+    __atomic_store_n(&rec->seq, rec->seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Wait for every reader that was inside a critical section when this was
+ * called to leave it.  Readers that enter afterwards see the writer's prior
+ * updates and need not be waited for.
+ */
+void epoch_synchronize(void) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (EPOCH_RECORD *rec = __atomic_load_n(&records, __ATOMIC_ACQUIRE); rec != NULL; rec = rec->next) {
+        unsigned long seq = __atomic_load_n(&rec->seq, __ATOMIC_SEQ_CST);
+        if (!(seq & 1))
+            continue;
+        while (__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) == seq)
+            sched_yield();
+    }
+}
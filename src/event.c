@@ -0,0 +1,136 @@
+/*
+ * Event-loop server mode: multiplexes client connections over a fixed set of
+ * threads using epoll.
+ */
+#include <stdlib.h>
+#include <pthread.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "pbx.h"
+#include "server.h"
+#include "event.h"
+#include "slab.h"
+#include "debug.h"
+
+#define EVENT_BATCH 64
+
+/*
+ * State kept for each connection serviced by an event loop.  Input that does
+ * not yet form a complete line is kept in the buffer until more arrives.
+ */
+typedef struct conn {
+    int fd;
+    TU *tu;
+    LINE_PARSER lines;
+} CONN;
+
+static SLAB_POOL *conn_pool;
+static pthread_once_t conn_pool_once = PTHREAD_ONCE_INIT;
+
+static void create_conn_pool(void) {
+    conn_pool = slab_pool_create("conn", sizeof(CONN));
+}
+
+typedef struct event_loop {
+    int epfd;
+    pthread_t tid;
+} EVENT_LOOP;
+
+static EVENT_LOOP *loops;
+static int num_loops;
+static unsigned int next_loop;
+
+static void conn_close(EVENT_LOOP *loop, CONN *conn) {
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    pbx_client_detach(conn->tu, &conn->lines);
+    slab_free(conn_pool, conn);
+}
+
+/*
+ * Read whatever is available on a connection that epoll reported readable.
+ * Only one read is done per event so that a busy client cannot starve the
+ * other connections on the same loop.
+ *
+ * @return 0 if the connection remains open, -1 if it has seen EOF or an error.
+ */
+static int conn_readable(CONN *conn) {
+    size_t room;
+    char *space = pbx_client_space(&conn->lines, &room);
+    ssize_t n = recv(conn->fd, space, room, MSG_DONTWAIT);
+    if (n < 0)
+        return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+    if (n == 0)
+        return -1;
+    pbx_client_frame(conn->tu, &conn->lines, n);
+    return 0;
+}
+
+static void *event_loop_thread(void *arg) {
+    EVENT_LOOP *loop = arg;
+    struct epoll_event events[EVENT_BATCH];
+    while (1) {
+        int n = epoll_wait(loop->epfd, events, EVENT_BATCH, -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "epoll_wait failed: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < n; i++) {
+            CONN *conn = events[i].data.ptr;
+            if (conn_readable(conn))
+                conn_close(loop, conn);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Start the event-loop threads.
+ */
+int event_loop_init(int nloops) {
+    if (nloops <= 0)
+        nloops = EVENT_DEFAULT_LOOPS;
+    loops = calloc(nloops, sizeof(EVENT_LOOP));
+    if (loops == NULL)
+        return -1;
+    for (int i = 0; i < nloops; i++) {
+        if ((loops[i].epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+            return -1;
+        if (pthread_create(&loops[i].tid, NULL, event_loop_thread, &loops[i]) != 0)
+            return -1;
+        pthread_detach(loops[i].tid);
+    }
+    num_loops = nloops;
+    debug("Started %d event loops", nloops);
+    return 0;
+}
+
+/*
+ * Register a new connection with the PBX and add it to an event loop,
+ * choosing loops round-robin.
+ */
+int event_loop_add(int connfd) {
+    pthread_once(&conn_pool_once, create_conn_pool);
+    CONN *conn = conn_pool ? slab_alloc(conn_pool) : NULL;
+    if (conn == NULL) {
+        close(connfd);
+        return -1;
+    }
+    conn->fd = connfd;
+    if ((conn->tu = pbx_client_attach(connfd)) == NULL) {
+        slab_free(conn_pool, conn);
+        return -1;
+    }
+    EVENT_LOOP *loop = &loops[__atomic_fetch_add(&next_loop, 1, __ATOMIC_RELAXED) % num_loops];
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP, .data.ptr = conn };
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, connfd, &ev) < 0) {
+        pbx_client_detach(conn->tu, &conn->lines);
+        slab_free(conn_pool, conn);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,215 @@
+/*
+ * Extension number allocator.
+ */
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "ext.h"
+#include "pbx.h"
+#include "debug.h"
+
+/*
+ * Largest range of extension numbers that can be configured.
+ */
+#define EXT_MAX_RANGE (1 << 24)
+
+#define WORD_BITS 64
+
+/*
+ * A number given back, and when its quarantine ends.
+ */
+typedef struct quarantined {
+    int ext;
+    unsigned long until;
+} QUARANTINED;
+
+static pthread_mutex_t ext_lock = PTHREAD_MUTEX_INITIALIZER;
+static int ext_first = EXT_DEFAULT_FIRST;
+static int ext_count = PBX_MAX_EXTENSIONS;
+static unsigned long quarantine_ms = EXT_DEFAULT_QUARANTINE_MS;
+
+/*
+ * One bit per number in the range, set while it is assigned or in
+ * quarantine.  The bits past the end of the range are always set.  No word
+ * below the hint has a clear bit.
+ */
+static unsigned long *bitmap;
+static int nwords;
+static int hint;
+
+/*
+ * Numbers in quarantine, oldest first, kept as a ring.  A number's bit stays
+ * set while it is in quarantine, so it cannot be in the ring twice, and the
+ * ring never holds more than the size of the range.
+ */
+static QUARANTINED *quarantine;
+static int q_first;
+static int q_len;
+
+static int assigned;
+static unsigned long released_early;
+static unsigned long exhausted;
+static unsigned long conflicts;
+
+static unsigned long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Allocate the bitmap and quarantine ring for the configured range.  The
+ * caller must hold the lock.
+ */
+static int setup(void) {
+    nwords = (ext_count + WORD_BITS - 1) / WORD_BITS;
+    bitmap = calloc(nwords, sizeof(unsigned long));
+    quarantine = malloc(ext_count * sizeof(QUARANTINED));
+    if (bitmap == NULL || quarantine == NULL) {
+        free(bitmap);
+        free(quarantine);
+        bitmap = NULL;
+        quarantine = NULL;
+        return -1;
+    }
+    if (ext_count % WORD_BITS)
+        bitmap[nwords - 1] = ~0UL << (ext_count % WORD_BITS);
+    return 0;
+}
+
+static void release(int ext) {
+    int i = ext - ext_first;
+    bitmap[i / WORD_BITS] &= ~(1UL << (i % WORD_BITS));
+    if (i / WORD_BITS < hint)
+        hint = i / WORD_BITS;
+}
+
+/*
+ * Release the numbers at the head of the quarantine ring whose time is up.
+ * The caller must hold the lock.
+ */
+static void expire(unsigned long now) {
+    while (q_len > 0 && quarantine[q_first].until <= now) {
+        release(quarantine[q_first].ext);
+        q_first = (q_first + 1) % ext_count;
+        q_len--;
+    }
+}
+
+int ext_init(int first, int last, unsigned long quarantine) {
+    if (first < 0 || last < first || (long) last - first >= EXT_MAX_RANGE)
+        return -1;
+    pthread_mutex_lock(&ext_lock);
+    if (bitmap != NULL) {
+        pthread_mutex_unlock(&ext_lock);
+        return -1;
+    }
+    ext_first = first;
+    ext_count = last - first + 1;
+    quarantine_ms = quarantine;
+    int ret = setup();
+    pthread_mutex_unlock(&ext_lock);
+    return ret;
+}
+
+int ext_base(void) {
+    return ext_first;
+}
+
+int ext_alloc(void) {
+    pthread_mutex_lock(&ext_lock);
+    if (bitmap == NULL && setup()) {
+        pthread_mutex_unlock(&ext_lock);
+        return -1;
+    }
+    expire(now_ms());
+    while (hint < nwords && bitmap[hint] == ~0UL)
+        hint++;
+    if (hint == nwords && q_len > 0) {
+        // Rather than turn the client away, cut short the quarantine of the
+        // number that has been in it longest.
+        release(quarantine[q_first].ext);
+        q_first = (q_first + 1) % ext_count;
+        q_len--;
+        released_early++;
+    }
+    if (hint == nwords) {
+        exhausted++;
+        pthread_mutex_unlock(&ext_lock);
+        return -1;
+    }
+    int bit = __builtin_ctzl(~bitmap[hint]);
+    bitmap[hint] |= 1UL << bit;
+    assigned++;
+    int ext = ext_first + hint * WORD_BITS + bit;
+    pthread_mutex_unlock(&ext_lock);
+    return ext;
+}
+
+int ext_claim(int ext) {
+    pthread_mutex_lock(&ext_lock);
+    if (bitmap == NULL && setup()) {
+        pthread_mutex_unlock(&ext_lock);
+        return -1;
+    }
+    if (ext < ext_first || ext - ext_first >= ext_count) {
+        pthread_mutex_unlock(&ext_lock);
+        return -1;
+    }
+    expire(now_ms());
+    int i = ext - ext_first;
+    unsigned long mask = 1UL << (i % WORD_BITS);
+    if (bitmap[i / WORD_BITS] & mask) {
+        conflicts++;
+        pthread_mutex_unlock(&ext_lock);
+        debug("Extension %d is not available", ext);
+        return -1;
+    }
+    bitmap[i / WORD_BITS] |= mask;
+    assigned++;
+    pthread_mutex_unlock(&ext_lock);
+    return 0;
+}
+
+void ext_free(int ext) {
+    pthread_mutex_lock(&ext_lock);
+    if (bitmap == NULL || ext < ext_first || ext - ext_first >= ext_count) {
+        pthread_mutex_unlock(&ext_lock);
+        return;
+    }
+    assigned--;
+    if (quarantine_ms == 0) {
+        release(ext);
+    }
+    else {
+        QUARANTINED *q = &quarantine[(q_first + q_len++) % ext_count];
+        q->ext = ext;
+        q->until = now_ms() + quarantine_ms;
+    }
+    pthread_mutex_unlock(&ext_lock);
+}
+
+void ext_unclaim(int ext) {
+    pthread_mutex_lock(&ext_lock);
+    if (bitmap == NULL || ext < ext_first || ext - ext_first >= ext_count) {
+        pthread_mutex_unlock(&ext_lock);
+        return;
+    }
+    assigned--;
+    release(ext);
+    pthread_mutex_unlock(&ext_lock);
+}
+
+void ext_stats(FILE *out) {
+    pthread_mutex_lock(&ext_lock);
+    int a = assigned, q = q_len;
+    unsigned long r = released_early, e = exhausted, c = conflicts;
+    pthread_mutex_unlock(&ext_lock);
+    fprintf(out, "ext_range %d\n", ext_count);
+    fprintf(out, "ext_assigned %d\n", a);
+    fprintf(out, "ext_quarantined %d\n", q);
+    fprintf(out, "ext_released_early %lu\n", r);
+    fprintf(out, "ext_exhausted %lu\n", e);
+    fprintf(out, "ext_claim_conflicts %lu\n", c);
+}
@@ -0,0 +1,98 @@
+/*
+ * Flight recorder of TU events.
+ */
+#include <stdlib.h>
+#include <time.h>
+
+#include "flight.h"
+#include "debug.h"
+
+_Static_assert((FLIGHT_EVENTS & (FLIGHT_EVENTS - 1)) == 0, "FLIGHT_EVENTS must be a power of two");
+
+/*
+ * A slot in the ring.  seq is 0 while the slot is being written, and
+ * otherwise one more than the number of the event in it.  Every field is
+ * read and written with atomic operations, as a reader may copy the slot
+ * while a writer is filling it in.
+ */
+typedef struct flight_event {
+    unsigned long seq;
+    long ms;
+    TU *tu;
+    TU *peer;
+    int ext;
+    int peer_ext;
+    signed char op;
+    signed char old;
+    signed char new;
+} FLIGHT_EVENT;
+
+static FLIGHT_EVENT ring[FLIGHT_EVENTS];
+static unsigned long next_event;
+
+static char *op_names[] = {
+    [FLIGHT_REGISTER] "register",
+    [FLIGHT_UNREGISTER] "unregister",
+    [FLIGHT_DIAL] "dial",
+    [FLIGHT_PICKUP] "pickup",
+    [FLIGHT_HANGUP] "hangup",
+    [FLIGHT_RING_TIMEOUT] "ring_timeout",
+    [FLIGHT_CHAT] "chat"
+};
+
+#define STORE(field, value) __atomic_store_n(&(field), (value), __ATOMIC_RELAXED)
+#define LOAD(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+void flight_record(FLIGHT_OP op, TU *tu, int ext, int old, int new, TU *peer, int peer_ext) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    unsigned long n = __atomic_fetch_add(&next_event, 1, __ATOMIC_RELAXED);
+    FLIGHT_EVENT *event = &ring[n & (FLIGHT_EVENTS - 1)];
+    STORE(event->seq, 0);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    STORE(event->ms, ts.tv_sec * 1000L + ts.tv_nsec / 1000000);
+    STORE(event->tu, tu);
+    STORE(event->peer, peer);
+    STORE(event->ext, ext);
+    STORE(event->peer_ext, peer_ext);
+    STORE(event->op, op);
+    STORE(event->old, old);
+    STORE(event->new, new);
+    __atomic_store_n(&event->seq, n + 1, __ATOMIC_RELEASE);
+}
+
+static char *state_name(int state) {
+    return state == FLIGHT_NO_STATE ? "-" : tu_state_names[state];
+}
+
+/*
+ * Events still being written when the ring is read, or overwritten while it
+ * is, are left out.
+ */
+int flight_dump(FILE *out) {
+    unsigned long end = __atomic_load_n(&next_event, __ATOMIC_RELAXED);
+    unsigned long n = end > FLIGHT_EVENTS ? end - FLIGHT_EVENTS : 0;
+    int count = 0;
+    for (; n < end; n++) {
+        FLIGHT_EVENT *slot = &ring[n & (FLIGHT_EVENTS - 1)];
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != n + 1)
+            continue;
+        FLIGHT_EVENT event = {
+            .ms = LOAD(slot->ms), .tu = LOAD(slot->tu), .peer = LOAD(slot->peer),
+            .ext = LOAD(slot->ext), .peer_ext = LOAD(slot->peer_ext),
+            .op = LOAD(slot->op), .old = LOAD(slot->old), .new = LOAD(slot->new)
+        };
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (LOAD(slot->seq) != n + 1)
+            continue;
+        fprintf(out, "%lu %ld.%03ld op=%s ext=%d tu=%p old=\"%s\" new=\"%s\"", n,
+                event.ms / 1000, event.ms % 1000, op_names[(int) event.op], event.ext,
+                (void *) event.tu, state_name(event.old), state_name(event.new));
+        if (event.peer != NULL)
+            fprintf(out, " peer=%d peer_tu=%p", event.peer_ext, (void *) event.peer);
+        fprintf(out, "\n");
+        count++;
+    }
+    fflush(out);
+    return count;
+}
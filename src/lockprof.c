@@ -0,0 +1,195 @@
+/*
+ * Lock contention profiler.
+ */
+#include <stdlib.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#include "csapp.h"
+#include "lockprof.h"
+
+#ifdef LOCK_PROFILE
+
+#define LOCK_CLASSES_MAX 32
+#define LOCK_NAME_MAX 48
+
+/*
+ * Most locks a thread can hold at once and still have their hold times
+ * recorded.
+ */
+#define LOCK_HELD_MAX 8
+
+typedef struct lock_class {
+    char name[LOCK_NAME_MAX];
+    int signal;  // Set if the semaphore is not a lock.
+    unsigned long acquisitions;
+    unsigned long contended;
+    unsigned long wait_ns;
+    unsigned long wait_max_ns;
+    unsigned long hold_ns;
+    unsigned long hold_max_ns;
+} LOCK_CLASS;
+
+typedef struct held_lock {
+    sem_t *sem;
+    LOCK_CLASS *cls;
+    long since;
+} HELD_LOCK;
+
+static LOCK_CLASS classes[LOCK_CLASSES_MAX];
+static int nclasses;
+static pthread_mutex_t classes_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread HELD_LOCK held[LOCK_HELD_MAX];
+static __thread int nheld;
+
+static long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static void add(unsigned long *counter, unsigned long n) {
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+static void raise_max(unsigned long *max, unsigned long n) {
+    unsigned long old = __atomic_load_n(max, __ATOMIC_RELAXED);
+    while (n > old && !__atomic_compare_exchange_n(max, &old, n, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/*
+ * Name the class of a call site: the base name of its file, then the member
+ * its semaphore expression ends in.
+ */
+static void class_name(LOCK_SITE *site, char *buf, size_t size) {
+    const char *file = strrchr(site->file, '/');
+    file = file != NULL ? file + 1 : site->file;
+    int len = strcspn(file, ".");
+    const char *member = site->expr;
+    for (const char *p = site->expr; *p != '\0'; p++) {
+        if (*p == '&' || *p == '.' || *p == ' ')
+            member = p + 1;
+        else if (*p == '-' && p[1] == '>')
+            member = p + 2;
+    }
+    snprintf(buf, size, "%.*s->%s", len, file, member);
+}
+
+/*
+ * Find the class of a call site, adding it if it is new.
+ *
+ * @return the class, or NULL if there is no room for another.
+ */
+static LOCK_CLASS *resolve(LOCK_SITE *site) {
+    LOCK_CLASS *cls = __atomic_load_n(&site->cls, __ATOMIC_ACQUIRE);
+    if (cls != NULL)
+        return cls;
+    char name[LOCK_NAME_MAX];
+    class_name(site, name, sizeof(name));
+    pthread_mutex_lock(&classes_lock);
+    for (int i = 0; i < nclasses && cls == NULL; i++) {
+        if (!strcmp(classes[i].name, name))
+            cls = &classes[i];
+    }
+    if (cls == NULL && nclasses < LOCK_CLASSES_MAX) {
+        cls = &classes[nclasses];
+        strcpy(cls->name, name);
+        __atomic_store_n(&nclasses, nclasses + 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&classes_lock);
+    if (cls != NULL)
+        __atomic_store_n(&site->cls, cls, __ATOMIC_RELEASE);
+    return cls;
+}
+
+static void acquired(sem_t *sem, LOCK_CLASS *cls) {
+    if (cls == NULL)
+        return;
+    add(&cls->acquisitions, 1);
+    if (!__atomic_load_n(&cls->signal, __ATOMIC_RELAXED) && nheld < LOCK_HELD_MAX)
+        held[nheld++] = (HELD_LOCK) { sem, cls, now_ns() };
+}
+
+void lockprof_init(sem_t *sem, int pshared, unsigned int value, LOCK_SITE *site) {
+    LOCK_CLASS *cls = resolve(site);
+    if (cls != NULL && value != 1)
+        __atomic_store_n(&cls->signal, 1, __ATOMIC_RELAXED);
+    if (sem_init(sem, pshared, value) < 0)
+        unix_error("Sem_init error");
+}
+
+void lockprof_P(sem_t *sem, LOCK_SITE *site) {
+    LOCK_CLASS *cls = resolve(site);
+    if (sem_trywait(sem) < 0) {
+        long start = now_ns();
+        if (sem_wait(sem) < 0)
+            unix_error("P error");
+        if (cls != NULL) {
+            unsigned long wait = now_ns() - start;
+            add(&cls->contended, 1);
+            add(&cls->wait_ns, wait);
+            raise_max(&cls->wait_max_ns, wait);
+        }
+    }
+    acquired(sem, cls);
+}
+
+int lockprof_trywait(sem_t *sem, LOCK_SITE *site) {
+    if (sem_trywait(sem) < 0)
+        return -1;
+    acquired(sem, resolve(site));
+    return 0;
+}
+
+/*
+ * Release a semaphore, recording the hold time if the calling thread took it
+ * as a lock.  The most recent acquisition of the semaphore is the one
+ * released.
+ */
+void lockprof_V(sem_t *sem, LOCK_SITE *site) {
+    for (int i = nheld - 1; i >= 0; i--) {
+        if (held[i].sem != sem)
+            continue;
+        unsigned long hold = now_ns() - held[i].since;
+        add(&held[i].cls->hold_ns, hold);
+        raise_max(&held[i].cls->hold_max_ns, hold);
+        memmove(&held[i], &held[i + 1], (nheld - i - 1) * sizeof(HELD_LOCK));
+        nheld--;
+        break;
+    }
+    if (sem_post(sem) < 0)
+        unix_error("V error");
+}
+
+int lockprof_stats(FILE *out) {
+    int n = __atomic_load_n(&nclasses, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < n; i++) {
+        LOCK_CLASS *cls = &classes[i];
+        fprintf(out, "lock_acquisitions{lock=\"%s\"} %lu\n", cls->name,
+                __atomic_load_n(&cls->acquisitions, __ATOMIC_RELAXED));
+        fprintf(out, "lock_contended{lock=\"%s\"} %lu\n", cls->name,
+                __atomic_load_n(&cls->contended, __ATOMIC_RELAXED));
+        fprintf(out, "lock_wait_ns_sum{lock=\"%s\"} %lu\n", cls->name,
+                __atomic_load_n(&cls->wait_ns, __ATOMIC_RELAXED));
+        fprintf(out, "lock_wait_ns_max{lock=\"%s\"} %lu\n", cls->name,
+                __atomic_load_n(&cls->wait_max_ns, __ATOMIC_RELAXED));
+        if (__atomic_load_n(&cls->signal, __ATOMIC_RELAXED))
+            continue;
+        fprintf(out, "lock_hold_ns_sum{lock=\"%s\"} %lu\n", cls->name,
+                __atomic_load_n(&cls->hold_ns, __ATOMIC_RELAXED));
+        fprintf(out, "lock_hold_ns_max{lock=\"%s\"} %lu\n", cls->name,
+                __atomic_load_n(&cls->hold_max_ns, __ATOMIC_RELAXED));
+    }
+    return n;
+}
+
+#else
+
+int lockprof_stats(FILE *out) {
+    return -1;
+}
+
+#endif
@@ -0,0 +1,443 @@
+/*
+ * Asynchronous logging.
+ */
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+
+#include "log.h"
+#include "debug.h"
+
+/*
+ * Size of each thread's ring, in bytes (a power of two).
+ */
+#define LOG_RING_SIZE (16 * 1024)
+
+/*
+ * Largest record, and longest line written for one.
+ */
+#define LOG_RECORD_MAX 1024
+#define LOG_LINE_MAX 2048
+
+/*
+ * Time the drain thread sleeps when it finds no records waiting.
+ */
+#define LOG_DRAIN_INTERVAL_NS 1000000L
+
+#if defined(DEBUG)
+int log_level = LOG_DEBUG;
+#elif defined(INFO) || defined(SUCCESS)
+int log_level = LOG_INFO;
+#elif defined(ERROR) && !defined(WARN)
+int log_level = LOG_ERROR;
+#else
+int log_level = LOG_WARN;
+#endif
+
+static char *level_names[] = {
+    [LOG_DEBUG] "debug",
+    [LOG_INFO]  "info",
+    [LOG_WARN]  "warn",
+    [LOG_ERROR] "error",
+    [LOG_OFF]   "off"
+};
+
+/*
+ * Header of a record in a ring, followed by the encoded arguments.  Records
+ * are padded to a multiple of 8 bytes and never wrap around the end of the
+ * ring: a record that would is placed at the start instead, and the space
+ * skipped is covered by a record with no site (if there is room for a
+ * header; if not, both sides know to skip it).
+ */
+typedef struct log_record {
+    unsigned int len;
+    const LOG_SITE *site;
+    long ns;
+} LOG_RECORD;
+
+#define RECORD_ALIGN(n) (((n) + 7) & ~(size_t) 7)
+
+/*
+ * A ring has one writer, the thread that owns it, and one reader, the drain
+ * thread.  head and tail only ever increase; the reader advances head past
+ * the records it has written out, and the writer advances tail past the
+ * records it has added.
+ */
+typedef struct log_ring {
+    struct log_ring *next;
+    int in_use;
+    int id;
+    unsigned long dropped;
+    unsigned long records;
+    unsigned long reported;  // Drops already reported, kept by the reader.
+    unsigned long head __attribute__((aligned(64)));
+    unsigned long tail __attribute__((aligned(64)));
+    char buf[LOG_RING_SIZE] __attribute__((aligned(64)));
+} LOG_RING;
+
+static LOG_RING *rings;
+static int nrings;
+static __thread LOG_RING *my_ring;
+static pthread_key_t release_key;
+static pthread_once_t release_key_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Held by whichever thread is reading the rings: the drain thread, or one
+ * calling log_flush().
+ */
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct timespec start;
+
+static void release_ring(void *ring) {
+    __atomic_store_n(&((LOG_RING *) ring)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void create_release_key(void) {
+    pthread_key_create(&release_key, release_ring);
+}
+
+/*
+ * Get the calling thread's ring, taking over one whose thread has exited if
+ * there is one, and otherwise adding a new one.  Records left in a ring that
+ * is taken over are still written out.
+ */
+static LOG_RING *get_ring(void) {
+    if (my_ring != NULL)
+        return my_ring;
+    pthread_once(&release_key_once, create_release_key);
+    LOG_RING *ring;
+    for (ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next) {
+        int free = 0;
+        if (__atomic_compare_exchange_n(&ring->in_use, &free, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+    }
+    if (ring == NULL) {
+        if ((ring = aligned_alloc(64, sizeof(LOG_RING))) == NULL)
+            return NULL;
+        memset(ring, 0, offsetof(LOG_RING, buf));
+        ring->in_use = 1;
+        ring->id = __atomic_add_fetch(&nrings, 1, __ATOMIC_RELAXED);
+        ring->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&rings, &ring->next, ring, 0,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+    pthread_setspecific(release_key, ring);
+    return my_ring = ring;
+}
+
+/*
+ * The kinds of argument a conversion takes.
+ */
+typedef enum arg_kind {
+    ARG_NONE, ARG_INT, ARG_LONG, ARG_LLONG, ARG_SIZE, ARG_INTMAX, ARG_PTRDIFF,
+    ARG_DOUBLE, ARG_STRING, ARG_POINTER
+} ARG_KIND;
+
+/*
+ * Parse the conversion specification that starts at the '%' at spec.
+ *
+ * @return a pointer past its end, with the kind of its argument (ARG_NONE for
+ * "%%" and anything not understood) in *kind.
+ */
+static const char *parse_spec(const char *spec, ARG_KIND *kind) {
+    const char *p = spec + 1;
+    p += strspn(p, "-+ #0");
+    p += strspn(p, "0123456789");
+    if (*p == '.') {
+        p++;
+        p += strspn(p, "0123456789");
+    }
+    int length = 0;  // 'h', 'l', 'L' (for ll), 'z', 'j' or 't'.
+    while (*p != '\0' && strchr("hlzjtL", *p)) {
+        length = *p == 'l' && length == 'l' ? 'L' : *p;
+        p++;
+    }
+    *kind = ARG_NONE;
+    if (*p == '\0')
+        return p;
+    switch (*p) {
+        case 'd': case 'i': case 'o': case 'u': case 'x': case 'X':
+        *kind = length == 'l' ? ARG_LONG : length == 'L' ? ARG_LLONG : length == 'z' ? ARG_SIZE :
+            length == 'j' ? ARG_INTMAX : length == 't' ? ARG_PTRDIFF : ARG_INT;
+        break;
+
+        case 'c':
+        *kind = ARG_INT;
+        break;
+
+        case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+        *kind = ARG_DOUBLE;
+        break;
+
+        case 's':
+        *kind = ARG_STRING;
+        break;
+
+        case 'p':
+        *kind = ARG_POINTER;
+        break;
+    }
+    return p + 1;
+}
+
+/*
+ * Copy the arguments of a message into buf: each as 8 bytes, except strings,
+ * which are a 2-byte length followed by their bytes.
+ *
+ * @return the number of bytes used.
+ */
+static size_t encode(const char *format, va_list ap, char *buf, size_t size) {
+    size_t len = 0;
+    for (const char *p = strchr(format, '%'); p != NULL; p = strchr(p, '%')) {
+        ARG_KIND kind;
+        p = parse_spec(p, &kind);
+        long long value = 0;
+        switch (kind) {
+            case ARG_NONE:
+            continue;
+
+            case ARG_STRING: {
+                const char *s = va_arg(ap, const char *);
+                if (s == NULL)
+                    s = "(null)";
+                unsigned short n = strnlen(s, LOG_STRING_MAX);
+                if (len + sizeof(n) + n > size)
+                    return len;
+                memcpy(buf + len, &n, sizeof(n));
+                memcpy(buf + len + sizeof(n), s, n);
+                len += sizeof(n) + n;
+                continue;
+            }
+
+            case ARG_DOUBLE: {
+                double d = va_arg(ap, double);
+                memcpy(&value, &d, sizeof(d));
+                break;
+            }
+
+            case ARG_INT: value = va_arg(ap, int); break;
+            case ARG_LONG: value = va_arg(ap, long); break;
+            case ARG_LLONG: value = va_arg(ap, long long); break;
+            case ARG_SIZE: value = va_arg(ap, size_t); break;
+            case ARG_INTMAX: value = va_arg(ap, intmax_t); break;
+            case ARG_PTRDIFF: value = va_arg(ap, ptrdiff_t); break;
+            case ARG_POINTER: value = (intptr_t) va_arg(ap, void *); break;
+        }
+        if (len + sizeof(value) > size)
+            return len;
+        memcpy(buf + len, &value, sizeof(value));
+        len += sizeof(value);
+    }
+    return len;
+}
+
+void log_write(const LOG_SITE *site, ...) {
+    LOG_RING *ring = get_ring();
+    if (ring == NULL)
+        return;
+    char args[LOG_RECORD_MAX - sizeof(LOG_RECORD)];
+    va_list ap;
+    va_start(ap, site);
+    size_t len = encode(site->format, ap, args, sizeof(args));
+    va_end(ap);
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    size_t need = RECORD_ALIGN(sizeof(LOG_RECORD) + len);
+    unsigned long tail = ring->tail;
+    unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    size_t offset = tail & (LOG_RING_SIZE - 1);
+    size_t skip = LOG_RING_SIZE - offset < need ? LOG_RING_SIZE - offset : 0;
+    if (tail + skip + need - head > LOG_RING_SIZE) {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+    if (skip >= sizeof(LOG_RECORD))
+        *(LOG_RECORD *) (ring->buf + offset) = (LOG_RECORD) { skip, NULL, 0 };
+    offset = (tail + skip) & (LOG_RING_SIZE - 1);
+    LOG_RECORD *record = (LOG_RECORD *) (ring->buf + offset);
+    record->len = need;
+    record->site = site;
+    record->ns = (ts.tv_sec - start.tv_sec) * 1000000000L + ts.tv_nsec - start.tv_nsec;
+    memcpy(record + 1, args, len);
+    __atomic_store_n(&ring->records, ring->records + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&ring->tail, tail + skip + need, __ATOMIC_RELEASE);
+}
+
+/*
+ * Format a message from its format and encoded arguments, one conversion at
+ * a time.
+ *
+ * @return the length of the message, which is truncated to fit.
+ */
+static size_t format_message(const char *format, const char *args, size_t args_len,
+                             char *buf, size_t size) {
+    size_t len = 0;
+    const char *p = format;
+    while (*p != '\0' && len < size - 1) {
+        const char *spec = strchr(p, '%');
+        if (spec == NULL)
+            spec = p + strlen(p);
+        size_t n = spec - p;
+        if (n > size - 1 - len)
+            n = size - 1 - len;
+        memcpy(buf + len, p, n);
+        len += n;
+        if (*spec == '\0')
+            break;
+        ARG_KIND kind;
+        p = parse_spec(spec, &kind);
+        char conv[32];
+        snprintf(conv, sizeof(conv), "%.*s", (int) (p - spec), spec);
+        long long value = 0;
+        char string[LOG_STRING_MAX + 1] = "";
+        if (kind == ARG_STRING && args_len >= sizeof(unsigned short)) {
+            unsigned short slen;
+            memcpy(&slen, args, sizeof(slen));
+            if (slen > args_len - sizeof(slen))
+                slen = args_len - sizeof(slen);
+            memcpy(string, args + sizeof(slen), slen);
+            string[slen] = '\0';
+            args += sizeof(slen) + slen;
+            args_len -= sizeof(slen) + slen;
+        }
+        else if (kind != ARG_NONE && kind != ARG_STRING && args_len >= sizeof(value)) {
+            memcpy(&value, args, sizeof(value));
+            args += sizeof(value);
+            args_len -= sizeof(value);
+        }
+        double d;
+        int w = 0;
+        char *out = buf + len;
+        size_t room = size - len;
+        switch (kind) {
+            case ARG_NONE: w = snprintf(out, room, "%s", strcmp(conv, "%%") ? conv : "%"); break;
+            case ARG_STRING: w = snprintf(out, room, conv, string); break;
+            case ARG_INT: w = snprintf(out, room, conv, (int) value); break;
+            case ARG_LONG: w = snprintf(out, room, conv, (long) value); break;
+            case ARG_LLONG: w = snprintf(out, room, conv, value); break;
+            case ARG_SIZE: w = snprintf(out, room, conv, (size_t) value); break;
+            case ARG_INTMAX: w = snprintf(out, room, conv, (intmax_t) value); break;
+            case ARG_PTRDIFF: w = snprintf(out, room, conv, (ptrdiff_t) value); break;
+            case ARG_POINTER: w = snprintf(out, room, conv, (void *) (intptr_t) value); break;
+            case ARG_DOUBLE:
+            memcpy(&d, &value, sizeof(d));
+            w = snprintf(out, room, conv, d);
+            break;
+        }
+        if (w > 0)
+            len += (size_t) w < room ? (size_t) w : room - 1;
+    }
+    buf[len] = '\0';
+    return len;
+}
+
+/*
+ * Write out the records waiting in a ring.  The caller must hold the drain
+ * lock.
+ *
+ * @return the number of records written.
+ */
+static int drain_ring(LOG_RING *ring, FILE *out) {
+    int count = 0;
+    unsigned long head = ring->head;
+    unsigned long tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    while (head < tail) {
+        size_t offset = head & (LOG_RING_SIZE - 1);
+        if (LOG_RING_SIZE - offset < sizeof(LOG_RECORD)) {
+            head += LOG_RING_SIZE - offset;
+            continue;
+        }
+        LOG_RECORD *record = (LOG_RECORD *) (ring->buf + offset);
+        const LOG_SITE *site = record->site;
+        if (site != NULL) {
+            char message[LOG_LINE_MAX];
+            format_message(site->format, (char *) (record + 1), record->len - sizeof(LOG_RECORD),
+                           message, sizeof(message));
+            fprintf(out, "%ld.%06ld [%d] %s%s:%s:%d " KNRM "%s" NL,
+                    record->ns / 1000000000L, record->ns / 1000 % 1000000, ring->id,
+                    site->prefix, site->file, site->function, site->line, message);
+            count++;
+        }
+        head += record->len;
+    }
+    __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+    unsigned long dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    if (dropped != ring->reported) {
+        fprintf(out, "[%d] %lu log messages dropped" NL, ring->id, dropped - ring->reported);
+        ring->reported = dropped;
+    }
+    return count;
+}
+
+static int drain(void) {
+    int count = 0;
+    pthread_mutex_lock(&drain_lock);
+    for (LOG_RING *ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next)
+        count += drain_ring(ring, stderr);
+    if (count > 0)
+        fflush(stderr);
+    pthread_mutex_unlock(&drain_lock);
+    return count;
+}
+
+/*
+ * Drain the rings until the process exits.  Signals are left to the other
+ * threads, so that the drain thread can be started before they are set up.
+ */
+static void *drain_thread(void *arg) {
+    struct timespec interval = { 0, LOG_DRAIN_INTERVAL_NS };
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);
+    while (1) {
+        if (drain() == 0)
+            nanosleep(&interval, NULL);
+    }
+    return NULL;
+}
+
+int log_init(void) {
+    pthread_t tid;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (pthread_create(&tid, NULL, drain_thread, NULL))
+        return -1;
+    pthread_detach(tid);
+    return 0;
+}
+
+void log_flush(void) {
+    drain();
+}
+
+int log_set_level(const char *name) {
+    for (int i = LOG_DEBUG; i <= LOG_OFF; i++) {
+        if (!strcmp(name, level_names[i])) {
+            __atomic_store_n(&log_level, i, __ATOMIC_RELAXED);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+const char *log_level_name(void) {
+    return level_names[__atomic_load_n(&log_level, __ATOMIC_RELAXED)];
+}
+
+void log_stats(FILE *out) {
+    unsigned long records = 0, dropped = 0;
+    for (LOG_RING *ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next) {
+        records += __atomic_load_n(&ring->records, __ATOMIC_RELAXED);
+        dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    }
+    fprintf(out, "log_level{level=\"%s\"} 1\n", log_level_name());
+    fprintf(out, "log_records %lu\n", records);
+    fprintf(out, "log_dropped %lu\n", dropped);
+}
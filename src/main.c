@@ -4,32 +4,141 @@
 #include "csapp.h"
 #include "pbx.h"
 #include "server.h"
+#include "event.h"
+#include "uring.h"
+#include "coro.h"
+#include "worker.h"
+#include "timer.h"
+#include "ext.h"
+#include "admin.h"
+#include "affinity.h"
+#include "stats.h"
+#include "slab.h"
+#include "log.h"
 #include "debug.h"
 #include "main_helper.h"
 
-static int* connfdp;
+typedef enum server_mode {
+    MODE_THREAD, MODE_EPOLL, MODE_URING, MODE_CORO
+} SERVER_MODE;
+
+static SERVER_MODE mode = MODE_THREAD;
 static void terminate(int status);
 
 static void terminate_helper() {
     debug("Running terminate_helper");
-    free(connfdp);
     terminate(EXIT_SUCCESS);
 }
 
+/*
+ * Hand a newly accepted connection to whatever services connections in the
+ * selected mode.
+ */
+static void service_connection(int connfd) {
+    if (mode == MODE_EPOLL) {
+        event_loop_add(connfd);
+        return;
+    }
+    if (mode == MODE_CORO) {
+        coro_add(connfd);
+        return;
+    }
+    pthread_t tid;
+    int *connfdp = Malloc(sizeof(int));
+    *connfdp = connfd;
+    if (pthread_create(&tid, NULL, pbx_client_service, connfdp) != 0) {
+        free(connfdp);
+        close(connfd);
+    }
+}
+
+/*
+ * Accept connections on a listening socket forever.
+ */
+static void accept_loop(int listenfd) {
+    // adapted from Lee-LEC21-Concurrency.pdf Slide 41
+    while (1) {
+        debug("Looking for connection");
+        int connfd = pbx_client_accept(listenfd);
+        if (connfd < 0) {
+            fprintf(stderr, "Failed to accept connections: %s\n", strerror(errno));
+            terminate(EXIT_FAILURE);
+        }
+        service_connection(connfd);
+    }
+}
+
+static void *acceptor_thread(void *arg) {
+    accept_loop((int) (long) arg);
+    return NULL;
+}
+
+/*
+ * Convert a timeout given in (possibly fractional) seconds to milliseconds.
+ *
+ * @return the timeout, or 0 if it is not positive.
+ */
+static unsigned long parse_timeout(char *arg) {
+    double secs = atof(arg);
+    return secs > 0 ? (unsigned long) (secs * 1000 + 0.5) : 0;
+}
+
 /*
  * "PBX" telephone exchange simulation.
  *
- * Usage: pbx <port>
+ * Usage: pbx -p <port> [-m thread|epoll|uring|coro] [-t <loops>] [-j <acceptors>]
+ *            [-s <shards>] [-H] [-b <bytes>] [-o drop|coalesce|disconnect]
+ *            [-w <workers>] [-c <clients>] [-r <secs>] [-i <secs>] [-k <secs>]
+ *            [-x <first>-<last>] [-q <secs>] [-a [<addr>:]<port>] [-l <level>]
+ *
+ *   -m  Selects how client connections are serviced: "thread" (the default)
+ *       starts a thread per connection, "epoll" multiplexes all connections
+ *       over a fixed set of event-loop threads, and "uring" does the same
+ *       with io_uring rings that also take over accepting connections.
+ *       "coro" runs the same service loop as "thread" mode, but in a
+ *       coroutine per connection, scheduled over a fixed set of threads.
+ *   -t  Number of event-loop threads (or rings, or coroutine schedulers) to
+ *       use in "epoll", "uring" and "coro" modes.
+ *   -j  Number of SO_REUSEPORT listening sockets to open, each with its own
+ *       acceptor thread (or ring, in "uring" mode) pinned to a CPU, so that
+ *       the kernel spreads incoming connections across cores.
+ *   -s  Number of shards to split the extension registry into.
+ *   -H  Back the object pools with huge pages where available.
+ *   -b  Bound on the bytes of output queued for each client.
+ *   -o  What to do with output to a client past that bound: "drop" drops
+ *       chat messages, "coalesce" (the default) also collapses queued state
+ *       notifications into the latest one, and "disconnect" shuts down the
+ *       connection.
+ *   -w  Number of worker threads to carry out client commands.  With
+ *       workers, the threads servicing connections only frame commands and
+ *       hand them to the workers.
+ *   -c  Most clients that may be connected at a time (PBX_MAX_EXTENSIONS by
+ *       default); further connections are sent "BUSY" and closed.
+ *   -r  Seconds after which a call that has not been answered is hung up.
+ *   -i  Seconds after which a connection with no input is closed.
+ *   -k  Seconds of no input after which a connection is sent its current
+ *       state, to find out whether it is still alive, and the interval at
+ *       which that is repeated.
+ *   Timeouts may be fractional; by default there are none.
+ *   -x  Range of extension numbers to assign to clients, lowest free number
+ *       first (by default, PBX_MAX_EXTENSIONS numbers from 0).
+ *   -q  Seconds that an extension number given up by a client is kept out of
+ *       use (1 by default; 0 for none).
+ *   -a  Port on which to serve the admin HTTP interface (see admin.h), which
+ *       serves the statistics at /metrics.  It listens on the loopback
+ *       address unless the port is given as <address>:<port>.
+ *   -l  Lowest level of log message to write: "debug", "info", "warn",
+ *       "error" or "off" (by default, the lowest the build enables).  It can
+ *       also be changed while running, through the admin interface.
+ *
+ * Sending SIGUSR2 to the server writes its statistics to stderr, and SIGUSR1
+ * its most recent call events.
  */
 int main(int argc, char* argv[]){
     // Option processing should be performed here.
     // Option '-p <port>' is required in order to specify the port number
     // on which the server should listen.
 
-    // Perform required initialization of the PBX module.
-    debug("Initializing PBX...");
-    pbx = pbx_init();
-
     // TODO: Set up the server socket and enter a loop to accept connections
     // on this socket.  For each connection, a thread should be started to
     // run function pbx_client_service().  In addition, you should install
@@ -41,15 +150,146 @@ int main(int argc, char* argv[]){
     // }
     
     char *port = NULL;
-    for (int i = 1; i < argc - 1; i++) {
-        if (!strcmp(argv[i], "-p")) {
-            i++;
-            port = argv[i];
+    char *admin_port = NULL;
+    int nloops = EVENT_DEFAULT_LOOPS;
+    int nacceptors = 1;
+    int nshards = PBX_DEFAULT_SHARDS;
+    int nworkers = 0;
+    int max_clients = 0;
+    int ext_first = EXT_DEFAULT_FIRST;
+    int ext_last = EXT_DEFAULT_FIRST + PBX_MAX_EXTENSIONS - 1;
+    unsigned long ext_quarantine = EXT_DEFAULT_QUARANTINE_MS;
+    int usage_error = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "p:m:t:j:s:Hb:o:w:c:r:i:k:x:q:a:l:")) != -1) {
+        switch (opt) {
+            case 'p':
+            port = optarg;
+            break;
+
+            case 'm':
+            if (!strcmp(optarg, "epoll"))
+                mode = MODE_EPOLL;
+            else if (!strcmp(optarg, "uring"))
+                mode = MODE_URING;
+            else if (!strcmp(optarg, "coro"))
+                mode = MODE_CORO;
+            else if (strcmp(optarg, "thread"))
+                usage_error = 1;
+            break;
+
+            case 't':
+            nloops = atoi(optarg);
+            break;
+
+            case 'j':
+            if ((nacceptors = atoi(optarg)) <= 0)
+                usage_error = 1;
+            break;
+
+            case 's':
+            if ((nshards = atoi(optarg)) <= 0)
+                usage_error = 1;
+            break;
+
+            case 'H':
+            slab_hugepages = 1;
+            break;
+
+            case 'b':
+            if ((long) (tu_output_limit = atol(optarg)) <= 0)
+                usage_error = 1;
+            break;
+
+            case 'o':
+            if (!strcmp(optarg, "drop"))
+                tu_overflow_policy = TU_OVERFLOW_DROP;
+            else if (!strcmp(optarg, "coalesce"))
+                tu_overflow_policy = TU_OVERFLOW_COALESCE;
+            else if (!strcmp(optarg, "disconnect"))
+                tu_overflow_policy = TU_OVERFLOW_DISCONNECT;
+            else
+                usage_error = 1;
+            break;
+
+            case 'w':
+            if ((nworkers = atoi(optarg)) <= 0)
+                usage_error = 1;
+            break;
+
+            case 'c':
+            if ((max_clients = atoi(optarg)) <= 0)
+                usage_error = 1;
+            break;
+
+            case 'r':
+            if ((tu_ring_timeout = parse_timeout(optarg)) == 0)
+                usage_error = 1;
+            break;
+
+            case 'i':
+            if ((tu_idle_timeout = parse_timeout(optarg)) == 0)
+                usage_error = 1;
+            break;
+
+            case 'k':
+            if ((tu_keepalive_interval = parse_timeout(optarg)) == 0)
+                usage_error = 1;
+            break;
+
+            case 'x':
+            if (sscanf(optarg, "%d-%d", &ext_first, &ext_last) != 2)
+                usage_error = 1;
+            break;
+
+            case 'q':
+            // Unlike the timeouts, a quarantine that does not parse is an
+            // error rather than none: it matters that numbers are kept back.
+            if ((ext_quarantine = parse_timeout(optarg)) == 0 && strcmp(optarg, "0"))
+                usage_error = 1;
+            break;
+
+            case 'a':
+            admin_port = optarg;
+            break;
+
+            case 'l':
+            if (log_set_level(optarg))
+                usage_error = 1;
+            break;
+
+            default:
+            usage_error = 1;
         }
     }
 
-    if (port == NULL) {
-        fprintf(stderr, "Usage: bin/pbx -p <port>\n");
+    if (port == NULL || usage_error) {
+        fprintf(stderr, "Usage: bin/pbx -p <port> [-m thread|epoll|uring|coro] [-t <loops>] [-j <acceptors>]"
+                " [-s <shards>] [-H]\n       [-b <bytes>] [-o drop|coalesce|disconnect] [-w <workers>] [-c <clients>]\n"
+                "       [-r <secs>] [-i <secs>] [-k <secs>] [-x <first>-<last>] [-q <secs>]\n"
+                "       [-a [<addr>:]<port>] [-l debug|info|warn|error|off]\n");
+        terminate(EXIT_FAILURE);
+    }
+
+    if (log_init()) {
+        fprintf(stderr, "Failed to start logging thread\n");
+        terminate(EXIT_FAILURE);
+    }
+
+    // Perform required initialization of the PBX module, whose registry is
+    // indexed from the bottom of the extension range.
+    if (ext_init(ext_first, ext_last, ext_quarantine)) {
+        fprintf(stderr, "Invalid extension range %d-%d\n", ext_first, ext_last);
+        terminate(EXIT_FAILURE);
+    }
+    debug("Initializing PBX...");
+    if ((pbx = pbx_init_sharded(nshards)) == NULL) {
+        fprintf(stderr, "Failed to initialize PBX\n");
+        terminate(EXIT_FAILURE);
+    }
+    pbx_client_init(max_clients);
+    if (stats_signal_init()) {
+        fprintf(stderr, "Failed to start statistics thread\n");
         terminate(EXIT_FAILURE);
     }
 
@@ -62,27 +302,69 @@ int main(int argc, char* argv[]){
         fprintf(stderr, "Failed to add sigaction");
         exit(1);
     }
+    // Writes to a client that has gone away must not kill the server.
+    Signal(SIGPIPE, SIG_IGN);
 
-    // adapted from Lee-LEC21-Concurrency.pdf Slide 41
-    int listenfd;
-    socklen_t clientlen;
-    struct sockaddr_storage clientaddr;
-    pthread_t tid;
+    if ((tu_ring_timeout || tu_idle_timeout || tu_keepalive_interval) && timer_init()) {
+        fprintf(stderr, "Failed to start timers\n");
+        terminate(EXIT_FAILURE);
+    }
 
-    listenfd = Open_listenfd(port);
+    if (nworkers > 0 && worker_pool_init(nworkers)) {
+        fprintf(stderr, "Failed to start workers\n");
+        terminate(EXIT_FAILURE);
+    }
 
-    while (1) {
-        debug("Looking for connection");
-        clientlen = sizeof(struct sockaddr_storage);
-        connfdp = Malloc(sizeof(int));
-        *connfdp = Accept(listenfd, (SA *) &clientaddr, &clientlen);
-        if (pthread_create(&tid, NULL, pbx_client_service, connfdp) != 0) {
-            free(connfdp);
-            connfdp = NULL;
+    if (nloops <= 0)
+        nloops = EVENT_DEFAULT_LOOPS;
+    if (mode == MODE_EPOLL && event_loop_init(nloops)) {
+        fprintf(stderr, "Failed to start event loops\n");
+        terminate(EXIT_FAILURE);
+    }
+    if (mode == MODE_CORO && coro_init(nloops)) {
+        fprintf(stderr, "Failed to start coroutine schedulers\n");
+        terminate(EXIT_FAILURE);
+    }
+
+    // Statistics may be served from here on, once everything they read has
+    // been set up.
+    if (admin_port != NULL && admin_init(admin_port)) {
+        fprintf(stderr, "Failed to start admin interface on %s\n", admin_port);
+        terminate(EXIT_FAILURE);
+    }
+
+    if (mode == MODE_URING) {
+        // The rings accept connections themselves.  With several listening
+        // sockets, the rings are spread across them and pinned to CPUs.
+        int nrings = nloops > nacceptors ? nloops : nacceptors;
+        int listenfds[nacceptors];
+        for (int i = 0; i < nacceptors; i++)
+            listenfds[i] = nacceptors > 1 ? Open_listenfd_reuseport(port) : Open_listenfd(port);
+        for (int i = 0; i < nrings; i++) {
+            if (uring_loop_start(listenfds[i % nacceptors], nacceptors > 1 ? i : -1)) {
+                fprintf(stderr, "Failed to start io_uring loops\n");
+                terminate(EXIT_FAILURE);
+            }
         }
-        connfdp = NULL;
+        while (1)
+            pause();
     }
-    
+
+    if (nacceptors == 1)
+        accept_loop(Open_listenfd(port));
+
+    for (int i = 0; i < nacceptors; i++) {
+        pthread_t tid;
+        long listenfd = Open_listenfd_reuseport(port);
+        if (pthread_create(&tid, NULL, acceptor_thread, (void *) listenfd) != 0) {
+            fprintf(stderr, "Failed to start acceptor threads\n");
+            terminate(EXIT_FAILURE);
+        }
+        pthread_detach(tid);
+        pin_thread(tid, i);
+    }
+    while (1)
+        pause();
 
     terminate(EXIT_SUCCESS);
 }
@@ -92,7 +374,9 @@ int main(int argc, char* argv[]){
  */
 static void terminate(int status) {
     debug("Shutting down PBX...");
-    pbx_shutdown(pbx);
+    if (pbx != NULL)
+        pbx_shutdown(pbx);
     debug("PBX server terminating");
+    log_flush();
     exit(status);
 }
\ No newline at end of file
@@ -0,0 +1,178 @@
+/*
+ * Per-command latency histograms and event counters.
+ */
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "metrics.h"
+#include "debug.h"
+
+typedef struct histogram {
+    unsigned long count;
+    unsigned long sum;
+    unsigned long max;
+    unsigned long buckets[METRICS_BUCKETS];
+} HISTOGRAM;
+
+/*
+ * The statistics recorded by one thread.  Only the thread that owns a block
+ * writes to it.
+ */
+typedef struct thread_metrics {
+    struct thread_metrics *next;
+    int in_use;
+    unsigned long counters[METRICS_COUNTERS];
+    HISTOGRAM histograms[METRICS_COMMANDS];
+} THREAD_METRICS;
+
+static char *counter_names[METRICS_COUNTERS] = {
+    [METRICS_REGISTRATIONS] "pbx_registrations_total",
+    [METRICS_CALLS]         "pbx_calls_total",
+    [METRICS_CHATS]         "pbx_chats_total"
+};
+
+static double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+static THREAD_METRICS *blocks;
+static __thread THREAD_METRICS *mine;
+static pthread_key_t release_key;
+static pthread_once_t release_key_once = PTHREAD_ONCE_INIT;
+
+static void release_block(void *block) {
+    __atomic_store_n(&((THREAD_METRICS *) block)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void create_release_key(void) {
+    pthread_key_create(&release_key, release_block);
+}
+
+/*
+ * Get the calling thread's block, taking over one left by a thread that has
+ * exited if there is one, and otherwise adding a new one to the list.  The
+ * block is given up when the thread exits.
+ */
+static THREAD_METRICS *my_block(void) {
+    if (mine != NULL)
+        return mine;
+    pthread_once(&release_key_once, create_release_key);
+    THREAD_METRICS *block;
+    for (block = __atomic_load_n(&blocks, __ATOMIC_ACQUIRE); block != NULL; block = block->next) {
+        int free = 0;
+        if (__atomic_compare_exchange_n(&block->in_use, &free, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+    }
+    if (block == NULL) {
+        if ((block = calloc(1, sizeof(THREAD_METRICS))) == NULL)
+            return NULL;
+        block->in_use = 1;
+        block->next = __atomic_load_n(&blocks, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&blocks, &block->next, block, 0,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+    pthread_setspecific(release_key, block);
+    return mine = block;
+}
+
+static int bucket_of(unsigned long ns) {
+    if (ns < METRICS_SUB_BUCKETS)
+        return ns;
+    int bits = 63 - __builtin_clzl(ns);
+    if (bits >= METRICS_MAX_BITS)
+        return METRICS_BUCKETS - 1;
+    return (bits - METRICS_SUB_BITS + 1) * METRICS_SUB_BUCKETS +
+        ((ns >> (bits - METRICS_SUB_BITS)) & (METRICS_SUB_BUCKETS - 1));
+}
+
+/*
+ * The highest value that falls in a bucket.
+ */
+static unsigned long bucket_limit(int bucket) {
+    if (bucket < METRICS_SUB_BUCKETS)
+        return bucket;
+    int shift = bucket / METRICS_SUB_BUCKETS - 1;
+    unsigned long low = (unsigned long) (METRICS_SUB_BUCKETS + bucket % METRICS_SUB_BUCKETS) << shift;
+    return low + (1UL << shift) - 1;
+}
+
+/*
+ * Add to a counter in the calling thread's block.
+ */
+static void bump(unsigned long *counter, unsigned long n) {
+    __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+long metrics_start(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+void metrics_record(TU_COMMAND cmd, long start) {
+    THREAD_METRICS *block = my_block();
+    if (block == NULL || cmd < 0 || cmd >= METRICS_COMMANDS)
+        return;
+    long elapsed = metrics_start() - start;
+    unsigned long ns = elapsed > 0 ? elapsed : 0;
+    HISTOGRAM *h = &block->histograms[cmd];
+    bump(&h->count, 1);
+    bump(&h->sum, ns);
+    bump(&h->buckets[bucket_of(ns)], 1);
+    if (ns > h->max)
+        __atomic_store_n(&h->max, ns, __ATOMIC_RELAXED);
+}
+
+void metrics_count(METRICS_COUNTER counter) {
+    THREAD_METRICS *block = my_block();
+    if (block != NULL)
+        bump(&block->counters[counter], 1);
+}
+
+static void histogram_stats(FILE *out, char *cmd, HISTOGRAM *h) {
+    fprintf(out, "pbx_command_ns_count{cmd=\"%s\"} %lu\n", cmd, h->count);
+    fprintf(out, "pbx_command_ns_sum{cmd=\"%s\"} %lu\n", cmd, h->sum);
+    fprintf(out, "pbx_command_ns_max{cmd=\"%s\"} %lu\n", cmd, h->max);
+    int q = 0, nq = sizeof(quantiles) / sizeof(quantiles[0]);
+    unsigned long cumulative = 0;
+    for (int b = 0; b < METRICS_BUCKETS; b++) {
+        cumulative += h->buckets[b];
+        for (; q < nq && h->count > 0 && cumulative >= quantiles[q] * h->count; q++) {
+            unsigned long value = bucket_limit(b);
+            fprintf(out, "pbx_command_ns{cmd=\"%s\",quantile=\"%g\"} %lu\n", cmd, quantiles[q],
+                    value < h->max ? value : h->max);
+        }
+    }
+    cumulative = 0;
+    for (int b = 0; b < METRICS_BUCKETS - 1; b++) {
+        if (h->buckets[b] == 0)
+            continue;
+        cumulative += h->buckets[b];
+        fprintf(out, "pbx_command_ns_bucket{cmd=\"%s\",le=\"%lu\"} %lu\n", cmd, bucket_limit(b), cumulative);
+    }
+    fprintf(out, "pbx_command_ns_bucket{cmd=\"%s\",le=\"+Inf\"} %lu\n", cmd, h->count);
+}
+
+void metrics_stats(FILE *out) {
+    HISTOGRAM totals[METRICS_COMMANDS] = { 0 };
+    unsigned long counters[METRICS_COUNTERS] = { 0 };
+    for (THREAD_METRICS *block = __atomic_load_n(&blocks, __ATOMIC_ACQUIRE); block != NULL;
+         block = block->next) {
+        for (int c = 0; c < METRICS_COUNTERS; c++)
+            counters[c] += __atomic_load_n(&block->counters[c], __ATOMIC_RELAXED);
+        for (int cmd = 0; cmd < METRICS_COMMANDS; cmd++) {
+            HISTOGRAM *h = &block->histograms[cmd], *t = &totals[cmd];
+            t->count += __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+            t->sum += __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+            unsigned long max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+            if (max > t->max)
+                t->max = max;
+            for (int b = 0; b < METRICS_BUCKETS; b++)
+                t->buckets[b] += __atomic_load_n(&h->buckets[b], __ATOMIC_RELAXED);
+        }
+    }
+    for (int c = 0; c < METRICS_COUNTERS; c++)
+        fprintf(out, "%s %lu\n", counter_names[c], counters[c]);
+    for (int cmd = 0; cmd < METRICS_COMMANDS; cmd++)
+        histogram_stats(out, tu_command_names[cmd], &totals[cmd]);
+}
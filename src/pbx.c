@@ -2,40 +2,128 @@
  * PBX: simulates a Private Branch Exchange.
  */
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
 
 #include "pbx.h"
 #include "debug.h"
 #include "csapp.h"
+#include "epoch.h"
+#include "metrics.h"
+#include "flight.h"
+#include "probes.h"
+#include "ext.h"
 
-typedef struct pbx_node {
-    TU *tu;
-    int ext;
-    struct pbx_node *next;
-} PBX_NODE;
+/*
+ * Upper limit on the size of a shard's extension table.  Each table starts
+ * out with its share of PBX_MAX_EXTENSIONS slots and doubles as needed to
+ * cover larger extensions.
+ */
+#define PBX_TABLE_LIMIT (1 << 24)
+
+/*
+ * Number of seconds pbx_shutdown() waits for server threads to unregister
+ * their TUs before releasing them regardless.
+ */
+#define PBX_SHUTDOWN_TIMEOUT 5
+
+/*
+ * The registry is split into shards by extension number, counted from the
+ * lowest number the allocator assigns (see ext.h) so that the tables stay
+ * small however high the range is: extension ext, at offset off = ext - base
+ * from it, lives in shard off % nshards, at slot off / nshards of that
+ * shard's table.  Each
+ * shard has its own writer lock and table, so registration churn on one shard
+ * does not hold up changes to another.  Tables are indexed directly, so that
+ * lookups on dial and removals on unregister take constant time.
+ *
+ * Lookups take no locks: pbx_dial reads a table inside an epoch read-side
+ * critical section.  Changes are serialized by the shard's writer lock and
+ * published with atomic stores, and anything a writer unpublishes (a TU, or
+ * the old table after growing it) is only released after epoch_synchronize().
+ */
+typedef struct extension_table {
+    int size;
+    TU *slots[];
+} EXTENSION_TABLE;
+
+typedef struct pbx_shard {
+    EXTENSION_TABLE *table;
+    sem_t w;
+    unsigned long acquisitions;
+    unsigned long contended;
+} __attribute__((aligned(64))) PBX_SHARD;
 
 typedef struct pbx {
-    PBX_NODE *head;
-    sem_t mutex, w;
-    int read_cnt;
+    int base;
+    int nshards;
+    PBX_SHARD *shards;
+    int registered;
+    int shutting_down;
+    sem_t drained;
 } PBX;
 
+/*
+ * Find where an extension number lives in the registry.
+ *
+ * @param shard  Set to the shard of the number.
+ * @return the slot of the number in the shard's table, or -1 if the number
+ * is below the base or too far above it to be registered.
+ */
+static int locate(PBX *pbx, int ext, PBX_SHARD **shard) {
+    if (ext < pbx->base)
+        return -1;
+    unsigned int off = (unsigned int) ext - pbx->base;
+    if (off / pbx->nshards >= PBX_TABLE_LIMIT)
+        return -1;
+    *shard = &pbx->shards[off % pbx->nshards];
+    return off / pbx->nshards;
+}
 
-static void add_reader() {
-    P(&pbx->mutex);
-    if (pbx->read_cnt == 0) {
-        P(&pbx->w);
-    }
-    pbx->read_cnt++;
-    V(&pbx->mutex);
+static EXTENSION_TABLE *table_alloc(int size) {
+    EXTENSION_TABLE *table = calloc(1, sizeof(EXTENSION_TABLE) + size * sizeof(TU *));
+    if (table != NULL)
+        table->size = size;
+    return table;
 }
 
-static void remove_reader() {
-    P(&pbx->mutex);
-    pbx->read_cnt--;
-    if (pbx->read_cnt == 0) {
-        V(&pbx->w);
+/*
+ * Take a shard's writer lock, counting the acquisitions that had to wait.
+ */
+static void shard_lock(PBX_SHARD *shard) {
+    if (Sem_trywait(&shard->w)) {
+        __atomic_fetch_add(&shard->contended, 1, __ATOMIC_RELAXED);
+        P(&shard->w);
     }
-    V(&pbx->mutex);
+    __atomic_fetch_add(&shard->acquisitions, 1, __ATOMIC_RELAXED);
+}
+
+static void shard_unlock(PBX_SHARD *shard) {
+    V(&shard->w);
+}
+
+/*
+ * Grow a shard's extension table so that it has at least the given number of
+ * slots.  Must be called with the shard's writer lock held.  The new table is
+ * published before the old one is freed, so concurrent lookups see one or the
+ * other.
+ */
+static int grow_table(PBX_SHARD *shard, int min_size) {
+    EXTENSION_TABLE *old = shard->table;
+    int size = old->size;
+    while (size < min_size)
+        size *= 2;
+    if (size > PBX_TABLE_LIMIT)
+        size = PBX_TABLE_LIMIT;
+    EXTENSION_TABLE *table = table_alloc(size);
+    if (table == NULL)
+        return -1;
+    memcpy(table->slots, old->slots, old->size * sizeof(TU *));
+    __atomic_store_n(&shard->table, table, __ATOMIC_RELEASE);
+    epoch_synchronize();
+    free(old);
+    return 0;
 }
 
 /*
@@ -45,14 +133,43 @@ static void remove_reader() {
  */
 // #if 0
 PBX *pbx_init() {
+    return pbx_init_sharded(PBX_DEFAULT_SHARDS);
+}
+// #endif
+
+/*
+ * Initialize a new PBX whose registry is split into the given number of shards.
+ *
+ * @param nshards  The number of registry shards.
+ * @return the newly initialized PBX, or NULL if initialization fails.
+ */
+PBX *pbx_init_sharded(int nshards) {
+    if (nshards <= 0)
+        return NULL;
     pbx = calloc(1, sizeof(PBX));
     if (pbx == NULL)
         return NULL;
-    Sem_init(&pbx->mutex, 0, 1);
-    Sem_init(&pbx->w, 0, 1);
+    pbx->shards = calloc(nshards, sizeof(PBX_SHARD));
+    if (pbx->shards == NULL) {
+        free(pbx);
+        return NULL;
+    }
+    pbx->base = ext_base();
+    pbx->nshards = nshards;
+    int size = (PBX_MAX_EXTENSIONS + nshards - 1) / nshards;
+    for (int i = 0; i < nshards; i++) {
+        if ((pbx->shards[i].table = table_alloc(size)) == NULL) {
+            while (i-- > 0)
+                free(pbx->shards[i].table);
+            free(pbx->shards);
+            free(pbx);
+            return NULL;
+        }
+        Sem_init(&pbx->shards[i].w, 0, 1);
+    }
+    Sem_init(&pbx->drained, 0, 0);
     return pbx;
 }
-// #endif
 
 /*
  * Shut down a pbx, shutting down all network connections, waiting for all server
@@ -68,19 +185,47 @@ PBX *pbx_init() {
 void pbx_shutdown(PBX *pbx) {
     // TO BE IMPLEMENTED
     debug("SHUTTING DOWN");
-    P(&pbx->w);
-    PBX_NODE *node = pbx->head;
-    while (node) {
-        PBX_NODE *next = node->next;
-        shutdown(tu_fileno(node->tu), SHUT_RDWR);
-        tu_unref(node->tu, "Shutting down PBX");
-        free(node);
-        node = next;
+    // Refuse new registrations, then shut down every connection so that the
+    // server threads see EOF and unregister their TUs.
+    __atomic_store_n(&pbx->shutting_down, 1, __ATOMIC_SEQ_CST);
+    for (int i = 0; i < pbx->nshards; i++) {
+        PBX_SHARD *shard = &pbx->shards[i];
+        shard_lock(shard);
+        for (int slot = 0; slot < shard->table->size; slot++) {
+            TU *tu = shard->table->slots[slot];
+            if (tu != NULL)
+                shutdown(tu_fileno(tu), SHUT_RDWR);
+        }
+        shard_unlock(shard);
     }
-    V(&pbx->w);
-    sem_destroy(&pbx->mutex);
-    sem_destroy(&pbx->w);
+    if (__atomic_load_n(&pbx->registered, __ATOMIC_SEQ_CST) > 0) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += PBX_SHUTDOWN_TIMEOUT;
+        while (sem_timedwait(&pbx->drained, &deadline) && errno == EINTR)
+            ;
+    }
+
+    // Release whatever is still registered after the wait.
+    for (int i = 0; i < pbx->nshards; i++) {
+        PBX_SHARD *shard = &pbx->shards[i];
+        shard_lock(shard);
+        EXTENSION_TABLE *table = shard->table;
+        __atomic_store_n(&shard->table, NULL, __ATOMIC_RELEASE);
+        epoch_synchronize();
+        for (int slot = 0; slot < table->size; slot++) {
+            TU *tu = table->slots[slot];
+            if (tu != NULL)
+                tu_unref(tu, "Shutting down PBX");
+        }
+        free(table);
+        shard_unlock(shard);
+        sem_destroy(&shard->w);
+    }
+    tu_dump_live(stderr);
     // free the pbx, shut down file descriptors
+    sem_destroy(&pbx->drained);
+    free(pbx->shards);
     free(pbx);
 }
 // #endif
@@ -97,23 +242,37 @@ void pbx_shutdown(PBX *pbx) {
  * @param pbx  The PBX registry.
  * @param tu  The TU to be registered.
  * @param ext  The extension number on which the TU is to be registered.
- * @return 0 if registration succeeds, otherwise -1.
+ * @return 0 if registration succeeds, otherwise -1 (including when the
+ * extension number is already in use).
  */
 // #if 0
 int pbx_register(PBX *pbx, TU *tu, int ext) {
-    P(&pbx->w);
-    PBX_NODE *node = malloc(sizeof(PBX_NODE));
-    if (node == NULL) {
-        V(&pbx->w);
+    PBX_SHARD *shard;
+    int slot = locate(pbx, ext, &shard);
+    if (slot < 0)
+        return -1;
+    shard_lock(shard);
+    if (shard->table == NULL || (slot >= shard->table->size && grow_table(shard, slot + 1))) {
+        shard_unlock(shard);
         return -1;
     }
-    node->tu = tu;
-    node->ext = ext;
-    node->next = pbx->head;
-    pbx->head = node;
-    tu_set_extension(tu, ext);
+    if (shard->table->slots[slot] != NULL) {
+        debug("Extension %d is already registered", ext);
+        shard_unlock(shard);
+        return -1;
+    }
+    if (__atomic_load_n(&pbx->shutting_down, __ATOMIC_SEQ_CST)) {
+        shard_unlock(shard);
+        return -1;
+    }
+    __atomic_add_fetch(&pbx->registered, 1, __ATOMIC_SEQ_CST);
     tu_ref(tu, "Registering to PBX");
-    V(&pbx->w);
+    __atomic_store_n(&shard->table->slots[slot], tu, __ATOMIC_RELEASE);
+    /* Announce the extension only once it can be dialed. */
+    tu_set_extension(tu, ext);
+    shard_unlock(shard);
+    flight_record(FLIGHT_REGISTER, tu, ext, FLIGHT_NO_STATE, FLIGHT_NO_STATE, NULL, -1);
+    metrics_count(METRICS_REGISTRATIONS);
     return 0;
 }
 // #endif
@@ -132,38 +291,79 @@ int pbx_register(PBX *pbx, TU *tu, int ext) {
  */
 // #if 0
 int pbx_unregister(PBX *pbx, TU *tu) {
-    P(&pbx->w);
-    if (pbx->head == NULL) {
-        V(&pbx->w);
+    int ext = tu_extension(tu);
+    PBX_SHARD *shard;
+    int slot = locate(pbx, ext, &shard);
+    if (slot < 0)
         return -1;
-    }
-    
-    PBX_NODE *removed;
-    if (pbx->head->tu == tu) {
-        removed = pbx->head;
-        pbx->head = removed->next;
-        tu_unref(removed->tu, "Unregistered tu");
-        free(removed);
-        V(&pbx->w);
-        return 0;
-    }
-
-    PBX_NODE *curr = pbx->head;
-    while (curr->next != NULL && curr->next->tu != tu) {
-        curr = curr->next;
-    }
-    removed = curr->next;
-    if (removed == NULL) {
-        V(&pbx->w);
+    shard_lock(shard);
+    if (shard->table == NULL || slot >= shard->table->size || shard->table->slots[slot] != tu) {
+        shard_unlock(shard);
         return -1;
     }
-    curr->next = removed->next;
-    tu_unref(removed->tu, "Unregistered tu");
-    free(removed);
+    __atomic_store_n(&shard->table->slots[slot], NULL, __ATOMIC_RELEASE);
+    shard_unlock(shard);
+    flight_record(FLIGHT_UNREGISTER, tu, ext, FLIGHT_NO_STATE, FLIGHT_NO_STATE, NULL, -1);
+
+    // Wait out any dial that may have looked up the TU before it was removed,
+    // so that a call it sets up is cancelled by the hangup below.
+    epoch_synchronize();
+    tu_hangup(tu);
+    tu_unref(tu, "Unregistered tu");
+    if (__atomic_sub_fetch(&pbx->registered, 1, __ATOMIC_SEQ_CST) == 0 &&
+        __atomic_load_n(&pbx->shutting_down, __ATOMIC_SEQ_CST))
+        V(&pbx->drained);
     return 0;
 }
 // #endif
 
+/*
+ * Move a registered TU to another extension number, announcing the new
+ * number to its client.  A call in progress is not affected: the peer is
+ * known by the TU itself, not by its number.  Dials that look up the TU
+ * while it is being moved find it at one number or the other.
+ *
+ * @param pbx  The PBX registry.
+ * @param tu  The TU to be moved.
+ * @param ext  The extension number to move it to.
+ * @return 0 if successful, otherwise -1 (including when the new extension
+ * number is already in use).
+ */
+int pbx_renumber(PBX *pbx, TU *tu, int ext) {
+    PBX_SHARD *from, *to;
+    int old = tu_extension(tu);
+    int old_slot = locate(pbx, old, &from);
+    int slot = locate(pbx, ext, &to);
+    if (old_slot < 0 || slot < 0)
+        return -1;
+    // Take the two writer locks in shard order.
+    PBX_SHARD *first = from < to ? from : to;
+    PBX_SHARD *second = from < to ? to : from;
+    shard_lock(first);
+    if (second != first)
+        shard_lock(second);
+    int ret = -1;
+    if (from->table == NULL || to->table == NULL ||
+        __atomic_load_n(&pbx->shutting_down, __ATOMIC_SEQ_CST) ||
+        old_slot >= from->table->size || from->table->slots[old_slot] != tu ||
+        (slot >= to->table->size && grow_table(to, slot + 1))) {
+        debug("Cannot move extension %d", old);
+    }
+    else if (to->table->slots[slot] != NULL) {
+        debug("Extension %d is already registered", ext);
+    }
+    else {
+        __atomic_store_n(&to->table->slots[slot], tu, __ATOMIC_RELEASE);
+        __atomic_store_n(&from->table->slots[old_slot], NULL, __ATOMIC_RELEASE);
+        tu_set_extension(tu, ext);
+        ret = 0;
+    }
+    if (second != first)
+        shard_unlock(second);
+    shard_unlock(first);
+    return ret;
+}
+
 /*
  * Use the PBX to initiate a call from a specified TU to a specified extension.
  *
@@ -174,14 +374,57 @@ int pbx_unregister(PBX *pbx, TU *tu) {
  */
 // #if 0
 int pbx_dial(PBX *pbx, TU *tu, int ext) {
-    add_reader();
-
-    PBX_NODE *node = pbx->head;
-    while (node != NULL && node->ext != ext) {
-        node = node->next;
+    TU *target = NULL;
+    PBX_PROBE(lookup_start, tu, ext);
+    epoch_enter();
+    PBX_SHARD *shard;
+    int slot = locate(pbx, ext, &shard);
+    if (slot >= 0) {
+        EXTENSION_TABLE *table = __atomic_load_n(&shard->table, __ATOMIC_ACQUIRE);
+        if (table != NULL && slot < table->size)
+            target = __atomic_load_n(&table->slots[slot], __ATOMIC_ACQUIRE);
     }
-    int res = tu_dial(tu, node == NULL ? NULL : node->tu);
-    remove_reader();
+    PBX_PROBE(lookup_done, tu, ext, target);
+    int res = tu_dial(tu, target);
+    epoch_exit();
     return res;
 }
 // #endif
+
+/*
+ * Write the per-shard registry statistics, and the depth of the outbound
+ * queue of each registered TU that has output waiting, one metric per line.
+ *
+ * @param pbx  The PBX.
+ * @param out  The stream to write to.
+ */
+void pbx_stats(PBX *pbx, FILE *out) {
+    size_t total_bytes = 0;
+    long total_msgs = 0;
+    epoch_enter();
+    for (int i = 0; i < pbx->nshards; i++) {
+        PBX_SHARD *shard = &pbx->shards[i];
+        EXTENSION_TABLE *table = __atomic_load_n(&shard->table, __ATOMIC_ACQUIRE);
+        fprintf(out, "pbx_shard_lock_acquisitions{shard=\"%d\"} %lu\n", i,
+                __atomic_load_n(&shard->acquisitions, __ATOMIC_RELAXED));
+        fprintf(out, "pbx_shard_lock_contended{shard=\"%d\"} %lu\n", i,
+                __atomic_load_n(&shard->contended, __ATOMIC_RELAXED));
+        fprintf(out, "pbx_shard_table_slots{shard=\"%d\"} %d\n", i, table ? table->size : 0);
+        // Outbound queue depths, for the TUs that have output waiting.
+        for (int j = 0; table != NULL && j < table->size; j++) {
+            TU *tu = __atomic_load_n(&table->slots[j], __ATOMIC_ACQUIRE);
+            size_t bytes;
+            int msgs;
+            if (tu == NULL || (msgs = tu_queue_depth(tu, &bytes)) == 0)
+                continue;
+            int ext = pbx->base + j * pbx->nshards + i;
+            fprintf(out, "tu_queue_messages{ext=\"%d\"} %d\n", ext, msgs);
+            fprintf(out, "tu_queue_bytes{ext=\"%d\"} %zu\n", ext, bytes);
+            total_msgs += msgs;
+            total_bytes += bytes;
+        }
+    }
+    epoch_exit();
+    fprintf(out, "pbx_queued_messages %ld\n", total_msgs);
+    fprintf(out, "pbx_queued_bytes %zu\n", total_bytes);
+}
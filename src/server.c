@@ -5,94 +5,479 @@
 #include <stdlib.h>
 #include <pthread.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
 
 #include "debug.h"
 #include "pbx.h"
 #include "server.h"
+#include "slab.h"
+#include "ext.h"
+#include "metrics.h"
+#include "probes.h"
 
-#define BUFFER_BLOCK_LEN 103
+/*
+ * Pool of the line parsers used by pbx_client_service().  The event-loop
+ * modes embed a parser in their per-connection state instead.
+ */
+static SLAB_POOL *line_pool;
+static pthread_once_t line_pool_once = PTHREAD_ONCE_INIT;
+
+static void create_line_pool(void) {
+    line_pool = slab_pool_create("line", sizeof(LINE_PARSER));
+}
 
 /*
- * Thread function for the thread that handles interaction with a client TU.
- * This is called after a network connection has been made via the main server
- * thread and a new thread has been created to handle the connection.
+ * Admission control.  At most client_limit connections are attached at a
+ * time.  A descriptor is also held in reserve: when accepting fails because
+ * the process (or system) has run out of descriptors, the reserve is
+ * released so that the next connection can be accepted, told the server is
+ * busy and closed, instead of staying in the listen queue.
  */
-// #if 0
-void *pbx_client_service(void *arg) {
-    if (pthread_detach(pthread_self())) {
-        fprintf(stderr, "Failed to detach thread\n");
-        exit(1);
+static int client_limit = PBX_MAX_EXTENSIONS;
+static int clients;
+static int reserve_fd = -1;
+static int reserve_released;
+static pthread_mutex_t reserve_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned long rejected_full;
+static unsigned long rejected_fds;
+static unsigned long accept_errors;
+
+void pbx_client_init(int max_clients) {
+    if (max_clients > 0)
+        client_limit = max_clients;
+    reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
+
+/*
+ * Turn away a connection with a BUSY notification.  The write is not allowed
+ * to block: a client that cannot take six bytes just gets closed.
+ */
+static void reject(int connfd, unsigned long *count) {
+    send(connfd, "BUSY" EOL, 6, MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(connfd);
+    __atomic_fetch_add(count, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Decide whether to take on a newly accepted connection, turning it away if
+ * it only got a descriptor because the reserve was released, or if the
+ * server is full or has run out of extension numbers.
+ *
+ * @return the extension number assigned to the connection if it was
+ * admitted, otherwise -1 (in which case it has been closed).
+ */
+static int admit(int connfd) {
+    if (__atomic_load_n(&reserve_released, __ATOMIC_ACQUIRE)) {
+        reject(connfd, &rejected_fds);
+        pthread_mutex_lock(&reserve_lock);
+        if (reserve_released && (reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC)) >= 0)
+            __atomic_store_n(&reserve_released, 0, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&reserve_lock);
+        return -1;
     }
-    int connfdp = *(int*)(arg);
-    TU *tu = tu_init(connfdp);
-    free(arg);
-    pbx_register(pbx, tu, connfdp);
+    if (__atomic_fetch_add(&clients, 1, __ATOMIC_ACQ_REL) >= client_limit) {
+        __atomic_fetch_sub(&clients, 1, __ATOMIC_RELEASE);
+        reject(connfd, &rejected_full);
+        return -1;
+    }
+    int ext = ext_alloc();
+    if (ext < 0) {
+        __atomic_fetch_sub(&clients, 1, __ATOMIC_RELEASE);
+        reject(connfd, &rejected_full);
+    }
+    return ext;
+}
+
+/*
+ * Tell whether an accept error is one to ride out: a connection that went
+ * away before it was accepted, a network error that accept(2) passes on for
+ * it, or running short of descriptors or memory.  Anything else (EBADF,
+ * EINVAL, ENOTSOCK...) means the listening socket itself is unusable, and
+ * retrying would only spin.
+ */
+static int accept_error_transient(int err) {
+    switch (err) {
+        case EINTR: case EAGAIN: case ECONNABORTED: case EPROTO: case EPERM:
+        case ENETDOWN: case ENOPROTOOPT: case EHOSTDOWN: case ENONET:
+        case EHOSTUNREACH: case EOPNOTSUPP: case ENETUNREACH:
+        case EMFILE: case ENFILE: case ENOBUFS: case ENOMEM:
+        return 1;
+
+        default:
+        return 0;
+    }
+}
+
+/*
+ * Deal with a failure to accept a connection.  Running out of descriptors
+ * releases the reserve, if it is still held; otherwise, for errors that
+ * will not go away at once, the caller is held up briefly so that it does
+ * not spin.
+ */
+int pbx_client_accept_error(int err) {
+    __atomic_fetch_add(&accept_errors, 1, __ATOMIC_RELAXED);
+    debug("Accept failed: %s", strerror(err));
+    if (!accept_error_transient(err))
+        return -1;
+    if (err == EMFILE || err == ENFILE) {
+        pthread_mutex_lock(&reserve_lock);
+        int released = reserve_fd >= 0;
+        if (released) {
+            close(reserve_fd);
+            reserve_fd = -1;
+            __atomic_store_n(&reserve_released, 1, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&reserve_lock);
+        if (released)
+            return 0;
+    }
+    if (err == EMFILE || err == ENFILE || err == ENOBUFS || err == ENOMEM)
+        usleep(1000);
+    return 0;
+}
+
+/*
+ * Accept a connection on a listening socket, retrying after transient
+ * errors.
+ */
+int pbx_client_accept(int listenfd) {
     while (1) {
-        char *buffer = malloc(BUFFER_BLOCK_LEN + 1);
-        if (buffer == NULL) {
-            fprintf(stderr, "Failed to allocate memory\n");
-            exit(EXIT_FAILURE);
+        int connfd = accept(listenfd, NULL, NULL);
+        if (connfd >= 0)
+            return connfd;
+        if (errno != EINTR && pbx_client_accept_error(errno))
+            return -1;
+    }
+}
+
+void pbx_client_stats(FILE *out) {
+    fprintf(out, "pbx_clients %d\n", __atomic_load_n(&clients, __ATOMIC_RELAXED));
+    fprintf(out, "pbx_client_limit %d\n", client_limit);
+    fprintf(out, "pbx_rejected{reason=\"full\"} %lu\n", __atomic_load_n(&rejected_full, __ATOMIC_RELAXED));
+    fprintf(out, "pbx_rejected{reason=\"fds\"} %lu\n", __atomic_load_n(&rejected_fds, __ATOMIC_RELAXED));
+    fprintf(out, "pbx_accept_errors %lu\n", __atomic_load_n(&accept_errors, __ATOMIC_RELAXED));
+}
+
+/*
+ * Create a TU for a newly accepted connection and register it with the PBX,
+ * if admission control lets it in, at the extension number it was assigned.
+ * If registration fails, the TU is freed and the connection is closed.
+ */
+TU *pbx_client_attach(int connfd) {
+    int ext = admit(connfd);
+    if (ext < 0)
+        return NULL;
+    TU *tu = tu_init(connfd);
+    if (tu == NULL) {
+        close(connfd);
+        ext_free(ext);
+        __atomic_fetch_sub(&clients, 1, __ATOMIC_RELEASE);
+        return NULL;
+    }
+    tu_ref(tu, "Attaching connection");
+    int ret = pbx_register(pbx, tu, ext);
+    tu_flush_pending();
+    tu_unref(tu, "Attached connection");
+    if (ret) {
+        ext_free(ext);
+        __atomic_fetch_sub(&clients, 1, __ATOMIC_RELEASE);
+        return NULL;
+    }
+    tu_watch(tu);
+    return tu;
+}
+
+static void run_detach(TU *tu, char *data, size_t len) {
+    int ext = tu_extension(tu);
+    tu_unwatch(tu);
+    if (pbx_unregister(pbx, tu) == 0)
+        ext_free(ext);
+    tu_flush_pending();
+    __atomic_fetch_sub(&clients, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Tear down the TU of a connection that has seen EOF, once every command
+ * framed before it has been carried out.  Unregistering hangs up any call in
+ * progress and drops the PBX reference, which closes the underlying
+ * connection once the last reference is gone.
+ */
+void pbx_client_detach(TU *tu, LINE_PARSER *lp) {
+    WORK_QUEUE *none = NULL;
+    worker_finish(lp != NULL ? &lp->work : &none, tu, run_detach);
+}
+
+/*
+ * Move the TU of a client to the extension number it asked for.  If the
+ * number is not to be had, the client is sent its current state instead.
+ */
+static void request_extension(TU *tu, int ext) {
+    int old = tu_extension(tu);
+    if (ext != old && ext_claim(ext) == 0) {
+        if (pbx_renumber(pbx, tu, ext) == 0) {
+            ext_free(old);
+            return;
         }
-        buffer[0] = '\0';
-
-        int len = 0;
-        int curr_read_len = 0;
-        char prev = 0;
-        int break_index = -1;
-        while ((curr_read_len = read(connfdp, (buffer + len), BUFFER_BLOCK_LEN)) > 0) {
-            len += curr_read_len;
-            buffer[len] = '\0';
-            for (int i = len - curr_read_len; i < len; i++) {
-                char curr = buffer[i];
-                if (prev == '\r' && curr == '\n') {
-                    break_index = i - 1;
-                    break;
-                }
-                prev = curr;
-            }
-
-            if (break_index != -1) {
-                break;
-            }
-
-            char *re_buffer = realloc(buffer, len + BUFFER_BLOCK_LEN + 1);
-            if (!re_buffer) {
-                fprintf(stderr, "Failed to reallocate memory\n");
-                free(buffer);
-                exit(EXIT_FAILURE);
-            }
-            buffer = re_buffer;
+        ext_unclaim(ext);
+    }
+    tu_set_extension(tu, old);
+}
+
+/*
+ * Parse a single command line received from the client of a TU and carry it
+ * out.  The line is NUL-terminated and does not include the EOL sequence.
+ */
+void pbx_client_dispatch(TU *tu, char *line) {
+    PBX_PROBE(command_receive, tu, tu_extension(tu), line);
+    long start = metrics_start();
+    if (!strcmp(line, "pickup")) {
+        tu_pickup(tu);
+        metrics_record(TU_PICKUP_CMD, start);
+    }
+    else if (!strcmp(line, "hangup")) {
+        tu_hangup(tu);
+        metrics_record(TU_HANGUP_CMD, start);
+    }
+    else if (!strncmp(line, "dial ", 5)) {
+        char *end_ptr = NULL;
+        int ext = strtol(line + 5, &end_ptr, 10);
+        if (*end_ptr == '\0') {
+            pbx_dial(pbx, tu, ext);
+            metrics_record(TU_DIAL_CMD, start);
         }
-        if (curr_read_len <= 0) {
-            free(buffer);
-            break;
+        else {
+            debug("Invalid dial");
         }
-        buffer[break_index] = '\0';
+    }
+    else if (!strncmp(line, "chat ", 5)) {
+        tu_chat(tu, line + 5);
+        metrics_record(TU_CHAT_CMD, start);
+    }
+    else if (!strncmp(line, PBX_EXTENSION_CMD " ", sizeof(PBX_EXTENSION_CMD))) {
+        char *end_ptr = NULL;
+        int ext = strtol(line + sizeof(PBX_EXTENSION_CMD), &end_ptr, 10);
+        if (*end_ptr == '\0') {
+            request_extension(tu, ext);
+        }
+        else {
+            debug("Invalid extension");
+        }
+    }
+    else if (*line != '\0') {
+        debug("Invalid command");
+    }
+}
+
+char *pbx_client_space(LINE_PARSER *lp, size_t *room) {
+    *room = sizeof(lp->buf) - lp->len;
+    return lp->buf + lp->len;
+}
 
-        if (!strcmp(buffer, "pickup")) {
-            tu_pickup(tu);
+/*
+ * Carry out one frame of the binary protocol received from the client of a TU.
+ */
+static void dispatch_frame(TU *tu, PROTO_HEADER *hdr, char *payload) {
+    PBX_PROBE(frame_receive, tu, tu_extension(tu), hdr->op, (int32_t) ntohl(hdr->arg));
+    long start = metrics_start();
+    switch (hdr->op) {
+        case TU_PICKUP_CMD:
+        tu_pickup(tu);
+        metrics_record(TU_PICKUP_CMD, start);
+        break;
+
+        case TU_HANGUP_CMD:
+        tu_hangup(tu);
+        metrics_record(TU_HANGUP_CMD, start);
+        break;
+
+        case TU_DIAL_CMD:
+        pbx_dial(pbx, tu, (int32_t) ntohl(hdr->arg));
+        metrics_record(TU_DIAL_CMD, start);
+        break;
+
+        case TU_CHAT_CMD:
+        tu_chat_bytes(tu, payload, ntohl(hdr->arg));
+        metrics_record(TU_CHAT_CMD, start);
+        break;
+
+        case PROTO_EXTENSION:
+        request_extension(tu, (int32_t) ntohl(hdr->arg));
+        break;
+
+        default:
+        debug("Invalid command %d", hdr->op);
+    }
+}
+
+static void run_line(TU *tu, char *data, size_t len) {
+    pbx_client_dispatch(tu, data);
+}
+
+static void run_frame(TU *tu, char *data, size_t len) {
+    PROTO_HEADER hdr;
+    memcpy(&hdr, data, PROTO_HEADER_LEN);
+    dispatch_frame(tu, &hdr, data + PROTO_HEADER_LEN);
+}
+
+static void run_set_binary(TU *tu, char *data, size_t len) {
+    tu_set_binary(tu);
+}
+
+/*
+ * Carry out a command framed from the input of a TU, or hand it to the
+ * worker pool if there is one.
+ */
+static void carry_out(TU *tu, LINE_PARSER *lp, WORK_FN fn, char *data, size_t len) {
+    if (worker_pool_size > 0)
+        worker_submit(&lp->work, tu, fn, data, len);
+    else
+        fn(tu, data, len);
+}
+
+/*
+ * Carry out the complete lines in the input held by a line parser, starting
+ * at the given offset, until the input runs out or the client switches to
+ * the binary protocol.  Lines are found with memchr() on the LF, which is
+ * much faster than a byte-at-a-time loop, and the search resumes where the
+ * last one stopped rather than rescanning a partial line.  A bare LF does
+ * not end a line.
+ *
+ * @return the offset just past the last line carried out.
+ */
+static size_t frame_text(TU *tu, LINE_PARSER *lp, size_t start) {
+    char *lf;
+    while ((lf = memchr(lp->buf + lp->scan, '\n', lp->len - lp->scan)) != NULL) {
+        size_t i = lf - lp->buf;
+        lp->scan = i + 1;
+        if (i == 0 || lf[-1] != '\r')
+            continue;
+        lf[-1] = '\0';
+        char *line = lp->buf + start;
+        size_t len = i - start;
+        start = i + 1;
+        if (lp->discarding) {
+            lp->discarding = 0;
         }
-        else if (!strcmp(buffer, "hangup")) {
-            tu_hangup(tu);
+        else if (!strcmp(line, PROTO_BINARY_CMD)) {
+            lp->binary = 1;
+            carry_out(tu, lp, run_set_binary, NULL, 0);
+            break;
         }
-        else if (!strncmp(buffer, "dial ", 5)) {
-            char *end_ptr = NULL;
-            int ext = strtol(buffer + 5, &end_ptr, 10);
-            if (*end_ptr == '\0') {
-                pbx_dial(pbx, tu, ext);
-            }
-            else {
-                debug("Invalid dial");
-            }
+        else {
+            carry_out(tu, lp, run_line, line, len);
         }
-        else if (!strncmp(buffer, "chat ", 5)) {
-            tu_chat(tu, buffer + 5);
+    }
+    return start;
+}
+
+/*
+ * Carry out the complete binary frames in the input held by a line parser,
+ * starting at the given offset.
+ *
+ * @return the offset just past the last frame carried out or skipped.
+ */
+static size_t frame_binary(TU *tu, LINE_PARSER *lp, size_t start) {
+    while (1) {
+        if (lp->skip > 0) {
+            size_t n = lp->len - start < lp->skip ? lp->len - start : lp->skip;
+            lp->skip -= n;
+            start += n;
+            if (lp->skip > 0)
+                break;
         }
-        else if (len > 0) {
-            debug("Invalid command");
+        if (lp->len - start < PROTO_HEADER_LEN)
+            break;
+        PROTO_HEADER hdr;
+        memcpy(&hdr, lp->buf + start, PROTO_HEADER_LEN);
+        size_t payload = hdr.op == TU_CHAT_CMD ? ntohl(hdr.arg) : 0;
+        if (payload > PROTO_CHAT_MAX) {
+            debug("Discarding chat frame of %zu bytes", payload);
+            lp->skip = payload;
+            start += PROTO_HEADER_LEN;
+            continue;
         }
-        free(buffer);
+        if (lp->len - start < PROTO_HEADER_LEN + payload)
+            break;
+        carry_out(tu, lp, run_frame, lp->buf + start, PROTO_HEADER_LEN + payload);
+        start += PROTO_HEADER_LEN + payload;
+    }
+    return start;
+}
+
+/*
+ * Carry out each line or frame completed by n bytes of new input, then shift
+ * any trailing partial one to the front of the buffer.  The notifications
+ * produced by the whole batch are written out at the end, one write per
+ * connection.
+ */
+void pbx_client_frame(TU *tu, LINE_PARSER *lp, size_t n) {
+    size_t start = 0;
+    lp->len += n;
+    tu_activity(tu);
+    if (!lp->binary)
+        start = frame_text(tu, lp, start);
+    if (lp->binary)
+        start = frame_binary(tu, lp, start);
+    tu_flush_pending();
+    if (start > 0) {
+        memmove(lp->buf, lp->buf + start, lp->len - start);
+        lp->len -= start;
+        lp->scan = lp->scan > start ? lp->scan - start : 0;
+    }
+    if (lp->len == sizeof(lp->buf) && !lp->binary) {
+        debug("Discarding line longer than %d bytes", PBX_LINE_MAX);
+        lp->discarding = 1;
+        // Keep a trailing CR, which may be the start of the EOL sequence.
+        lp->len = lp->buf[lp->len - 1] == '\r';
+        lp->buf[0] = '\r';
+        lp->scan = 0;
+    }
+}
+
+/*
+ * Receive input from the client of a TU and carry out what it asks for, until
+ * the connection sees EOF or an error.
+ */
+void pbx_client_serve(TU *tu, LINE_PARSER *lp, int fd, ssize_t (*rd)(int, void *, size_t)) {
+    while (1) {
+        size_t room;
+        char *space = pbx_client_space(lp, &room);
+        ssize_t len = rd(fd, space, room);
+        if (len <= 0)
+            break;
+        pbx_client_frame(tu, lp, len);
+    }
+}
+
+/*
+ * Thread function for the thread that handles interaction with a client TU.
+ * This is called after a network connection has been made via the main server
+ * thread and a new thread has been created to handle the connection.
+ */
+// #if 0
+void *pbx_client_service(void *arg) {
+    if (pthread_detach(pthread_self())) {
+        fprintf(stderr, "Failed to detach thread\n");
+        exit(1);
+    }
+    int connfdp = *(int*)(arg);
+    free(arg);
+    TU *tu = pbx_client_attach(connfdp);
+    if (tu == NULL)
+        return NULL;
+    pthread_once(&line_pool_once, create_line_pool);
+    LINE_PARSER *lp = line_pool ? slab_alloc(line_pool) : NULL;
+    if (lp == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(EXIT_FAILURE);
     }
+    pbx_client_serve(tu, lp, connfdp, read);
+    pbx_client_detach(tu, lp);
+    slab_free(line_pool, lp);
     debug("Returning null");
     return NULL;
 }
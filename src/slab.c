@@ -0,0 +1,269 @@
+/*
+ * Fixed-size object pools with per-thread caches.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "slab.h"
+#include "debug.h"
+
+#define SLAB_ALIGN 16
+#define SLAB_CHUNK_LEN (2 * 1024 * 1024)
+
+/*
+ * Number of objects moved between a thread cache and the shared free list at
+ * a time.  A cache holding twice this many returns a batch.
+ */
+#define SLAB_BATCH 32
+
+typedef struct slab_obj {
+    struct slab_obj *next;
+} SLAB_OBJ;
+
+/*
+ * Per-thread cache of free objects for one pool.  The allocation and free
+ * counts are written only by the owning thread, so keeping them does not
+ * bounce a shared cache line; statistics are computed by summing them.
+ */
+typedef struct slab_cache {
+    SLAB_OBJ *head;
+    int count;
+    int in_use;
+    unsigned long allocs;
+    unsigned long frees;
+    struct slab_cache *next;
+} SLAB_CACHE;
+
+typedef struct slab_pool {
+    char *name;
+    int id;
+    size_t size;
+    pthread_mutex_t lock;
+    SLAB_OBJ *free_list;
+    unsigned long free_count;
+    unsigned long total;
+    unsigned long high_water;
+    unsigned long retired_allocs;
+    unsigned long retired_frees;
+    size_t reserved;
+    SLAB_CACHE *caches;
+} SLAB_POOL;
+
+int slab_hugepages;
+
+static SLAB_POOL *pools[SLAB_MAX_POOLS];
+static int num_pools;
+static pthread_mutex_t pools_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t cache_key;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+static __thread SLAB_CACHE *my_caches[SLAB_MAX_POOLS];
+
+/*
+ * Return the objects in a thread's caches to their pools when it exits.
+ * The caches themselves stay on the pool's list, empty and with their counts
+ * folded into the pool's, for reuse by later threads.
+ */
+static void retire_caches(void *arg) {
+    SLAB_CACHE **caches = arg;
+    for (int i = 0; i < SLAB_MAX_POOLS; i++) {
+        SLAB_CACHE *cache = caches[i];
+        if (cache == NULL)
+            continue;
+        SLAB_POOL *pool = pools[i];
+        pthread_mutex_lock(&pool->lock);
+        while (cache->head != NULL) {
+            SLAB_OBJ *obj = cache->head;
+            cache->head = obj->next;
+            obj->next = pool->free_list;
+            pool->free_list = obj;
+            pool->free_count++;
+        }
+        cache->count = 0;
+        pool->retired_allocs += cache->allocs;
+        pool->retired_frees += cache->frees;
+        __atomic_store_n(&cache->allocs, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&cache->frees, 0, __ATOMIC_RELAXED);
+        cache->in_use = 0;
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+static void make_key(void) {
+    pthread_key_create(&cache_key, retire_caches);
+}
+
+static SLAB_CACHE *get_cache(SLAB_POOL *pool) {
+    SLAB_CACHE *cache = my_caches[pool->id];
+    if (cache != NULL)
+        return cache;
+    pthread_once(&cache_once, make_key);
+    pthread_setspecific(cache_key, my_caches);
+    pthread_mutex_lock(&pool->lock);
+    for (cache = pool->caches; cache != NULL && cache->in_use; cache = cache->next)
+        ;
+    if (cache == NULL && (cache = calloc(1, sizeof(SLAB_CACHE))) != NULL) {
+        cache->next = pool->caches;
+        pool->caches = cache;
+    }
+    if (cache != NULL)
+        cache->in_use = 1;
+    pthread_mutex_unlock(&pool->lock);
+    return my_caches[pool->id] = cache;
+}
+
+/*
+ * Count the objects of a pool that are allocated and not yet freed, and
+ * update the high-water mark.  Must be called with the pool lock held.
+ */
+static long count_live(SLAB_POOL *pool) {
+    long live = pool->retired_allocs - pool->retired_frees;
+    for (SLAB_CACHE *cache = pool->caches; cache != NULL; cache = cache->next)
+        live += __atomic_load_n(&cache->allocs, __ATOMIC_RELAXED)
+            - __atomic_load_n(&cache->frees, __ATOMIC_RELAXED);
+    if (live > (long) pool->high_water)
+        pool->high_water = live;
+    return live;
+}
+
+/*
+ * Map a new chunk and add its objects to the shared free list.
+ * Must be called with the pool lock held.
+ */
+static int grow_pool(SLAB_POOL *pool) {
+    void *chunk = MAP_FAILED;
+    if (slab_hugepages)
+        chunk = mmap(NULL, SLAB_CHUNK_LEN, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (chunk == MAP_FAILED) {
+        chunk = mmap(NULL, SLAB_CHUNK_LEN, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (chunk == MAP_FAILED)
+            return -1;
+        if (slab_hugepages)
+            madvise(chunk, SLAB_CHUNK_LEN, MADV_HUGEPAGE);
+    }
+    size_t n = SLAB_CHUNK_LEN / pool->size;
+    for (size_t i = 0; i < n; i++) {
+        SLAB_OBJ *obj = (SLAB_OBJ *) ((char *) chunk + i * pool->size);
+        obj->next = pool->free_list;
+        pool->free_list = obj;
+    }
+    pool->free_count += n;
+    pool->total += n;
+    pool->reserved += SLAB_CHUNK_LEN;
+    debug("Pool %s grew to %lu objects", pool->name, pool->total);
+    return 0;
+}
+
+/*
+ * Move a batch of objects from the shared free list to a thread cache.
+ */
+static int refill(SLAB_POOL *pool, SLAB_CACHE *cache) {
+    pthread_mutex_lock(&pool->lock);
+    count_live(pool);
+    if (pool->free_count < SLAB_BATCH && grow_pool(pool) && pool->free_list == NULL) {
+        pthread_mutex_unlock(&pool->lock);
+        return -1;
+    }
+    for (int i = 0; i < SLAB_BATCH && pool->free_list != NULL; i++) {
+        SLAB_OBJ *obj = pool->free_list;
+        pool->free_list = obj->next;
+        pool->free_count--;
+        obj->next = cache->head;
+        cache->head = obj;
+        cache->count++;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+/*
+ * Move a batch of objects from a thread cache back to the shared free list.
+ */
+static void drain(SLAB_POOL *pool, SLAB_CACHE *cache) {
+    pthread_mutex_lock(&pool->lock);
+    for (int i = 0; i < SLAB_BATCH; i++) {
+        SLAB_OBJ *obj = cache->head;
+        cache->head = obj->next;
+        cache->count--;
+        obj->next = pool->free_list;
+        pool->free_list = obj;
+        pool->free_count++;
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+SLAB_POOL *slab_pool_create(char *name, size_t size) {
+    SLAB_POOL *pool = calloc(1, sizeof(SLAB_POOL));
+    if (pool == NULL)
+        return NULL;
+    pool->name = name;
+    pool->size = (size + SLAB_ALIGN - 1) & ~(size_t) (SLAB_ALIGN - 1);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_mutex_lock(&pools_lock);
+    if (num_pools == SLAB_MAX_POOLS) {
+        pthread_mutex_unlock(&pools_lock);
+        free(pool);
+        return NULL;
+    }
+    pool->id = num_pools;
+    pools[num_pools] = pool;
+    __atomic_store_n(&num_pools, num_pools + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&pools_lock);
+    return pool;
+}
+
+void *slab_alloc(SLAB_POOL *pool) {
+    SLAB_CACHE *cache = get_cache(pool);
+    if (cache == NULL)
+        return NULL;
+    if (cache->head == NULL && refill(pool, cache))
+        return NULL;
+    SLAB_OBJ *obj = cache->head;
+    cache->head = obj->next;
+    cache->count--;
+    __atomic_store_n(&cache->allocs, cache->allocs + 1, __ATOMIC_RELAXED);
+    memset(obj, 0, pool->size);
+    return obj;
+}
+
+void slab_free(SLAB_POOL *pool, void *ptr) {
+    if (ptr == NULL)
+        return;
+    SLAB_CACHE *cache = get_cache(pool);
+    SLAB_OBJ *obj = ptr;
+    if (cache == NULL) {
+        pthread_mutex_lock(&pool->lock);
+        obj->next = pool->free_list;
+        pool->free_list = obj;
+        pool->free_count++;
+        pool->retired_frees++;
+        pthread_mutex_unlock(&pool->lock);
+        return;
+    }
+    obj->next = cache->head;
+    cache->head = obj;
+    cache->count++;
+    __atomic_store_n(&cache->frees, cache->frees + 1, __ATOMIC_RELAXED);
+    if (cache->count >= 2 * SLAB_BATCH)
+        drain(pool, cache);
+}
+
+void slab_stats(FILE *out) {
+    int n = __atomic_load_n(&num_pools, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < n; i++) {
+        SLAB_POOL *pool = pools[i];
+        pthread_mutex_lock(&pool->lock);
+        long live = count_live(pool);
+        unsigned long total = pool->total;
+        unsigned long high_water = pool->high_water;
+        size_t reserved = pool->reserved;
+        pthread_mutex_unlock(&pool->lock);
+        fprintf(out, "slab_live{pool=\"%s\"} %ld\n", pool->name, live);
+        fprintf(out, "slab_free{pool=\"%s\"} %ld\n", pool->name, (long) total - live);
+        fprintf(out, "slab_high_water{pool=\"%s\"} %lu\n", pool->name, high_water);
+        fprintf(out, "slab_reserved_bytes{pool=\"%s\"} %zu\n", pool->name, reserved);
+    }
+}
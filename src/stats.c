@@ -0,0 +1,66 @@
+/*
+ * Server statistics.
+ */
+#include <stdlib.h>
+#include <pthread.h>
+#include <signal.h>
+
+#include "pbx.h"
+#include "stats.h"
+#include "server.h"
+#include "slab.h"
+#include "worker.h"
+#include "timer.h"
+#include "ext.h"
+#include "metrics.h"
+#include "lockprof.h"
+#include "log.h"
+#include "flight.h"
+#include "debug.h"
+
+void stats_dump(FILE *out) {
+    if (pbx != NULL)
+        pbx_stats(pbx, out);
+    pbx_client_stats(out);
+    ext_stats(out);
+    metrics_stats(out);
+    lockprof_stats(out);
+    tu_stats(out);
+    worker_stats(out);
+    timer_stats(out);
+    slab_stats(out);
+    log_stats(out);
+    fflush(out);
+}
+
+static void *stats_signal_thread(void *arg) {
+    sigset_t *set = arg;
+    int sig;
+    while (1) {
+        if (sigwait(set, &sig))
+            continue;
+        if (sig == SIGUSR1) {
+            debug("Dumping flight recorder on signal %d", sig);
+            flight_dump(stderr);
+        }
+        else {
+            debug("Dumping statistics on signal %d", sig);
+            stats_dump(stderr);
+        }
+    }
+    return NULL;
+}
+
+int stats_signal_init(void) {
+    static sigset_t set;
+    pthread_t tid;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    sigaddset(&set, SIGUSR2);
+    if (pthread_sigmask(SIG_BLOCK, &set, NULL))
+        return -1;
+    if (pthread_create(&tid, NULL, stats_signal_thread, &set))
+        return -1;
+    pthread_detach(tid);
+    return 0;
+}
@@ -0,0 +1,202 @@
+/*
+ * Hierarchical timing wheel.
+ */
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "timer.h"
+#include "debug.h"
+
+#define WHEEL0_BITS 8
+#define WHEEL_BITS 6
+#define WHEEL0_SIZE (1 << WHEEL0_BITS)
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define NUM_OUTER 3
+
+/*
+ * Furthest ahead, in ticks, that a timer can be armed.
+ */
+#define TIMER_MAX_TICKS ((1UL << (WHEEL0_BITS + NUM_OUTER * WHEEL_BITS)) - 1)
+
+static pthread_mutex_t wheel_lock = PTHREAD_MUTEX_INITIALIZER;
+static TIMER *wheel0[WHEEL0_SIZE];
+static TIMER *outer[NUM_OUTER][WHEEL_SIZE];
+
+/*
+ * The next tick to be run.  Every armed timer expires at or after it.
+ */
+static unsigned long wheel_tick;
+static unsigned long now_ms;
+static struct timespec start;
+
+static unsigned long armed;
+static unsigned long fired;
+static unsigned long cascaded;
+
+static void link_timer(TIMER **slot, TIMER *timer) {
+    if ((timer->next = *slot) != NULL)
+        timer->next->pprev = &timer->next;
+    *slot = timer;
+    timer->pprev = slot;
+}
+
+static void unlink_timer(TIMER *timer) {
+    if (timer->next != NULL)
+        timer->next->pprev = timer->pprev;
+    *timer->pprev = timer->next;
+    timer->pprev = NULL;
+}
+
+/*
+ * Put a timer in the slot that covers its expiry time.  The caller must hold
+ * the wheel lock.
+ */
+static void add_timer(TIMER *timer) {
+    unsigned long delta = timer->expires - wheel_tick;
+    if ((long) delta < 0) {
+        // Already due: run it with the next tick.
+        timer->expires = wheel_tick;
+        delta = 0;
+    }
+    if (delta < WHEEL0_SIZE) {
+        link_timer(&wheel0[timer->expires & (WHEEL0_SIZE - 1)], timer);
+        return;
+    }
+    for (int i = 0; i < NUM_OUTER; i++) {
+        int shift = WHEEL0_BITS + (i + 1) * WHEEL_BITS;
+        if (delta < 1UL << shift || i == NUM_OUTER - 1) {
+            int index = (timer->expires >> (shift - WHEEL_BITS)) & (WHEEL_SIZE - 1);
+            link_timer(&outer[i][index], timer);
+            return;
+        }
+    }
+}
+
+/*
+ * Move the timers in a slot of an outer wheel to the wheels inside it.
+ *
+ * @return the index of the slot.
+ */
+static int cascade(int level) {
+    int index = (wheel_tick >> (WHEEL0_BITS + level * WHEEL_BITS)) & (WHEEL_SIZE - 1);
+    TIMER *timer = outer[level][index];
+    outer[level][index] = NULL;
+    while (timer != NULL) {
+        TIMER *next = timer->next;
+        add_timer(timer);
+        cascaded++;
+        timer = next;
+    }
+    return index;
+}
+
+/*
+ * Run one tick: expire the timers due at it, calling their functions with
+ * the lock released.  The caller must hold the wheel lock.
+ */
+static void run_tick(void) {
+    int index = wheel_tick & (WHEEL0_SIZE - 1);
+    for (int level = 0; index == 0 && level < NUM_OUTER; level++)
+        index = cascade(level);
+    index = wheel_tick & (WHEEL0_SIZE - 1);
+    wheel_tick++;
+    // Take the timers due off the slot before running any of them.  A timer
+    // armed for a whole turn of the wheel from here on goes into this same
+    // slot, and must wait for the slot to come round again.  The list keeps
+    // its links, so a timer on it can still be cancelled or moved while the
+    // lock is released.
+    TIMER *due = wheel0[index];
+    wheel0[index] = NULL;
+    if (due != NULL)
+        due->pprev = &due;
+    TIMER *timer;
+    while ((timer = due) != NULL) {
+        unlink_timer(timer);
+        armed--;
+        fired++;
+        // Once the lock is released the timer may be armed again.
+        void (*fn)(TIMER *timer) = timer->fn;
+        pthread_mutex_unlock(&wheel_lock);
+        fn(timer);
+        pthread_mutex_lock(&wheel_lock);
+    }
+}
+
+static unsigned long elapsed_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec - start.tv_sec) * 1000 + (ts.tv_nsec - start.tv_nsec) / 1000000;
+}
+
+static void *timer_thread(void *arg) {
+    struct timespec next = start;
+    while (1) {
+        next.tv_nsec += TIMER_TICK_MS * 1000000L;
+        if (next.tv_nsec >= 1000000000L) {
+            next.tv_nsec -= 1000000000L;
+            next.tv_sec++;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+        unsigned long ms = elapsed_ms();
+        __atomic_store_n(&now_ms, ms, __ATOMIC_RELAXED);
+        // Catch up on any ticks missed while the thread was not running.
+        pthread_mutex_lock(&wheel_lock);
+        while (wheel_tick <= ms / TIMER_TICK_MS)
+            run_tick();
+        pthread_mutex_unlock(&wheel_lock);
+    }
+    return NULL;
+}
+
+int timer_init(void) {
+    pthread_t tid;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (pthread_create(&tid, NULL, timer_thread, NULL))
+        return -1;
+    pthread_detach(tid);
+    return 0;
+}
+
+int timer_arm(TIMER *timer, unsigned long ms, void (*fn)(TIMER *timer)) {
+    unsigned long ticks = (ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    if (ticks == 0)
+        ticks = 1;
+    if (ticks > TIMER_MAX_TICKS)
+        ticks = TIMER_MAX_TICKS;
+    pthread_mutex_lock(&wheel_lock);
+    int was_armed = timer->pprev != NULL;
+    if (was_armed)
+        unlink_timer(timer);
+    else
+        armed++;
+    timer->fn = fn;
+    timer->expires = wheel_tick + ticks;
+    add_timer(timer);
+    pthread_mutex_unlock(&wheel_lock);
+    return was_armed;
+}
+
+int timer_cancel(TIMER *timer) {
+    pthread_mutex_lock(&wheel_lock);
+    int was_armed = timer->pprev != NULL;
+    if (was_armed) {
+        unlink_timer(timer);
+        armed--;
+    }
+    pthread_mutex_unlock(&wheel_lock);
+    return was_armed;
+}
+
+unsigned long timer_now(void) {
+    return __atomic_load_n(&now_ms, __ATOMIC_RELAXED);
+}
+
+void timer_stats(FILE *out) {
+    pthread_mutex_lock(&wheel_lock);
+    unsigned long a = armed, f = fired, c = cascaded;
+    pthread_mutex_unlock(&wheel_lock);
+    fprintf(out, "timer_armed %lu\n", a);
+    fprintf(out, "timer_fired %lu\n", f);
+    fprintf(out, "timer_cascaded %lu\n", c);
+}
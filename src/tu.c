@@ -2,38 +2,977 @@
  * TU: simulates a "telephone unit", which interfaces a client with the PBX.
  */
 #include <stdlib.h>
+#include <stddef.h>
+#include <limits.h>
+#include <stdarg.h>
 #include <pthread.h>
+#include <sched.h>
 #include <csapp.h>
 #include <stdio.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
 
 #include "pbx.h"
+#include "proto.h"
+#include "slab.h"
+#include "timer.h"
+#include "metrics.h"
+#include "flight.h"
+#include "probes.h"
 #include "debug.h"
 
+/*
+ * The state of a TU and its peer are packed into a single atomic word, so
+ * that both are always read and changed together.  TUs are at least 16-byte
+ * aligned, which leaves the low four bits of the peer pointer free: the low
+ * three hold the state and the fourth is a claim bit.
+ *
+ * A transition claims the word of each TU it changes by setting the claim bit
+ * with a compare-and-swap, checks that the states it read beforehand still
+ * hold, and commits by storing the new words, which clears the claim bits.
+ * Two-party transitions claim both TUs in address order so that they cannot
+ * deadlock.  Notifications are queued while the claims are held, so each
+ * client sees its state changes in the order they were made.
+ */
+#define TU_STATE_BITS 0x7UL
+#define TU_CLAIM_BIT 0x8UL
+#define TU_PEER_BITS (~0xFUL)
+
+#define TU_WORD(state, peer) ((unsigned long) (peer) | (unsigned long) (state))
+#define WORD_STATE(word) ((TU_STATE) ((word) & TU_STATE_BITS))
+#define WORD_PEER(word) ((TU *) ((word) & TU_PEER_BITS))
+
+/*
+ * Number of times to spin on a claimed word before yielding the CPU.
+ */
+#define TU_CLAIM_SPINS 64
+
+/*
+ * Notifications are not written to the client while claims are held.  They
+ * are formatted into messages that are appended to the TU's outbound queue,
+ * and the TU is put on a list, kept by the calling thread, of TUs with output
+ * to be written.  The thread writes them all out with tu_flush_pending() once
+ * it has carried out a batch of commands, gathering each TU's queued messages
+ * into one writev(), so that each client receives one write per batch however
+ * many notifications the batch produced.
+ *
+ * Messages that fit in TU_MSG_SMALL bytes, which includes every state
+ * notification, come from a pool; longer chat messages from the heap.
+ *
+ * Writes never block.  When a client's socket buffer is full, the unsent
+ * messages go back on the front of its queue and the TU is handed to a
+ * flusher thread, which finishes the flush once epoll reports the socket
+ * writable.  Meanwhile the queue is bounded by tu_output_limit bytes, with
+ * tu_overflow_policy deciding what happens to messages past the bound.
+ */
+#define TU_PENDING_MAX 16
+#define TU_MSG_SMALL 64
+#define TU_FLUSH_IOV 64
+
+/*
+ * Flush statistics are kept in a fixed set of stripes, with each thread
+ * assigned a stripe round-robin, so that threads flushing at the same time
+ * rarely update the same cache line.
+ */
+#define TU_STATS_STRIPES 16
+#define TU_FLUSH_BUCKETS 6
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+
+#ifdef DEBUG
+/*
+ * In debug builds each TU records its most recent reference count changes,
+ * and all live TUs are kept on a list, so that leaked references can be
+ * traced with tu_dump_live().
+ */
+#define TU_REF_HISTORY 16
+
+typedef struct tu_ref_event {
+    char *reason;
+    int delta;
+    int count;
+} TU_REF_EVENT;
+
+static struct tu *live_tus;
+static pthread_mutex_t live_tus_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/*
+ * The reference count is changed with atomic operations only, so reference
+ * traffic does not contend with state transitions.
+ */
 typedef struct tu {
+    unsigned long word;
     int fd;
     int ext;
-    TU_STATE state;
-    struct tu *peer;
-    sem_t mutex;
     int ref_count;
-} TU;
+    sem_t out_lock;
+    struct tu_msg *out_head;
+    struct tu_msg **out_tail;
+    size_t out_off;
+    size_t out_bytes;
+    int out_count;
+    int flushing;
+    int out_failed;
+    int out_polled;
+    int binary;
+    TIMER ring_timer;
+    TIMER idle_timer;
+    int unwatched;
+    unsigned long last_input;
+    unsigned long last_probe;
+#ifdef DEBUG
+    unsigned int ref_events;
+    TU_REF_EVENT ref_history[TU_REF_HISTORY];
+    struct tu *live_prev, *live_next;
+#endif
+} __attribute__((aligned(16))) TU;
 
-// assumes that there is a lock 
-void print_state(TU *tu) {
-    switch (tu->state) {
-        case TU_ON_HOOK:
-        dprintf(tu->fd, "ON HOOK %d\r\n", tu->ext);
-        break;
+_Static_assert(TU_STATE_BITS >= TU_ERROR, "TU states must fit in the state bits");
 
-        case TU_CONNECTED:
-        dprintf(tu->fd, "CONNECTED %d\r\n", tu->peer->ext);
-        break;
+/*
+ * A message queued for output to the client of a TU.
+ */
+typedef struct tu_msg {
+    struct tu_msg *next;
+    size_t len;
+    int pooled;
+    int state;
+    char data[];
+} TU_MSG;
 
-        default:
-        dprintf(tu->fd, "%s\r\n", tu_state_names[tu->state]);
+/*
+ * A write of queued messages handed to the thread's submitter, which owns
+ * the flush of its TU and a reference to it until the write completes.
+ */
+typedef struct tu_send {
+    TU *tu;
+    TU_MSG *msgs;
+    size_t off;
+    struct msghdr mh;
+    struct iovec iov[TU_FLUSH_IOV];
+} TU_SEND;
+
+typedef struct flush_stats {
+    unsigned long flushes;
+    unsigned long writes;
+    unsigned long messages;
+    unsigned long bytes;
+    unsigned long buckets[TU_FLUSH_BUCKETS];
+    unsigned long blocked;
+    unsigned long dropped;
+    unsigned long coalesced;
+    unsigned long disconnects;
+    unsigned long relayed;
+    unsigned long ring_timeouts;
+    unsigned long idle_reaped;
+    unsigned long probes;
+} __attribute__((aligned(64))) FLUSH_STATS;
+
+size_t tu_output_limit = TU_DEFAULT_OUTPUT_LIMIT;
+TU_OVERFLOW tu_overflow_policy = TU_OVERFLOW_COALESCE;
+int tu_relay_chat = 1;
+unsigned long tu_ring_timeout;
+unsigned long tu_idle_timeout;
+unsigned long tu_keepalive_interval;
+
+static int flusher_epfd = -1;
+static pthread_once_t flusher_once = PTHREAD_ONCE_INIT;
+
+static SLAB_POOL *tu_pool;
+static SLAB_POOL *msg_pool;
+static SLAB_POOL *send_pool;
+static pthread_once_t tu_pool_once = PTHREAD_ONCE_INIT;
+
+static void create_tu_pool(void) {
+    tu_pool = slab_pool_create("tu", sizeof(TU));
+    msg_pool = slab_pool_create("tu_msg", sizeof(TU_MSG) + TU_MSG_SMALL);
+    send_pool = slab_pool_create("tu_send", sizeof(TU_SEND));
+}
+
+static __thread TU *pending[TU_PENDING_MAX];
+static __thread int num_pending;
+static __thread int (*my_submit)(void *arg, int fd, struct msghdr *msg, TU_SEND *send);
+static __thread void *my_submit_arg;
+
+static FLUSH_STATS flush_stats[TU_STATS_STRIPES];
+static unsigned int next_stripe;
+static __thread FLUSH_STATS *my_stats;
+
+/*
+ * Claim a TU, waiting for any other claim on it to be released.
+ *
+ * @return the word of the TU, without the claim bit.
+ */
+static unsigned long claim(TU *tu) {
+    int spins = 0;
+    while (1) {
+        unsigned long word = __atomic_load_n(&tu->word, __ATOMIC_RELAXED);
+        if (!(word & TU_CLAIM_BIT) &&
+            __atomic_compare_exchange_n(&tu->word, &word, word | TU_CLAIM_BIT, 1,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return word;
+        if (++spins < TU_CLAIM_SPINS)
+            cpu_relax();
+        else
+            sched_yield(), spins = 0;
+    }
+}
+
+/*
+ * Release a claim on a TU, committing its new word.
+ */
+static void commit(TU *tu, unsigned long word) {
+    __atomic_store_n(&tu->word, word, __ATOMIC_RELEASE);
+}
+
+/*
+ * Try once to claim a TU.
+ *
+ * @return 0 if the TU was claimed, with its word stored in *word, otherwise -1.
+ */
+static int try_claim(TU *tu, unsigned long *word) {
+    unsigned long w = __atomic_load_n(&tu->word, __ATOMIC_RELAXED);
+    if (w & TU_CLAIM_BIT)
+        return -1;
+    if (!__atomic_compare_exchange_n(&tu->word, &w, w | TU_CLAIM_BIT, 0,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return -1;
+    *word = w;
+    return 0;
+}
+
+/*
+ * Claim a TU together with its peer, if it has one.
+ *
+ * The TU is claimed first: while that claim is held its peer cannot hang up,
+ * so the peer cannot be freed.  If the peer comes after the TU in address
+ * order it is then simply claimed as well.  Otherwise taking it would break
+ * the ordering, so it is only tried, and on failure the claim on the TU is
+ * released and the whole thing retried.
+ *
+ * @param tu  The TU.
+ * @param peer_word  Set to the word of the peer, if the TU has a peer.
+ * @return the word of the TU.
+ */
+static unsigned long claim_with_peer(TU *tu, unsigned long *peer_word) {
+    while (1) {
+        unsigned long word = claim(tu);
+        TU *peer = WORD_PEER(word);
+        if (peer == NULL)
+            return word;
+        if (tu < peer) {
+            *peer_word = claim(peer);
+            return word;
+        }
+        if (try_claim(peer, peer_word) == 0)
+            return word;
+        commit(tu, word);
+        sched_yield();
+    }
+}
+
+static void free_msg(TU_MSG *msg) {
+    if (msg->pooled)
+        slab_free(msg_pool, msg);
+    else
+        free(msg);
+}
+
+static FLUSH_STATS *get_stats(void) {
+    if (my_stats == NULL)
+        my_stats = &flush_stats[__atomic_fetch_add(&next_stripe, 1, __ATOMIC_RELAXED)
+                                % TU_STATS_STRIPES];
+    return my_stats;
+}
+
+/*
+ * Record a flush of the given number of messages and bytes, made with the
+ * given number of calls to writev().  Messages per flush are counted in
+ * power-of-two buckets: 1, 2, 3-4, 5-8, 9-16 and more.
+ */
+static void count_flush(int writes, int messages, size_t bytes) {
+    FLUSH_STATS *stats = get_stats();
+    int bucket = 0;
+    while (bucket < TU_FLUSH_BUCKETS - 1 && messages > 1 << bucket)
+        bucket++;
+    __atomic_fetch_add(&stats->flushes, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->writes, writes, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->messages, messages, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->bytes, bytes, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->buckets[bucket], 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Gather data into one write without blocking.  Connections are written with
+ * sendmsg() and MSG_DONTWAIT, so that the descriptor itself can stay in
+ * blocking mode for the reads of the thread servicing it; anything that is
+ * not a socket (such as /dev/null in the benchmarks) falls back to writev().
+ */
+static ssize_t send_iov(int fd, struct iovec *iov, int n) {
+    struct msghdr mh = { .msg_iov = iov, .msg_iovlen = n };
+    ssize_t done = sendmsg(fd, &mh, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (done < 0 && errno == ENOTSOCK)
+        done = writev(fd, iov, n);
+    return done;
+}
+
+/*
+ * Describe the start of a list of messages, the first of which may have been
+ * partly written already, as parts for a single write.
+ *
+ * @return the number of parts, at most TU_FLUSH_IOV.
+ */
+static int gather_iov(TU_MSG *msg, size_t off, struct iovec *iov) {
+    int n = 0;
+    for (TU_MSG *m = msg; m != NULL && n < TU_FLUSH_IOV; m = m->next, n++) {
+        iov[n].iov_base = m->data;
+        iov[n].iov_len = m->len;
+    }
+    iov[0].iov_base = msg->data + off;
+    iov[0].iov_len -= off;
+    return n;
+}
+
+/*
+ * Free the messages at the start of a list that a write of done bytes
+ * completed, adding their size and number to *bytes and *count.
+ *
+ * @param off  The amount of the first message written before; updated to
+ * the amount written of the first message left.
+ * @return the messages left.
+ */
+static TU_MSG *free_written(TU_MSG *msg, size_t done, size_t *off, size_t *bytes, int *count) {
+    done += *off;
+    *off = 0;
+    while (msg != NULL && done >= msg->len) {
+        TU_MSG *m = msg;
+        done -= m->len;
+        msg = m->next;
+        *bytes += m->len;
+        (*count)++;
+        free_msg(m);
+    }
+    if (msg != NULL)
+        *off = done;
+    return msg;
+}
+
+/*
+ * Free a list of messages that cannot be written, adding their size and
+ * number to *bytes and *count.
+ */
+static void free_unwritten(TU_MSG *msg, size_t *bytes, int *count) {
+    while (msg != NULL) {
+        TU_MSG *m = msg;
+        msg = m->next;
+        *bytes += m->len;
+        (*count)++;
+        free_msg(m);
+    }
+}
+
+/*
+ * Write a list of messages to a connection, the first of which may have been
+ * partly written already, gathering up to TU_FLUSH_IOV of them into each
+ * write, and free those that were written.
+ *
+ * @param tu  The TU whose messages these are.
+ * @param msg  The messages.
+ * @param off  The amount of the first message already written; updated.
+ * @param bytes  Set to the total size of the messages freed.
+ * @param count  Set to the number of messages freed.
+ * @param failed  Set if the connection has failed, in which case all the
+ * messages are freed.
+ * @return the messages still to be written if the socket buffer filled up,
+ * otherwise NULL.
+ */
+static TU_MSG *write_msgs(TU *tu, TU_MSG *msg, size_t *off, size_t *bytes, int *count,
+                          int *failed) {
+    struct iovec iov[TU_FLUSH_IOV];
+    int writes = 0;
+    size_t written = 0;
+    *bytes = 0;
+    *count = 0;
+    *failed = 0;
+    while (msg != NULL) {
+        int n = gather_iov(msg, *off, iov);
+        ssize_t done;
+        while ((done = send_iov(tu->fd, iov, n)) < 0 && errno == EINTR)
+            ;
+        if (done < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (done <= 0) {
+            debug("Discarding output to fd %d", tu->fd);
+            *failed = 1;
+            *off = 0;
+            free_unwritten(msg, bytes, count);
+            msg = NULL;
+            break;
+        }
+        PBX_PROBE(notify_send, tu, tu->fd, done, n);
+        writes++;
+        written += done;
+        msg = free_written(msg, done, off, bytes, count);
+        if (*off > 0)
+            break;
+    }
+    if (*count > 0 || writes > 0)
+        count_flush(writes, *count, written);
+    return msg;
+}
+
+/*
+ * Free everything in the outbound queue of a TU.  The caller must hold the
+ * queue lock, or the last reference to the TU.
+ */
+static void discard_output(TU *tu) {
+    while (tu->out_head != NULL) {
+        TU_MSG *msg = tu->out_head;
+        tu->out_head = msg->next;
+        free_msg(msg);
+    }
+    tu->out_tail = &tu->out_head;
+    tu->out_off = 0;
+    tu->out_bytes = 0;
+    tu->out_count = 0;
+}
+
+static void *flusher_thread(void *arg);
+
+static void start_flusher(void) {
+    pthread_t tid;
+    if ((flusher_epfd = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+        pthread_create(&tid, NULL, flusher_thread, NULL)) {
+        fprintf(stderr, "Failed to start flusher thread\n");
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(tid);
+}
+
+/*
+ * Hand a TU whose socket buffer is full to the flusher thread, which keeps a
+ * reference to it until it has finished the flush.
+ * The caller must own the flush of the TU, and passes that ownership on.
+ */
+static void wait_writable(TU *tu) {
+    pthread_once(&flusher_once, start_flusher);
+    __atomic_fetch_add(&get_stats()->blocked, 1, __ATOMIC_RELAXED);
+    tu_ref(tu, "Waiting to flush output");
+    struct epoll_event ev = { .events = EPOLLOUT | EPOLLONESHOT, .data.ptr = tu };
+    int op = tu->out_polled ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    tu->out_polled = 1;
+    if (epoll_ctl(flusher_epfd, op, tu->fd, &ev) < 0) {
+        // Can only fail if the connection is already gone.
+        debug("Failed to poll fd %d for output: %s", tu->fd, strerror(errno));
+        P(&tu->out_lock);
+        tu->out_failed = 1;
+        discard_output(tu);
+        tu->flushing = 0;
+        V(&tu->out_lock);
+        tu_unref(tu, "Failed to wait to flush output");
+    }
+}
+
+/*
+ * Hand the first write of a list of messages taken from the queue of a TU to
+ * the calling thread's submitter, which passes on the flush of the TU until
+ * tu_send_done() is called.
+ *
+ * @return 0 if the write was submitted, otherwise -1, in which case the
+ * caller still owns the flush and the messages.
+ */
+static int submit_msgs(TU *tu, TU_MSG *msgs, size_t off) {
+    TU_SEND *send = slab_alloc(send_pool);
+    if (send == NULL)
+        return -1;
+    send->tu = tu;
+    send->msgs = msgs;
+    send->off = off;
+    send->mh = (struct msghdr) { .msg_iov = send->iov,
+                                 .msg_iovlen = gather_iov(msgs, off, send->iov) };
+    tu_ref(tu, "Submitting output");
+    if (my_submit(my_submit_arg, tu->fd, &send->mh, send)) {
+        tu_unref(tu, "Failed to submit output");
+        slab_free(send_pool, send);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Write out the outbound queue of a TU.  The caller must own the flush of the
+ * TU, that is, must be the one that set tu->flushing.  The queue lock is not
+ * held while writing, so a slow client does not hold up the threads queueing
+ * messages for it.  If the socket buffer fills, the flush is handed to the
+ * flusher thread, otherwise it is released once the queue is empty.  On a
+ * thread with a submitter, the write is submitted instead, and the flush
+ * carries on in tu_send_done() once it completes.
+ */
+static void drain_output(TU *tu) {
+    P(&tu->out_lock);
+    while (tu->out_head != NULL) {
+        TU_MSG *msgs = tu->out_head;
+        size_t off = tu->out_off;
+        tu->out_head = NULL;
+        tu->out_tail = &tu->out_head;
+        tu->out_off = 0;
+        V(&tu->out_lock);
+        if (my_submit != NULL && submit_msgs(tu, msgs, off) == 0)
+            return;
+        size_t bytes;
+        int count, failed;
+        TU_MSG *rest = write_msgs(tu, msgs, &off, &bytes, &count, &failed);
+        P(&tu->out_lock);
+        tu->out_bytes -= bytes;
+        tu->out_count -= count;
+        if (failed)
+            tu->out_failed = 1;
+        if (rest != NULL) {
+            tu->out_off = off;
+            TU_MSG *last = rest;
+            while (last->next != NULL)
+                last = last->next;
+            if ((last->next = tu->out_head) == NULL)
+                tu->out_tail = &last->next;
+            tu->out_head = rest;
+            V(&tu->out_lock);
+            wait_writable(tu);
+            return;
+        }
+    }
+    tu->flushing = 0;
+    V(&tu->out_lock);
+}
+
+/*
+ * Write out the outbound queue of a TU, unless another thread is already
+ * doing so.  Only one thread flushes a given TU at a time, which keeps the
+ * messages in order: a thread that finds a flush in progress leaves its
+ * messages for that flush, which keeps taking the queue until it is empty.
+ */
+static void flush_output(TU *tu) {
+    P(&tu->out_lock);
+    if (tu->flushing) {
+        V(&tu->out_lock);
+        return;
+    }
+    tu->flushing = 1;
+    V(&tu->out_lock);
+    drain_output(tu);
+}
+
+void tu_set_submitter(int (*submit)(void *arg, int fd, struct msghdr *msg, TU_SEND *send),
+                      void *arg) {
+    pthread_once(&tu_pool_once, create_tu_pool);
+    my_submit = submit;
+    my_submit_arg = arg;
+}
+
+/*
+ * Finish a submitted write: free the messages it completed, put back the
+ * rest at the head of the queue, and carry on with the flush.  A write that
+ * would have blocked is handed to the flusher thread, as in write_msgs().
+ */
+void tu_send_done(TU_SEND *send, int res) {
+    TU *tu = send->tu;
+    TU_MSG *rest = send->msgs;
+    size_t off = send->off;
+    size_t bytes = 0;
+    int count = 0;
+    int blocked = res == -EAGAIN || res == -EWOULDBLOCK || res == -EINTR;
+    int failed = res <= 0 && !blocked;
+    if (failed) {
+        debug("Discarding output to fd %d", tu->fd);
+        free_unwritten(rest, &bytes, &count);
+        rest = NULL;
+        off = 0;
+    }
+    else if (res > 0) {
+        PBX_PROBE(notify_send, tu, tu->fd, res, (int) send->mh.msg_iovlen);
+        rest = free_written(rest, res, &off, &bytes, &count);
+        count_flush(1, count, res);
+    }
+    slab_free(send_pool, send);
+    P(&tu->out_lock);
+    tu->out_bytes -= bytes;
+    tu->out_count -= count;
+    if (failed)
+        tu->out_failed = 1;
+    if (rest != NULL) {
+        TU_MSG *last = rest;
+        while (last->next != NULL)
+            last = last->next;
+        if ((last->next = tu->out_head) == NULL)
+            tu->out_tail = &last->next;
+        tu->out_head = rest;
+        tu->out_off = off;
+    }
+    V(&tu->out_lock);
+    if (blocked)
+        wait_writable(tu);
+    else
+        drain_output(tu);
+    tu_unref(tu, "Submitted output");
+}
+
+static void *flusher_thread(void *arg) {
+    struct epoll_event events[TU_FLUSH_IOV];
+    while (1) {
+        int n = epoll_wait(flusher_epfd, events, TU_FLUSH_IOV, -1);
+        if (n < 0 && errno != EINTR) {
+            fprintf(stderr, "epoll_wait failed: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < n; i++) {
+            TU *tu = events[i].data.ptr;
+            drain_output(tu);
+            tu_unref(tu, "Flushed output");
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Write out the output of every TU on the calling thread's pending list,
+ * and empty the list.
+ */
+void tu_flush_pending(void) {
+    for (int i = 0; i < num_pending; i++) {
+        flush_output(pending[i]);
+        tu_unref(pending[i], "Flushed output");
+    }
+    num_pending = 0;
+}
+
+/*
+ * Put a TU on the calling thread's pending list, unless it is already there.
+ * The list holds a reference to the TU until it has been flushed.
+ */
+static void add_pending(TU *tu) {
+    for (int i = 0; i < num_pending; i++)
+        if (pending[i] == tu)
+            return;
+    if (num_pending == TU_PENDING_MAX)
+        tu_flush_pending();
+    tu_ref(tu, "Output pending");
+    pending[num_pending++] = tu;
+}
+
+/*
+ * Remove the state notifications from the outbound queue of a TU, except one
+ * that is partly written already.  The caller must hold the queue lock.
+ */
+static void coalesce_output(TU *tu) {
+    TU_MSG **link = &tu->out_head;
+    if (*link != NULL && tu->out_off > 0)
+        link = &(*link)->next;
+    while (*link != NULL) {
+        TU_MSG *msg = *link;
+        if (!msg->state) {
+            link = &msg->next;
+            continue;
+        }
+        *link = msg->next;
+        tu->out_bytes -= msg->len;
+        tu->out_count--;
+        free_msg(msg);
+        __atomic_fetch_add(&get_stats()->coalesced, 1, __ATOMIC_RELAXED);
+    }
+    tu->out_tail = link;
+}
+
+/*
+ * Append a message to the outbound queue of a TU, applying the overflow
+ * policy if the queue would go past tu_output_limit bytes.  The caller must
+ * hold the queue lock.
+ *
+ * @return 0 if the message was queued, -1 if it was discarded.
+ */
+static int enqueue_msg(TU *tu, TU_MSG *msg) {
+    if (tu->out_failed)
+        return -1;
+    if (tu->out_bytes + msg->len > tu_output_limit) {
+        switch (tu_overflow_policy) {
+            case TU_OVERFLOW_DISCONNECT:
+            debug("Output to fd %d overflowed; disconnecting", tu->fd);
+            __atomic_fetch_add(&get_stats()->disconnects, 1, __ATOMIC_RELAXED);
+            tu->out_failed = 1;
+            shutdown(tu->fd, SHUT_RDWR);
+            return -1;
+
+            case TU_OVERFLOW_COALESCE:
+            if (msg->state) {
+                coalesce_output(tu);
+                break;
+            }
+            // Chat is dropped, as with TU_OVERFLOW_DROP.
+
+            case TU_OVERFLOW_DROP:
+            if (!msg->state) {
+                __atomic_fetch_add(&get_stats()->dropped, 1, __ATOMIC_RELAXED);
+                return -1;
+            }
+        }
+    }
+    msg->next = NULL;
+    *tu->out_tail = msg;
+    tu->out_tail = &msg->next;
+    tu->out_bytes += msg->len;
+    tu->out_count++;
+    return 0;
+}
+
+/*
+ * Gather a message from its parts into a single buffer.
+ *
+ * @param state  Nonzero if the message is a state notification, which the
+ * overflow policy treats differently from chat.
+ * @return the message, or NULL if it could not be allocated.
+ */
+static TU_MSG *gather_msg(int state, struct iovec *iov, int n) {
+    size_t len = 0;
+    for (int i = 0; i < n; i++)
+        len += iov[i].iov_len;
+    TU_MSG *msg;
+    if (len <= TU_MSG_SMALL) {
+        if ((msg = slab_alloc(msg_pool)) != NULL)
+            msg->pooled = 1;
+    }
+    else if ((msg = malloc(sizeof(TU_MSG) + len)) != NULL) {
+        msg->pooled = 0;
+    }
+    if (msg == NULL)
+        return NULL;
+    msg->len = 0;
+    for (int i = 0; i < n; i++) {
+        memcpy(msg->data + msg->len, iov[i].iov_base, iov[i].iov_len);
+        msg->len += iov[i].iov_len;
+    }
+    msg->state = state;
+    return msg;
+}
+
+/*
+ * Gather a message from its parts and append it to the outbound queue of a TU.
+ * The caller must hold the claim on the TU, which orders the messages.
+ */
+static void queue_parts(TU *tu, int state, struct iovec *iov, int n) {
+    TU_MSG *msg = gather_msg(state, iov, n);
+    if (msg == NULL) {
+        debug("Failed to allocate message; message dropped");
+        return;
+    }
+    P(&tu->out_lock);
+    int err = enqueue_msg(tu, msg);
+    V(&tu->out_lock);
+    if (err)
+        free_msg(msg);
+    else
+        add_pending(tu);
+}
+
+/*
+ * Describe a chat message as it is to be sent to the client of a TU, in the
+ * protocol spoken by that client.  The caller must hold the claim on the TU.
+ *
+ * A chat from a binary client may contain any bytes.  For a text client, CR,
+ * LF and NUL are replaced by spaces, in a copy of the message, since they
+ * would otherwise end the CHAT line early and let the sender forge lines of
+ * the protocol, such as state notifications, to the peer.
+ *
+ * @param hdr  Storage for the header of a binary frame.
+ * @param copy  Set to the copy of the message made, if any, which the caller
+ * must free once the parts have been queued; otherwise NULL.
+ * @param iov  Set to the parts of the message.
+ * @return the number of parts, or 0 if a copy was needed and could not be
+ * made.
+ */
+static int chat_parts(TU *tu, char *msg, size_t len, PROTO_HEADER *hdr, char **copy,
+                      struct iovec *iov) {
+    *copy = NULL;
+    if (tu->binary) {
+        *hdr = (PROTO_HEADER) { .op = PROTO_CHAT, .arg = htonl(len) };
+        iov[0] = (struct iovec) { .iov_base = hdr, .iov_len = PROTO_HEADER_LEN };
+        iov[1] = (struct iovec) { .iov_base = msg, .iov_len = len };
+        return 2;
+    }
+    size_t i = 0;
+    while (i < len && msg[i] != '\r' && msg[i] != '\n' && msg[i] != '\0')
+        i++;
+    if (i < len) {
+        if ((*copy = malloc(len)) == NULL)
+            return 0;
+        for (i = 0; i < len; i++)
+            (*copy)[i] = msg[i] == '\r' || msg[i] == '\n' || msg[i] == '\0' ? ' ' : msg[i];
+        msg = *copy;
+    }
+    iov[0] = (struct iovec) { .iov_base = "CHAT ", .iov_len = 5 };
+    iov[1] = (struct iovec) { .iov_base = msg, .iov_len = len };
+    iov[2] = (struct iovec) { .iov_base = "\r\n", .iov_len = 2 };
+    return 3;
+}
+
+/*
+ * Take the flush of a TU that has no output waiting, so that a chat message
+ * can be relayed to it by relay_chat() once the caller's claims are released.
+ * Output queued for the TU meanwhile is left for the owner of the flush, so
+ * it goes out after the chat.  The caller must hold the claim on the TU.
+ *
+ * @return nonzero if the flush was taken, 0 if output is already waiting or
+ * being written, in which case the message must be queued behind it.
+ */
+static int reserve_output(TU *tu) {
+    P(&tu->out_lock);
+    int reserved = tu->out_head == NULL && !tu->flushing && !tu->out_failed;
+    if (reserved)
+        tu->flushing = 1;
+    V(&tu->out_lock);
+    return reserved;
+}
+
+/*
+ * Write a chat message to the client of a TU straight from its parts, which
+ * point into the sender's input buffer, so that the payload is not copied
+ * into a queued message.  The caller must own the flush of the TU, taken with
+ * reserve_output(), and must not hold any claims, as the write is a system
+ * call.  Only the unwritten remainder of a partial write is copied, to the
+ * head of the queue, and the output queued behind the chat is then written
+ * out as by any other flush.
+ */
+static void relay_chat(TU *tu, struct iovec *iov, int n) {
+    size_t total = 0;
+    for (int i = 0; i < n; i++)
+        total += iov[i].iov_len;
+    ssize_t done;
+    while ((done = send_iov(tu->fd, iov, n)) < 0 && errno == EINTR)
+        ;
+    if (done < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        debug("Discarding output to fd %d", tu->fd);
+        P(&tu->out_lock);
+        tu->out_failed = 1;
+        V(&tu->out_lock);
+        drain_output(tu);
+        return;
+    }
+    if (done > 0) {
+        PBX_PROBE(notify_send, tu, tu->fd, done, n);
+        count_flush(1, (size_t) done == total, done);
+        __atomic_fetch_add(&get_stats()->relayed, 1, __ATOMIC_RELAXED);
+    }
+    else {
+        done = 0;
+    }
+    if ((size_t) done < total) {
+        TU_MSG *rest = gather_msg(0, iov, n);
+        P(&tu->out_lock);
+        if (rest == NULL) {
+            debug("Failed to allocate message; discarding output to fd %d", tu->fd);
+            tu->out_failed = 1;
+            shutdown(tu->fd, SHUT_RDWR);
+        }
+        else {
+            if ((rest->next = tu->out_head) == NULL)
+                tu->out_tail = &rest->next;
+            tu->out_head = rest;
+            tu->out_off = done;
+            tu->out_bytes += rest->len;
+            tu->out_count++;
+        }
+        V(&tu->out_lock);
+    }
+    drain_output(tu);
+}
+
+/*
+ * Get the depth of the outbound queue of a TU.
+ *
+ * @param tu  The TU.
+ * @param bytes  Set to the number of bytes queued.
+ * @return the number of messages queued.
+ */
+int tu_queue_depth(TU *tu, size_t *bytes) {
+    P(&tu->out_lock);
+    int count = tu->out_count;
+    *bytes = tu->out_bytes;
+    V(&tu->out_lock);
+    return count;
+}
+
+/*
+ * Write the outbound message statistics accumulated by all threads.
+ *
+ * @param out  The stream to write to.
+ */
+void tu_stats(FILE *out) {
+    static char *bucket_names[TU_FLUSH_BUCKETS] = { "1", "2", "4", "8", "16", "+Inf" };
+    FLUSH_STATS total = { 0 };
+    for (int i = 0; i < TU_STATS_STRIPES; i++) {
+        total.flushes += __atomic_load_n(&flush_stats[i].flushes, __ATOMIC_RELAXED);
+        total.writes += __atomic_load_n(&flush_stats[i].writes, __ATOMIC_RELAXED);
+        total.messages += __atomic_load_n(&flush_stats[i].messages, __ATOMIC_RELAXED);
+        total.bytes += __atomic_load_n(&flush_stats[i].bytes, __ATOMIC_RELAXED);
+        for (int b = 0; b < TU_FLUSH_BUCKETS; b++)
+            total.buckets[b] += __atomic_load_n(&flush_stats[i].buckets[b], __ATOMIC_RELAXED);
+        total.blocked += __atomic_load_n(&flush_stats[i].blocked, __ATOMIC_RELAXED);
+        total.dropped += __atomic_load_n(&flush_stats[i].dropped, __ATOMIC_RELAXED);
+        total.coalesced += __atomic_load_n(&flush_stats[i].coalesced, __ATOMIC_RELAXED);
+        total.disconnects += __atomic_load_n(&flush_stats[i].disconnects, __ATOMIC_RELAXED);
+        total.relayed += __atomic_load_n(&flush_stats[i].relayed, __ATOMIC_RELAXED);
+        total.ring_timeouts += __atomic_load_n(&flush_stats[i].ring_timeouts, __ATOMIC_RELAXED);
+        total.idle_reaped += __atomic_load_n(&flush_stats[i].idle_reaped, __ATOMIC_RELAXED);
+        total.probes += __atomic_load_n(&flush_stats[i].probes, __ATOMIC_RELAXED);
+    }
+    fprintf(out, "tu_flushes %lu\n", total.flushes);
+    fprintf(out, "tu_flush_writes %lu\n", total.writes);
+    fprintf(out, "tu_flush_messages %lu\n", total.messages);
+    fprintf(out, "tu_flush_bytes %lu\n", total.bytes);
+    fprintf(out, "tu_flush_blocked %lu\n", total.blocked);
+    fprintf(out, "tu_overflow_dropped %lu\n", total.dropped);
+    fprintf(out, "tu_overflow_coalesced %lu\n", total.coalesced);
+    fprintf(out, "tu_overflow_disconnects %lu\n", total.disconnects);
+    fprintf(out, "tu_chat_relayed %lu\n", total.relayed);
+    fprintf(out, "tu_ring_timeouts %lu\n", total.ring_timeouts);
+    fprintf(out, "tu_idle_reaped %lu\n", total.idle_reaped);
+    fprintf(out, "tu_keepalive_probes %lu\n", total.probes);
+    unsigned long cumulative = 0;
+    for (int b = 0; b < TU_FLUSH_BUCKETS; b++) {
+        cumulative += total.buckets[b];
+        fprintf(out, "tu_flush_messages_bucket{le=\"%s\"} %lu\n", bucket_names[b], cumulative);
     }
 }
 
+/*
+ * Send a notification of the state recorded in a word to the client of a TU.
+ * The caller must hold the claim on the TU.
+ */
+static void print_state(TU *tu, unsigned long word) {
+    TU_STATE state = WORD_STATE(word);
+    int ext = state == TU_ON_HOOK ? tu->ext : state == TU_CONNECTED ? WORD_PEER(word)->ext : 0;
+    PROTO_HEADER hdr;
+    char line[TU_MSG_SMALL];
+    struct iovec iov;
+    if (tu->binary) {
+        hdr = (PROTO_HEADER) { .op = PROTO_STATE, .state = state, .arg = htonl(ext) };
+        iov = (struct iovec) { .iov_base = &hdr, .iov_len = PROTO_HEADER_LEN };
+    }
+    else {
+        int n;
+        if (state == TU_ON_HOOK || state == TU_CONNECTED)
+            n = snprintf(line, sizeof(line), "%s %d\r\n", tu_state_names[state], ext);
+        else
+            n = snprintf(line, sizeof(line), "%s\r\n", tu_state_names[state]);
+        iov = (struct iovec) { .iov_base = line, .iov_len = n };
+    }
+    PBX_PROBE(notify_queue, tu, state);
+    queue_parts(tu, 1, &iov, 1);
+}
+
 /*
  * Initialize a TU
  *
@@ -44,21 +983,66 @@ void print_state(TU *tu) {
 // #if 0
 TU *tu_init(int fd) {
     // TO BE IMPLEMENTED
-    TU *tu = calloc(1, sizeof(TU));
+    pthread_once(&tu_pool_once, create_tu_pool);
+    TU *tu = tu_pool ? slab_alloc(tu_pool) : NULL;
     if (tu == NULL) {
         return NULL;
     }
-    Sem_init(&tu->mutex, 0, 1);
     tu->fd = fd;
+    Sem_init(&tu->out_lock, 0, 1);
+    tu->out_tail = &tu->out_head;
+#ifdef DEBUG
+    pthread_mutex_lock(&live_tus_lock);
+    tu->live_next = live_tus;
+    if (live_tus != NULL)
+        live_tus->live_prev = tu;
+    live_tus = tu;
+    pthread_mutex_unlock(&live_tus_lock);
+#endif
     return tu;
 }
 // #endif
 
-// tu_ref, but it assumes there is already a lock on tu
-void tu_ref_nl(TU *tu, char *reason) {
-    tu->ref_count += 1;
-    debug("Refing because: %s. Ref count: %d", reason, tu->ref_count);
+#ifdef DEBUG
+/*
+ * Add a reference count change to the history of a TU.
+ *
+ * @return the entry, whose count may still be corrected by the caller while
+ * it holds its reference.
+ */
+static TU_REF_EVENT *record_ref(TU *tu, char *reason, int delta, int count) {
+    unsigned int i = __atomic_fetch_add(&tu->ref_events, 1, __ATOMIC_RELAXED);
+    TU_REF_EVENT *event = &tu->ref_history[i % TU_REF_HISTORY];
+    event->reason = reason;
+    event->delta = delta;
+    event->count = count;
+    return event;
+}
+
+/*
+ * Write the extension, reference count and recent reference count changes
+ * of every TU that has not yet been freed.
+ *
+ * @param out  The stream to write to.
+ */
+void tu_dump_live(FILE *out) {
+    pthread_mutex_lock(&live_tus_lock);
+    for (TU *tu = live_tus; tu != NULL; tu = tu->live_next) {
+        unsigned int events = __atomic_load_n(&tu->ref_events, __ATOMIC_RELAXED);
+        fprintf(out, "TU ext %d fd %d: ref count %d\n", tu->ext, tu->fd,
+                __atomic_load_n(&tu->ref_count, __ATOMIC_RELAXED));
+        unsigned int first = events > TU_REF_HISTORY ? events - TU_REF_HISTORY : 0;
+        for (unsigned int i = first; i < events; i++) {
+            TU_REF_EVENT *event = &tu->ref_history[i % TU_REF_HISTORY];
+            fprintf(out, "  %+d -> %d: %s\n", event->delta, event->count, event->reason);
+        }
+    }
+    pthread_mutex_unlock(&live_tus_lock);
+}
+#else
+void tu_dump_live(FILE *out) {
 }
+#endif
 
 /*
  * Increment the reference count on a TU.
@@ -70,9 +1054,13 @@ void tu_ref_nl(TU *tu, char *reason) {
 // #if 0
 void tu_ref(TU *tu, char *reason) {
     // TO BE IMPLEMENTED
-    P(&tu->mutex);
-    tu_ref_nl(tu, reason);
-    V(&tu->mutex);
+#ifdef DEBUG
+    int count = __atomic_add_fetch(&tu->ref_count, 1, __ATOMIC_RELAXED);
+    debug("Refing because: %s. Ref count: %d", reason, count);
+    record_ref(tu, reason, 1, count);
+#else
+    __atomic_add_fetch(&tu->ref_count, 1, __ATOMIC_RELAXED);
+#endif
 }
 // #endif
 
@@ -86,19 +1074,46 @@ void tu_ref(TU *tu, char *reason) {
 // #if 0
 void tu_unref(TU *tu, char *reason) {
     // TO BE IMPLEMENTED
-    P(&tu->mutex);
-    tu->ref_count -= 1;
-    debug("Unrefing because: %s. Ref count: %d", reason, tu->ref_count);
-    if (tu->ref_count == 0) {
-        debug("Deleting tu");
-        V(&tu->mutex);
-        close(tu->fd);
-        sem_destroy(&tu->mutex);
-        free(tu);
-    }
-    else {
-        V(&tu->mutex);
+    // The release half makes this thread's prior accesses to the TU happen
+    // before the thread that drops the last reference frees it, and the
+    // acquire half orders that free after them.  (An acquire fence on the
+    // last drop would do, but ThreadSanitizer does not model fences.)
+#ifdef DEBUG
+    // Once the count is dropped another thread may free the TU, so the
+    // change is recorded first, with the count it is about to be set to.
+    int count = __atomic_load_n(&tu->ref_count, __ATOMIC_RELAXED);
+    TU_REF_EVENT *event = record_ref(tu, reason, -1, count - 1);
+    while (!__atomic_compare_exchange_n(&tu->ref_count, &count, count - 1, 1,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        event->count = count - 1;
+    count--;
+#else
+    int count = __atomic_sub_fetch(&tu->ref_count, 1, __ATOMIC_ACQ_REL);
+#endif
+    debug("Unrefing because: %s. Ref count: %d", reason, count);
+#ifdef DEBUG
+    if (count < 0) {
+        error("Reference count of TU went negative");
+        tu_dump_live(stderr);
     }
+#endif
+    if (count != 0)
+        return;
+    debug("Deleting tu");
+#ifdef DEBUG
+    pthread_mutex_lock(&live_tus_lock);
+    if (tu->live_prev != NULL)
+        tu->live_prev->live_next = tu->live_next;
+    else
+        live_tus = tu->live_next;
+    if (tu->live_next != NULL)
+        tu->live_next->live_prev = tu->live_prev;
+    pthread_mutex_unlock(&live_tus_lock);
+#endif
+    close(tu->fd);
+    sem_destroy(&tu->out_lock);
+    discard_output(tu);
+    slab_free(tu_pool, tu);
 }
 // #endif
 
@@ -113,11 +1128,8 @@ void tu_unref(TU *tu, char *reason) {
  */
 // #if 0
 int tu_fileno(TU *tu) {
-    // TO BE IMPLEMENTED
-    P(&tu->mutex);
-    int fd = tu->fd;
-    V(&tu->mutex);
-    return fd;
+    // The descriptor does not change over the life of the TU.
+    return tu->fd;
 }
 // #endif
 
@@ -133,74 +1145,206 @@ int tu_fileno(TU *tu) {
  */
 // #if 0
 int tu_extension(TU *tu) {
-    // TO BE IMPLEMENTED
-    P(&tu->mutex);
-    int ext = tu->ext;
-    V(&tu->mutex);
-    return ext;
+    return __atomic_load_n(&tu->ext, __ATOMIC_ACQUIRE);
 }
 // #endif
 
 /*
  * Set the extension number for a TU.
  * A notification is set to the client of the TU.
- * This function should be called at most once one any particular TU.
+ * This function is called when the TU is registered, and again whenever it
+ * is moved to another extension (or its client is to be reminded of the
+ * current one).
  *
  * @param tu  The TU whose extension is being set.
  */
 // #if 0
 int tu_set_extension(TU *tu, int ext) {
-    // TO BE IMPLEMENTED
     if (tu == NULL)
         return -1;
-    P(&tu->mutex);
-    tu->ext = ext;
-    print_state(tu);
-    V(&tu->mutex);
+    unsigned long word = claim(tu);
+    __atomic_store_n(&tu->ext, ext, __ATOMIC_RELEASE);
+    print_state(tu, word);
+    commit(tu, word);
     return 0;
 }
 // #endif
 
-void lock(TU *tu, TU *target) {
-    P(&tu->mutex);
-    int tu_fd = tu->fd;
-    V(&tu->mutex);
-
-    P(&target->mutex);
-    int target_fd = target->fd;
-    V(&target->mutex);
-    
-    if (tu_fd == target_fd) {
-        debug("WHAT - tu == target");
-        exit(EXIT_FAILURE);
-    }
-    else if (tu_fd < target_fd) {
-        P(&tu->mutex);
-        P(&target->mutex);
+/*
+ * Switch the client of a TU to the binary protocol described in proto.h.
+ * Notifications queued before the switch are still sent as text; the
+ * current state of the TU is then sent as the first binary frame.
+ *
+ * @param tu  The TU.
+ */
+void tu_set_binary(TU *tu) {
+    unsigned long word = claim(tu);
+    tu->binary = 1;
+    print_state(tu, word);
+    commit(tu, word);
+}
+
+/*
+ * Record an operation on a claimed TU in the flight recorder, and fire its
+ * tu_state probe, given its word before and after.  The peer recorded is the
+ * one it has afterwards, or the one it had before if it no longer has one.
+ */
+static void record(FLIGHT_OP op, TU *tu, unsigned long old, unsigned long new) {
+    PBX_PROBE(tu_state, tu, tu->ext, op, WORD_STATE(old), WORD_STATE(new));
+    TU *peer = WORD_PEER(new) != NULL ? WORD_PEER(new) : WORD_PEER(old);
+    flight_record(op, tu, tu->ext, WORD_STATE(old), WORD_STATE(new),
+                  peer, peer != NULL ? tu_extension(peer) : -1);
+}
+
+/*
+ * Hang up a TU, as tu_hangup() does.
+ *
+ * @param unanswered  If nonzero, only hang up a TU whose call is still
+ * ringing; a TU in any other state is left alone.
+ * @return 0 if the TU was hung up, otherwise -1.
+ */
+static int hangup(TU *tu, int unanswered) {
+    unsigned long peer_word;
+    unsigned long word = claim_with_peer(tu, &peer_word);
+    unsigned long old = word, peer_old = peer_word;
+    FLIGHT_OP op = unanswered ? FLIGHT_RING_TIMEOUT : FLIGHT_HANGUP;
+    TU *peer = WORD_PEER(word);
+    if (unanswered && WORD_STATE(word) != TU_RING_BACK) {
+        if (peer != NULL)
+            commit(peer, peer_word);
+        commit(tu, word);
+        return -1;
     }
-    else if (target_fd < tu_fd) {
-        P(&target->mutex);
-        P(&tu->mutex);
+    if (peer == NULL) {
+        word = TU_WORD(TU_ON_HOOK, NULL);
+        record(op, tu, old, word);
+        print_state(tu, word);
+        commit(tu, word);
+        return 0;
     }
+
+    // The caller being rung back hangs up: the called TU stops ringing.
+    // Otherwise the peer is left off hook, with a dial tone.
+    peer_word = TU_WORD(WORD_STATE(word) == TU_RING_BACK ? TU_ON_HOOK : TU_DIAL_TONE, NULL);
+    word = TU_WORD(TU_ON_HOOK, NULL);
+    record(op, tu, old, word);
+    record(op, peer, peer_old, peer_word);
+    print_state(tu, word);
+    print_state(peer, peer_word);
+    commit(peer, peer_word);
+    commit(tu, word);
+    tu_unref(tu, "Hung up");
+    tu_unref(peer, "Got hung up on");
+    return 0;
 }
 
-void unlock(TU *tu, TU *target) {
-    debug("Before locking 2");
-    int tu_fd = tu->fd;
-    int target_fd = target->fd;
-    
-    if (tu_fd == target_fd) {
-        debug("WHAT - tu == target");
-        exit(EXIT_FAILURE);
+/*
+ * Timers.  An armed timer holds a reference to its TU, which is handed to the
+ * timer's function when it expires, so the function must either re-arm the
+ * timer or drop the reference.
+ */
+static void arm_timer(TU *tu, TIMER *timer, unsigned long ms, void (*fn)(TIMER *timer)) {
+    if (!timer_arm(timer, ms, fn))
+        tu_ref(tu, "Timer armed");
+}
+
+static void cancel_timer(TU *tu, TIMER *timer) {
+    if (timer_cancel(timer))
+        tu_unref(tu, "Timer cancelled");
+}
+
+/*
+ * A call has rung for tu_ring_timeout milliseconds since the caller last
+ * dialed: if it is still unanswered, the caller is hung up.  A later dial
+ * would have moved the timer, so a call still ringing is the one it was
+ * armed for.
+ */
+static void ring_expired(TIMER *timer) {
+    TU *tu = (TU *) ((char *) timer - offsetof(TU, ring_timer));
+    if (hangup(tu, 1) == 0) {
+        debug("Call from %d was not answered", tu->ext);
+        __atomic_fetch_add(&get_stats()->ring_timeouts, 1, __ATOMIC_RELAXED);
+        tu_flush_pending();
     }
-    else if (target_fd < tu_fd) {
-        V(&tu->mutex);
-        V(&target->mutex);
+    tu_unref(tu, "Ring timer expired");
+}
+
+/*
+ * The connection of a TU may have been idle long enough to probe or reap.
+ * Input does not move the timer, as that would take the timer lock on every
+ * read; it only records the time, and the timer is moved to the next deadline
+ * here.  A connection idle for tu_idle_timeout is shut down, after which its
+ * servicing thread sees EOF and tears it down as usual.  One idle for
+ * tu_keepalive_interval since its last input (or probe) is sent its current
+ * state, which is harmless to a live client and makes a dead connection fail.
+ */
+static void idle_expired(TIMER *timer) {
+    TU *tu = (TU *) ((char *) timer - offsetof(TU, idle_timer));
+    unsigned long now = timer_now();
+    unsigned long last = __atomic_load_n(&tu->last_input, __ATOMIC_RELAXED);
+    if (tu_idle_timeout > 0 && now - last >= tu_idle_timeout) {
+        debug("Reaping idle connection on fd %d", tu->fd);
+        __atomic_fetch_add(&get_stats()->idle_reaped, 1, __ATOMIC_RELAXED);
+        shutdown(tu->fd, SHUT_RDWR);
+        tu_unref(tu, "Reaped idle connection");
+        return;
     }
-    else if (tu_fd < target_fd) {
-        V(&target->mutex);
-        V(&tu->mutex);
+    unsigned long word = claim(tu);
+    unsigned long next = tu_idle_timeout > 0 ? last + tu_idle_timeout : ULONG_MAX;
+    if (tu_keepalive_interval > 0) {
+        unsigned long since = last > tu->last_probe ? last : tu->last_probe;
+        if (now - since >= tu_keepalive_interval) {
+            print_state(tu, word);
+            tu->last_probe = since = now;
+            __atomic_fetch_add(&get_stats()->probes, 1, __ATOMIC_RELAXED);
+        }
+        if (since + tu_keepalive_interval < next)
+            next = since + tu_keepalive_interval;
     }
+    // Re-arming under the claim keeps it from racing with tu_unwatch().
+    int rearm = !tu->unwatched;
+    if (rearm && timer_arm(timer, next > now ? next - now : 0, idle_expired))
+        rearm = 0;
+    commit(tu, word);
+    tu_flush_pending();
+    P(&tu->out_lock);
+    int failed = tu->out_failed;
+    V(&tu->out_lock);
+    if (failed)
+        shutdown(tu->fd, SHUT_RDWR);
+    if (!rearm)
+        tu_unref(tu, "Idle timer expired");
+}
+
+/*
+ * Start watching the connection of a TU for inactivity, if idle connections
+ * are reaped or probed.
+ */
+void tu_watch(TU *tu) {
+    if (tu_idle_timeout == 0 && tu_keepalive_interval == 0)
+        return;
+    __atomic_store_n(&tu->last_input, timer_now(), __ATOMIC_RELAXED);
+    unsigned long ms = tu_idle_timeout;
+    if (ms == 0 || (tu_keepalive_interval > 0 && tu_keepalive_interval < ms))
+        ms = tu_keepalive_interval;
+    arm_timer(tu, &tu->idle_timer, ms, idle_expired);
+}
+
+void tu_activity(TU *tu) {
+    if (tu_idle_timeout > 0 || tu_keepalive_interval > 0)
+        __atomic_store_n(&tu->last_input, timer_now(), __ATOMIC_RELAXED);
+}
+
+/*
+ * Cancel the timers of a TU whose connection is being torn down, so that
+ * they do not keep it alive until they expire.
+ */
+void tu_unwatch(TU *tu) {
+    unsigned long word = claim(tu);
+    tu->unwatched = 1;
+    commit(tu, word);
+    cancel_timer(tu, &tu->idle_timer);
+    cancel_timer(tu, &tu->ring_timer);
 }
 
 /*
@@ -235,50 +1379,59 @@ void unlock(TU *tu, TU *target) {
  */
 // #if 0
 int tu_dial(TU *tu, TU *target) {
-    P(&tu->mutex);
-    if (tu->state != TU_DIAL_TONE) {
+    if (target == NULL || target == tu) {
+        unsigned long word = claim(tu);
+        unsigned long old = word;
+        int res = 0;
+        if (WORD_STATE(word) != TU_DIAL_TONE) {
+            debug("Cannot dial - not in DIAL TONE state");
+        }
+        else if (target == NULL) {
+            debug("Updating to error state");
+            word = TU_WORD(TU_ERROR, NULL);
+            res = -1;
+        }
+        else {
+            word = TU_WORD(TU_BUSY_SIGNAL, NULL);
+        }
+        record(FLIGHT_DIAL, tu, old, word);
+        print_state(tu, word);
+        commit(tu, word);
+        return res;
+    }
+
+    // Both TUs are claimed up front, in address order, so that the target
+    // cannot change state between the check and the transition.
+    unsigned long word, target_word;
+    if (tu < target) {
+        word = claim(tu);
+        target_word = claim(target);
+    }
+    else {
+        target_word = claim(target);
+        word = claim(tu);
+    }
+    unsigned long old = word;
+    if (WORD_STATE(word) != TU_DIAL_TONE) {
         debug("Cannot dial - not in DIAL TONE state");
-        print_state(tu);
-        V(&tu->mutex);
-        return 0;
     }
-    if (target == NULL) {
-        debug("Updating to error state");
-        tu->state = TU_ERROR;
-        V(&tu->mutex);
-        return -1;
+    else if (WORD_STATE(target_word) != TU_ON_HOOK || WORD_PEER(target_word) != NULL) {
+        word = TU_WORD(TU_BUSY_SIGNAL, NULL);
     }
-    V(&tu->mutex);
-    
-    P(&target->mutex);
-    if (target->state != TU_ON_HOOK) {
-        V(&target->mutex);
-        
-        P(&tu->mutex);
-        tu->state = TU_BUSY_SIGNAL;
-        print_state(tu);
-        V(&tu->mutex);
-        return 0;
+    else {
+        tu_ref(tu, "Is the caller");
+        tu_ref(target, "Is being called");
+        word = TU_WORD(TU_RING_BACK, target);
+        record(FLIGHT_DIAL, target, target_word, TU_WORD(TU_RINGING, tu));
+        target_word = TU_WORD(TU_RINGING, tu);
+        print_state(target, target_word);
+        if (tu_ring_timeout > 0)
+            arm_timer(tu, &tu->ring_timer, tu_ring_timeout, ring_expired);
     }
-    else
-        V(&target->mutex);
-    
-    debug("About to lock tu and target");
-    lock(tu, target);
-    debug("Successfully locked");
- 
-    tu->state = TU_RING_BACK;
-    tu->peer = target;
-    tu_ref_nl(tu, "Is the caller");
-    target->state = TU_RINGING;
-    target->peer = tu;
-    tu_ref_nl(target, "Is being called");
-    print_state(tu);
-    print_state(target);
-
-    debug("About to unlock tu and target");
-    unlock(tu, target);
-    debug("Successfully unlocked");
+    record(FLIGHT_DIAL, tu, old, word);
+    print_state(tu, word);
+    commit(target, target_word);
+    commit(tu, word);
     return 0;
 }
 // #endif
@@ -302,36 +1455,34 @@ int tu_dial(TU *tu, TU *target) {
  */
 // #if 0
 int tu_pickup(TU *tu) {
-    // TO BE IMPLEMENTED
-    P(&tu->mutex);
-    debug("State before pickup: %s", tu_state_names[tu->state]);
-    switch (tu->state) {
+    unsigned long peer_word;
+    unsigned long word = claim_with_peer(tu, &peer_word);
+    unsigned long old = word;
+    TU *peer = WORD_PEER(word);
+    debug("State before pickup: %s", tu_state_names[WORD_STATE(word)]);
+    switch (WORD_STATE(word)) {
         case TU_ON_HOOK:
-        tu->state = TU_DIAL_TONE;
-        print_state(tu);
-        debug("New state: %s", tu_state_names[tu->state]);
-        V(&tu->mutex);
+        word = TU_WORD(TU_DIAL_TONE, NULL);
+        print_state(tu, word);
+        debug("New state: %s", tu_state_names[WORD_STATE(word)]);
         break;
 
         case TU_RINGING:
-        V(&tu->mutex);
-        TU *target = tu->peer;
-        lock(tu, target);
-
-        tu->state = TU_CONNECTED;
-        target->state = TU_CONNECTED;
-
-        print_state(tu);
-        print_state(target);
-
-        unlock(tu, target);
-
+        word = TU_WORD(TU_CONNECTED, peer);
+        record(FLIGHT_PICKUP, peer, peer_word, TU_WORD(TU_CONNECTED, tu));
+        peer_word = TU_WORD(TU_CONNECTED, tu);
+        print_state(tu, word);
+        print_state(peer, peer_word);
+        metrics_count(METRICS_CALLS);
         break;
 
         default:
-        print_state(tu);
-        V(&tu->mutex);
+        print_state(tu, word);
     }
+    record(FLIGHT_PICKUP, tu, old, word);
+    if (peer != NULL)
+        commit(peer, peer_word);
+    commit(tu, word);
     return 0;
 }
 // #endif
@@ -359,39 +1510,7 @@ int tu_pickup(TU *tu) {
  */
 // #if 0
 int tu_hangup(TU *tu) {
-    // TO BE IMPLEMENTED
-    P(&tu->mutex);
-    switch (tu->state) {
-        case TU_CONNECTED:
-        case TU_RINGING:
-        case TU_RING_BACK:
-        TU *target = tu->peer;
-        V(&tu->mutex);
-        lock(tu, target);
-        
-        tu->state = TU_ON_HOOK;
-        tu->peer = NULL;
-        if (tu->state == TU_RING_BACK)
-            target->state = TU_ON_HOOK;
-        else
-            target->state = TU_DIAL_TONE;
-        target->peer = NULL;
-        print_state(tu);
-        print_state(target);
-
-        unlock(tu, target);
-
-        tu_unref(tu, "Hung up");
-        tu_unref(target, "Got hung up on");
-        break;
-
-        default:
-        tu->state = TU_ON_HOOK;
-        print_state(tu);
-        V(&tu->mutex);
-        break;
-    }
-    return 0;
+    return hangup(tu, 0);
 }
 // #endif
 
@@ -410,16 +1529,52 @@ int tu_hangup(TU *tu) {
  */
 // #if 0
 int tu_chat(TU *tu, char *msg) {
-    // TO BE IMPLEMENTED
-    P(&tu->mutex);
-    if (tu->state != TU_CONNECTED) {
-        print_state(tu);
-        V(&tu->mutex);
-        return -1;
+    return tu_chat_bytes(tu, msg, strlen(msg));
+}
+// #endif
+
+/*
+ * "Chat" over a connection, as tu_chat() does, with a message of the given
+ * length that may contain any bytes.
+ */
+int tu_chat_bytes(TU *tu, char *msg, size_t len) {
+    // Claiming the peer as well keeps the chat from being interleaved with
+    // its notifications.
+    unsigned long peer_word;
+    unsigned long word = claim_with_peer(tu, &peer_word);
+    TU *peer = WORD_PEER(word);
+    int res = -1;
+    PROTO_HEADER hdr;
+    struct iovec iov[3];
+    char *copy = NULL;
+    int n = 0, relay = 0;
+    if (WORD_STATE(word) == TU_CONNECTED) {
+        n = chat_parts(peer, msg, len, &hdr, &copy, iov);
+        // A message small enough for the pool costs next to nothing to queue.
+        // A thread with a submitter sends its output through it instead.
+        if (n > 0 && tu_relay_chat && len > TU_MSG_SMALL && my_submit == NULL &&
+            reserve_output(peer)) {
+            tu_ref(peer, "Relaying chat");
+            relay = 1;
+        }
+        else if (n > 0) {
+            queue_parts(peer, 0, iov, n);
+        }
+        metrics_count(METRICS_CHATS);
+        record(FLIGHT_CHAT, tu, word, word);
+        res = 0;
     }
-    dprintf(tu->peer->fd, "CHAT %s\r\n", msg);
-    print_state(tu);
-    V(&tu->mutex);
-    return 0;
+    print_state(tu, word);
+    if (peer != NULL)
+        commit(peer, peer_word);
+    commit(tu, word);
+    // The flush of the peer, taken under the claims, keeps anything sent to
+    // it from here on behind the chat.
+    if (relay) {
+        relay_chat(peer, iov, n);
+        tu_unref(peer, "Relayed chat");
+    }
+    free(copy);
+    return res;
 }
 // #endif
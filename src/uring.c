@@ -0,0 +1,325 @@
+/*
+ * io_uring server mode: multishot accept and multishot receive into a ring of
+ * provided buffers, with the output of the commands sent by SENDMSG entries
+ * on the same ring.  The raw system call interface is used directly.
+ */
+#include <stdlib.h>
+#include <pthread.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "csapp.h"
+#include "pbx.h"
+#include "server.h"
+#include "uring.h"
+#include "affinity.h"
+#include "slab.h"
+#include "debug.h"
+
+#define URING_ENTRIES 256
+#define URING_BUF_COUNT 256
+#define URING_BUF_LEN 2048
+#define URING_BGID 0
+
+/*
+ * User data value used for the completions of the multishot accept.
+ * Completions for receives carry a pointer to the connection instead, and
+ * those for sends a pointer to the TU_SEND with URING_SEND_TAG set, which
+ * slab objects leave clear.
+ */
+#define URING_ACCEPT_TAG 1
+#define URING_SEND_TAG 2
+
+typedef struct ring_conn {
+    int fd;
+    TU *tu;
+    LINE_PARSER lines;
+} RING_CONN;
+
+static SLAB_POOL *conn_pool;
+static pthread_once_t conn_pool_once = PTHREAD_ONCE_INIT;
+
+static void create_conn_pool(void) {
+    conn_pool = slab_pool_create("ring_conn", sizeof(RING_CONN));
+}
+
+typedef struct ring {
+    int fd;
+    int listenfd;
+    unsigned sq_entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned to_submit;
+    struct io_uring_buf_ring *br;
+    char *bufs;
+    pthread_t tid;
+    sem_t ready;
+    int setup_error;
+} RING;
+
+static int ring_enter(RING *ring, unsigned wait_nr) {
+    int ret;
+    do {
+        ret = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, wait_nr,
+                      wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+    if (ret >= 0)
+        ring->to_submit -= ret;
+    return ret;
+}
+
+/*
+ * Get the next free submission queue entry, flushing queued submissions to
+ * the kernel first if the queue is full.
+ */
+static struct io_uring_sqe *ring_get_sqe(RING *ring) {
+    unsigned tail = *ring->sq_tail;
+    while (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+        if (ring_enter(ring, 0) < 0)
+            return NULL;
+    }
+    unsigned idx = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[idx] = idx;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+    return sqe;
+}
+
+static int ring_arm_accept(RING *ring) {
+    struct io_uring_sqe *sqe = ring_get_sqe(ring);
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = ring->listenfd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = URING_ACCEPT_TAG;
+    return 0;
+}
+
+static int ring_arm_recv(RING *ring, RING_CONN *conn) {
+    struct io_uring_sqe *sqe = ring_get_sqe(ring);
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->user_data = (unsigned long) conn;
+    return 0;
+}
+
+/*
+ * Submitter for the output of the TUs flushed on a ring thread (see
+ * tu_set_submitter()).  The send goes to the kernel with the next
+ * io_uring_enter(), along with every other send queued by the same batch of
+ * completions, and its completion is reaped with the receives.  The socket is
+ * in blocking mode, so the kernel waits for room in its buffer rather than
+ * failing the send.
+ */
+static int ring_submit_send(void *arg, int fd, struct msghdr *msg, TU_SEND *send) {
+    struct io_uring_sqe *sqe = ring_get_sqe(arg);
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long) msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (unsigned long) send | URING_SEND_TAG;
+    return 0;
+}
+
+/*
+ * Hand a provided buffer back to the kernel once its contents are consumed.
+ */
+static void ring_recycle_buf(RING *ring, unsigned short bid) {
+    unsigned short tail = ring->br->tail;
+    struct io_uring_buf *buf = &ring->br->bufs[tail & (URING_BUF_COUNT - 1)];
+    buf->addr = (unsigned long) (ring->bufs + (size_t) bid * URING_BUF_LEN);
+    buf->len = URING_BUF_LEN;
+    buf->bid = bid;
+    __atomic_store_n(&ring->br->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static int ring_setup(RING *ring) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_SINGLE_ISSUER;
+    if ((ring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p)) < 0)
+        return -1;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP))
+        return -1;
+
+    size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    size_t len = sq_len > cq_len ? sq_len : cq_len;
+    char *sq = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ring->fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED)
+        return -1;
+    ring->sq_entries = p.sq_entries;
+    ring->sq_head = (unsigned *) (sq + p.sq_off.head);
+    ring->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (sq + p.sq_off.array);
+    ring->cq_head = (unsigned *) (sq + p.cq_off.head);
+    ring->cq_tail = (unsigned *) (sq + p.cq_off.tail);
+    ring->cq_mask = (unsigned *) (sq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (sq + p.cq_off.cqes);
+    ring->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+        return -1;
+
+    // Register the ring of provided buffers that multishot receives draw from.
+    ring->br = mmap(NULL, URING_BUF_COUNT * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ring->bufs = malloc((size_t) URING_BUF_COUNT * URING_BUF_LEN);
+    if (ring->br == MAP_FAILED || ring->bufs == NULL)
+        return -1;
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long) ring->br;
+    reg.ring_entries = URING_BUF_COUNT;
+    reg.bgid = URING_BGID;
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        return -1;
+    ring->br->tail = 0;
+    for (int i = 0; i < URING_BUF_COUNT; i++)
+        ring_recycle_buf(ring, i);
+    return 0;
+}
+
+static void ring_accepted(RING *ring, int connfd) {
+    pthread_once(&conn_pool_once, create_conn_pool);
+    RING_CONN *conn = conn_pool ? slab_alloc(conn_pool) : NULL;
+    if (conn == NULL) {
+        close(connfd);
+        return;
+    }
+    conn->fd = connfd;
+    if ((conn->tu = pbx_client_attach(connfd)) == NULL) {
+        slab_free(conn_pool, conn);
+        return;
+    }
+    if (ring_arm_recv(ring, conn)) {
+        pbx_client_detach(conn->tu, &conn->lines);
+        slab_free(conn_pool, conn);
+    }
+}
+
+static void ring_conn_close(RING_CONN *conn) {
+    pbx_client_detach(conn->tu, &conn->lines);
+    slab_free(conn_pool, conn);
+}
+
+/*
+ * Copy received data from a provided buffer into the connection's line parser
+ * and carry out every complete command.
+ */
+static void ring_conn_input(RING_CONN *conn, char *data, size_t n) {
+    while (n > 0) {
+        size_t room;
+        char *space = pbx_client_space(&conn->lines, &room);
+        if (room > n)
+            room = n;
+        memcpy(space, data, room);
+        pbx_client_frame(conn->tu, &conn->lines, room);
+        data += room;
+        n -= room;
+    }
+}
+
+static void ring_recv_done(RING *ring, RING_CONN *conn, struct io_uring_cqe *cqe) {
+    int more = cqe->flags & IORING_CQE_F_MORE;
+    if (cqe->res > 0) {
+        unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        ring_conn_input(conn, ring->bufs + (size_t) bid * URING_BUF_LEN, cqe->res);
+        ring_recycle_buf(ring, bid);
+        if (!more && ring_arm_recv(ring, conn) == 0)
+            return;
+    }
+    else if (cqe->res == -ENOBUFS && !more) {
+        // Ran out of provided buffers; they are back by now, so just re-arm.
+        if (ring_arm_recv(ring, conn) == 0)
+            return;
+    }
+    if (!more)
+        ring_conn_close(conn);
+}
+
+static void *ring_thread(void *arg) {
+    RING *ring = arg;
+    // The ring is created here since only this thread may submit to it.
+    ring->setup_error = ring_setup(ring) || ring_arm_accept(ring);
+    if (ring->setup_error)
+        fprintf(stderr, "Failed to set up io_uring: %s\n", strerror(errno));
+    V(&ring->ready);
+    if (ring->setup_error)
+        return NULL;
+    tu_set_submitter(ring_submit_send, ring);
+    while (1) {
+        if (ring_enter(ring, 1) < 0) {
+            fprintf(stderr, "io_uring_enter failed: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            if (cqe->user_data == URING_ACCEPT_TAG) {
+                if (cqe->res >= 0) {
+                    ring_accepted(ring, cqe->res);
+                }
+                else if (pbx_client_accept_error(-cqe->res)) {
+                    fprintf(stderr, "Failed to accept connections: %s\n", strerror(-cqe->res));
+                    exit(EXIT_FAILURE);
+                }
+                if (!(cqe->flags & IORING_CQE_F_MORE))
+                    ring_arm_accept(ring);
+            }
+            else if (cqe->user_data & URING_SEND_TAG) {
+                tu_send_done((TU_SEND *) (unsigned long) (cqe->user_data & ~URING_SEND_TAG),
+                             cqe->res);
+            }
+            else {
+                ring_recv_done(ring, (RING_CONN *) (unsigned long) cqe->user_data, cqe);
+            }
+            head++;
+            // Release the entry now: the handlers above may queue submissions.
+            __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+            if (head == tail)
+                tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Start a ring thread on a listening socket.
+ */
+int uring_loop_start(int listenfd, int cpu) {
+    RING *ring = calloc(1, sizeof(RING));
+    if (ring == NULL)
+        return -1;
+    ring->listenfd = listenfd;
+    Sem_init(&ring->ready, 0, 0);
+    if (pthread_create(&ring->tid, NULL, ring_thread, ring) != 0)
+        return -1;
+    pthread_detach(ring->tid);
+    if (cpu >= 0)
+        pin_thread(ring->tid, cpu);
+    P(&ring->ready);
+    if (ring->setup_error)
+        return -1;
+    debug("Started io_uring loop on fd %d", ring->fd);
+    return 0;
+}
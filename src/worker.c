@@ -0,0 +1,319 @@
+/*
+ * Worker pool that carries out client commands, with per-TU ordering and
+ * work stealing between workers.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "csapp.h"
+#include "worker.h"
+#include "slab.h"
+#include "debug.h"
+
+/*
+ * Jobs whose data fit in WORK_SMALL bytes (every command line but a long
+ * chat) come from a pool; larger ones are allocated individually.
+ */
+#define WORK_SMALL 64
+
+/*
+ * Number of jobs a worker runs from one queue before putting it back at the
+ * end of its deque, so that a flood of commands on one connection cannot
+ * delay the others scheduled on the same worker indefinitely.
+ */
+#define WORK_BUDGET 32
+
+/*
+ * Upper bounds, in microseconds, of the buckets that queue wait times are
+ * counted in.
+ */
+#define WORK_WAIT_BUCKETS 6
+static long wait_bounds[WORK_WAIT_BUCKETS - 1] = { 10, 100, 1000, 10000, 100000 };
+
+typedef struct job {
+    struct job *next;
+    WORK_FN fn;
+    long queued_ns;
+    size_t len;
+    int pooled;
+    int last;
+    char data[];
+} JOB;
+
+struct work_queue {
+    pthread_mutex_t lock;
+    JOB *head;
+    JOB **tail;
+    int scheduled;  // Set while the queue is in a deque or being run.
+    int home;       // Worker whose deque the queue is pushed onto.
+    TU *tu;
+};
+
+/*
+ * Statistics of a worker, written only by that worker.
+ */
+typedef struct worker_counts {
+    unsigned long jobs;
+    unsigned long steals;
+    unsigned long wait_us;
+    unsigned long wait_max_us;
+    unsigned long buckets[WORK_WAIT_BUCKETS];
+} WORKER_COUNTS;
+
+/*
+ * Deque of the work queues scheduled on a worker, kept as a ring that grows
+ * when it fills up.
+ */
+typedef struct worker {
+    pthread_t tid;
+    pthread_mutex_t lock;
+    WORK_QUEUE **ring;
+    size_t cap;
+    size_t first;
+    size_t count;
+    WORKER_COUNTS counts;
+} WORKER;
+
+int worker_pool_size;
+
+static WORKER *workers;
+static unsigned int next_home;
+
+/*
+ * Counts the queues in all deques together.  A worker takes a unit before
+ * looking for a queue to run, so that it always finds one.
+ */
+static sem_t ready;
+
+static SLAB_POOL *job_pool;
+static SLAB_POOL *queue_pool;
+
+static long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static void push_queue(WORKER *w, WORK_QUEUE *wq) {
+    pthread_mutex_lock(&w->lock);
+    if (w->count == w->cap) {
+        size_t cap = w->cap ? 2 * w->cap : 64;
+        WORK_QUEUE **ring = malloc(cap * sizeof(WORK_QUEUE *));
+        if (ring == NULL) {
+            fprintf(stderr, "Failed to grow worker deque\n");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < w->count; i++)
+            ring[i] = w->ring[(w->first + i) % w->cap];
+        free(w->ring);
+        w->ring = ring;
+        w->cap = cap;
+        w->first = 0;
+    }
+    w->ring[(w->first + w->count++) % w->cap] = wq;
+    pthread_mutex_unlock(&w->lock);
+    V(&ready);
+}
+
+/*
+ * Take the oldest queue from a worker's own deque, or the newest from
+ * another's.
+ */
+static WORK_QUEUE *take_queue(WORKER *w, int own) {
+    WORK_QUEUE *wq = NULL;
+    pthread_mutex_lock(&w->lock);
+    if (w->count > 0) {
+        if (own) {
+            wq = w->ring[w->first];
+            w->first = (w->first + 1) % w->cap;
+        }
+        else {
+            wq = w->ring[(w->first + w->count - 1) % w->cap];
+        }
+        w->count--;
+    }
+    pthread_mutex_unlock(&w->lock);
+    return wq;
+}
+
+static void free_job(JOB *job) {
+    if (job->pooled)
+        slab_free(job_pool, job);
+    else
+        free(job);
+}
+
+static void count_wait(WORKER_COUNTS *counts, long queued_ns) {
+    unsigned long us = (now_ns() - queued_ns) / 1000;
+    int bucket = 0;
+    while (bucket < WORK_WAIT_BUCKETS - 1 && us > (unsigned long) wait_bounds[bucket])
+        bucket++;
+    __atomic_store_n(&counts->jobs, counts->jobs + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&counts->wait_us, counts->wait_us + us, __ATOMIC_RELAXED);
+    __atomic_store_n(&counts->buckets[bucket], counts->buckets[bucket] + 1, __ATOMIC_RELAXED);
+    if (us > counts->wait_max_us)
+        __atomic_store_n(&counts->wait_max_us, us, __ATOMIC_RELAXED);
+}
+
+/*
+ * Run the jobs of a queue, up to the budget.  The notifications they produce
+ * are written out together at the end.
+ */
+static void run_queue(WORKER *w, WORK_QUEUE *wq) {
+    for (int n = 0; n < WORK_BUDGET; n++) {
+        pthread_mutex_lock(&wq->lock);
+        JOB *job = wq->head;
+        if (job == NULL) {
+            wq->scheduled = 0;
+            pthread_mutex_unlock(&wq->lock);
+            tu_flush_pending();
+            return;
+        }
+        if ((wq->head = job->next) == NULL)
+            wq->tail = &wq->head;
+        pthread_mutex_unlock(&wq->lock);
+
+        count_wait(&w->counts, job->queued_ns);
+        job->fn(wq->tu, job->data, job->len);
+        int last = job->last;
+        free_job(job);
+        if (last) {
+            // Nothing can have been submitted after the last job.
+            pthread_mutex_destroy(&wq->lock);
+            slab_free(queue_pool, wq);
+            tu_flush_pending();
+            return;
+        }
+    }
+    tu_flush_pending();
+    push_queue(w, wq);
+}
+
+static void *worker_thread(void *arg) {
+    WORKER *w = arg;
+    int self = w - workers;
+    while (1) {
+        P(&ready);
+        WORK_QUEUE *wq = take_queue(w, 1);
+        for (int i = 1; wq == NULL; i++) {
+            if ((wq = take_queue(&workers[(self + i) % worker_pool_size], 0)) != NULL)
+                __atomic_store_n(&w->counts.steals, w->counts.steals + 1, __ATOMIC_RELAXED);
+        }
+        run_queue(w, wq);
+    }
+    return NULL;
+}
+
+/*
+ * Start the worker threads.
+ */
+int worker_pool_init(int nworkers) {
+    job_pool = slab_pool_create("job", sizeof(JOB) + WORK_SMALL);
+    queue_pool = slab_pool_create("work_queue", sizeof(WORK_QUEUE));
+    workers = calloc(nworkers, sizeof(WORKER));
+    if (job_pool == NULL || queue_pool == NULL || workers == NULL)
+        return -1;
+    Sem_init(&ready, 0, 0);
+    worker_pool_size = nworkers;
+    for (int i = 0; i < nworkers; i++) {
+        pthread_mutex_init(&workers[i].lock, NULL);
+        if (pthread_create(&workers[i].tid, NULL, worker_thread, &workers[i]) != 0)
+            return -1;
+        pthread_detach(workers[i].tid);
+    }
+    debug("Started %d workers", nworkers);
+    return 0;
+}
+
+static void append_job(WORK_QUEUE **wqp, TU *tu, JOB *job) {
+    WORK_QUEUE *wq = *wqp;
+    if (wq == NULL) {
+        if ((wq = slab_alloc(queue_pool)) == NULL) {
+            fprintf(stderr, "Failed to allocate work queue\n");
+            exit(EXIT_FAILURE);
+        }
+        pthread_mutex_init(&wq->lock, NULL);
+        wq->tail = &wq->head;
+        wq->tu = tu;
+        wq->home = __atomic_fetch_add(&next_home, 1, __ATOMIC_RELAXED) % worker_pool_size;
+        *wqp = wq;
+    }
+    job->queued_ns = now_ns();
+    pthread_mutex_lock(&wq->lock);
+    *wq->tail = job;
+    wq->tail = &job->next;
+    int schedule = !wq->scheduled;
+    wq->scheduled = 1;
+    pthread_mutex_unlock(&wq->lock);
+    if (schedule)
+        push_queue(&workers[wq->home], wq);
+}
+
+void worker_submit(WORK_QUEUE **wqp, TU *tu, WORK_FN fn, char *data, size_t len) {
+    JOB *job;
+    if (len <= WORK_SMALL) {
+        if ((job = slab_alloc(job_pool)) != NULL)
+            job->pooled = 1;
+    }
+    else if ((job = malloc(sizeof(JOB) + len)) != NULL) {
+        job->pooled = 0;
+        job->last = 0;
+    }
+    if (job == NULL) {
+        fprintf(stderr, "Failed to allocate job\n");
+        exit(EXIT_FAILURE);
+    }
+    job->next = NULL;
+    job->fn = fn;
+    job->len = len;
+    memcpy(job->data, data, len);
+    append_job(wqp, tu, job);
+}
+
+void worker_finish(WORK_QUEUE **wqp, TU *tu, WORK_FN fn) {
+    if (*wqp == NULL) {
+        fn(tu, NULL, 0);
+        return;
+    }
+    JOB *job = slab_alloc(job_pool);
+    if (job == NULL) {
+        fprintf(stderr, "Failed to allocate job\n");
+        exit(EXIT_FAILURE);
+    }
+    job->pooled = 1;
+    job->fn = fn;
+    job->last = 1;
+    append_job(wqp, tu, job);
+    *wqp = NULL;
+}
+
+void worker_stats(FILE *out) {
+    static char *bucket_names[WORK_WAIT_BUCKETS] = { "10", "100", "1000", "10000", "100000", "+Inf" };
+    if (worker_pool_size == 0)
+        return;
+    WORKER_COUNTS total = { 0 };
+    for (int i = 0; i < worker_pool_size; i++) {
+        WORKER_COUNTS *c = &workers[i].counts;
+        unsigned long jobs = __atomic_load_n(&c->jobs, __ATOMIC_RELAXED);
+        unsigned long steals = __atomic_load_n(&c->steals, __ATOMIC_RELAXED);
+        unsigned long max = __atomic_load_n(&c->wait_max_us, __ATOMIC_RELAXED);
+        fprintf(out, "worker_jobs{worker=\"%d\"} %lu\n", i, jobs);
+        fprintf(out, "worker_steals{worker=\"%d\"} %lu\n", i, steals);
+        total.jobs += jobs;
+        total.wait_us += __atomic_load_n(&c->wait_us, __ATOMIC_RELAXED);
+        if (max > total.wait_max_us)
+            total.wait_max_us = max;
+        for (int b = 0; b < WORK_WAIT_BUCKETS; b++)
+            total.buckets[b] += __atomic_load_n(&c->buckets[b], __ATOMIC_RELAXED);
+    }
+    fprintf(out, "worker_queue_wait_us_count %lu\n", total.jobs);
+    fprintf(out, "worker_queue_wait_us_sum %lu\n", total.wait_us);
+    fprintf(out, "worker_queue_wait_us_max %lu\n", total.wait_max_us);
+    unsigned long cumulative = 0;
+    for (int b = 0; b < WORK_WAIT_BUCKETS; b++) {
+        cumulative += total.buckets[b];
+        fprintf(out, "worker_queue_wait_us_bucket{le=\"%s\"} %lu\n", bucket_names[b], cumulative);
+    }
+}
@@ -28,6 +28,13 @@
 
 /*
  * Structure describing a single step in a test script.
+ *
+ * A TU_SEND_CMD step sends its data verbatim, as a format with one %d for the
+ * extension of the TU id_to_dial (if that is not -1), so that several commands,
+ * or malformed input, can go out in a single write.  It and TU_EXPECT_CMD
+ * (which sends nothing) then require the very next notification to be the
+ * response, with no allowance for messages crossing in transit; a
+ * TU_SEND_CMD step whose response is -1 reads nothing.
  */
 typedef struct test_step {
     int id;                        // Index of TU performing test, or -1 if end.
@@ -36,6 +43,52 @@ typedef struct test_step {
     TU_STATE response;		   // Expected response.
     struct timeval timeout;        // Limit on time to wait for response (zero for no limit)
                                    // or time to delay.
+    char *data;                    // Input to send, for TU_SEND_CMD.
 } TEST_STEP;
 
 int run_test_script(char *name, TEST_STEP *scr, int port);
+
+/*
+ * Start a server on SERVER_PORT, with the given NULL-terminated list of further
+ * arguments, and wait for it to listen.  Returns its pid.
+ */
+int start_server(char *const args[]);
+
+/*
+ * Shut down a server with SIGHUP (killing it if it is still there a little later)
+ * and return its wait status.
+ */
+int stop_server(int pid);
+
+/*
+ * Raw connections, for tests that check the exact bytes sent by the server.
+ * test_connect() returns the connected socket, or -1.  test_read_line() reads
+ * up to and including an LF, and test_read_bytes() exactly len bytes; both
+ * return the number of bytes read, which is short on EOF or once the timeout
+ * has passed, and test_read_line() NUL-terminates what it read.
+ */
+int test_connect(int port);
+int test_read_line(int fd, char *buf, size_t size, struct timeval tv);
+int test_read_bytes(int fd, void *buf, size_t len, struct timeval tv);
+
+/*
+ * Criterion fixtures for tests over raw connections, which fail the current
+ * test when what they check does not hold.
+ *
+ * test_server_fini() shuts down a server started by start_server() and checks
+ * that it exited cleanly; test_killall() is for .fini, to get rid of a server
+ * left behind by a test that failed.
+ * test_client() connects to the server on SERVER_PORT and checks that it is
+ * sent ON HOOK, at extension ext unless that is -1.  It returns the
+ * connection, with the extension assigned in *assigned unless that is NULL.
+ * test_send_line() writes a string, which may hold several lines.
+ * test_expect_line() reads a line, waiting at most TEST_READ_TIMEOUT, and
+ * checks that it is the one expected, EOL included.
+ */
+#define TEST_READ_TIMEOUT HND_MSEC
+
+void test_server_fini(int pid);
+void test_killall(void);
+int test_client(int ext, int *assigned);
+void test_send_line(int fd, char *line);
+void test_expect_line(int fd, char *expected);
@@ -0,0 +1,67 @@
+/*
+ * Tests of admission control, with a server limited to one client.
+ * Like the other tests, these have to be run with -j1.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#include <criterion/criterion.h>
+
+#include "__test_includes.h"
+
+static int server_pid;
+
+static void init() {
+    char *args[] = { "-c", "1", NULL };
+    server_pid = start_server(args);
+}
+
+/*
+ * Connect a client and check that it is turned away.
+ */
+static void connect_rejected() {
+    char line[PBX_LINE_MAX];
+    int fd = test_connect(SERVER_PORT);
+    cr_assert(fd >= 0, "Failed to connect to server");
+    test_expect_line(fd, "BUSY\r\n");
+    cr_assert_eq(test_read_bytes(fd, line, 1, (struct timeval) TEST_READ_TIMEOUT), 0,
+		 "Expected EOF after BUSY");
+    close(fd);
+}
+
+#define SUITE admission_suite
+
+/*
+ * A client that would take the server past its limit is told BUSY and
+ * disconnected, without disturbing the client already there.
+ */
+#define TEST_NAME busy_when_full_test
+Test(SUITE, TEST_NAME, .init = init, .fini = test_killall, .timeout = 30) {
+    int fd = test_client(-1, NULL);
+    connect_rejected();
+    test_send_line(fd, "pickup\r\n");
+    test_expect_line(fd, "DIAL TONE\r\n");
+    close(fd);
+    test_server_fini(server_pid);
+}
+#undef TEST_NAME
+
+/*
+ * The place of a client that disconnects goes to the next one.
+ */
+#define TEST_NAME slot_reused_test
+Test(SUITE, TEST_NAME, .init = init, .fini = test_killall, .timeout = 30) {
+    int fd = test_client(-1, NULL);
+    close(fd);
+    usleep(100000);
+    fd = test_client(-1, NULL);
+    connect_rejected();
+    close(fd);
+    test_server_fini(server_pid);
+}
+#undef TEST_NAME
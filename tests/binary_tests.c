@@ -0,0 +1,211 @@
+/*
+ * Tests of the binary framing of the client protocol (see proto.h), and of
+ * calls between clients that speak it and clients that speak the text protocol.
+ * Like the other tests, these have to be run with -j1.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <arpa/inet.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#include <criterion/criterion.h>
+
+#include "__test_includes.h"
+#include "proto.h"
+
+static int server_pid;
+
+static void init() {
+    server_pid = start_server(NULL);
+}
+
+/*
+ * Write a frame, with the given extension or length for its arg.
+ */
+static void send_frame(int fd, int op, int arg, char *payload, size_t len) {
+    PROTO_HEADER hdr = { .op = op, .arg = htonl(payload != NULL ? len : arg) };
+    struct iovec iov[2] = {
+	{ .iov_base = &hdr, .iov_len = PROTO_HEADER_LEN },
+	{ .iov_base = payload, .iov_len = len }
+    };
+    cr_assert_eq(writev(fd, iov, 2), PROTO_HEADER_LEN + len, "Short write of frame");
+}
+
+/*
+ * Read a frame header and check that it is a state notification as expected.
+ */
+static void expect_state(int fd, TU_STATE state, int arg) {
+    PROTO_HEADER hdr;
+    int n = test_read_bytes(fd, &hdr, PROTO_HEADER_LEN, (struct timeval) TEST_READ_TIMEOUT);
+    cr_assert_eq(n, PROTO_HEADER_LEN, "Expected %s frame, read %d bytes",
+		 tu_state_names[state], n);
+    cr_assert_eq(hdr.op, PROTO_STATE, "Expected state frame, read op %d", hdr.op);
+    cr_assert_eq(hdr.state, state, "Expected %s, read %s",
+		 tu_state_names[state], tu_state_names[hdr.state]);
+    cr_assert_eq(ntohl(hdr.arg), arg, "Expected %s %d, read %s %d",
+		 tu_state_names[state], arg, tu_state_names[hdr.state], ntohl(hdr.arg));
+}
+
+/*
+ * Read a frame and check that it is the chat expected.
+ */
+static void expect_chat(int fd, char *payload, size_t len) {
+    PROTO_HEADER hdr;
+    char buf[PROTO_CHAT_MAX];
+    int n = test_read_bytes(fd, &hdr, PROTO_HEADER_LEN, (struct timeval) TEST_READ_TIMEOUT);
+    cr_assert_eq(n, PROTO_HEADER_LEN, "Expected chat frame, read %d bytes", n);
+    cr_assert_eq(hdr.op, PROTO_CHAT, "Expected chat frame, read op %d", hdr.op);
+    cr_assert_eq(ntohl(hdr.arg), len, "Expected chat of %zu bytes, read %d",
+		 len, ntohl(hdr.arg));
+    n = test_read_bytes(fd, buf, len, (struct timeval) TEST_READ_TIMEOUT);
+    cr_assert(n == len && !memcmp(buf, payload, len), "Chat payload differs");
+}
+
+/*
+ * Set up a call from a binary client to a text client, returning the
+ * connections in *bfd and *tfd and the extensions in *bext and *text.
+ */
+static void binary_call(int *bfd, int *bext, int *tfd, int *text) {
+    *bfd = test_client(-1, bext);
+    *tfd = test_client(-1, text);
+    test_send_line(*bfd, PROTO_BINARY_CMD"\r\n");
+    expect_state(*bfd, TU_ON_HOOK, *bext);
+    send_frame(*bfd, TU_PICKUP_CMD, 0, NULL, 0);
+    send_frame(*bfd, TU_DIAL_CMD, *text, NULL, 0);
+    expect_state(*bfd, TU_DIAL_TONE, 0);
+    expect_state(*bfd, TU_RING_BACK, 0);
+    test_expect_line(*tfd, "RINGING\r\n");
+    test_send_line(*tfd, "pickup\r\n");
+    char line[PBX_LINE_MAX];
+    sprintf(line, "CONNECTED %d\r\n", *bext);
+    test_expect_line(*tfd, line);
+    expect_state(*bfd, TU_CONNECTED, *text);
+}
+
+#define SUITE binary_suite
+
+/*
+ * Switching to binary framing is confirmed with the state of the TU, and
+ * frames may follow the switch in the same write.
+ */
+#define TEST_NAME binary_switch_test
+Test(SUITE, TEST_NAME, .init = init, .fini = test_killall, .timeout = 30) {
+    int ext;
+    int fd = test_client(-1, &ext);
+    char buf[64];
+    PROTO_HEADER hdr = { .op = TU_PICKUP_CMD };
+    int n = sprintf(buf, "%s\r\n", PROTO_BINARY_CMD);
+    memcpy(buf + n, &hdr, PROTO_HEADER_LEN);
+    write(fd, buf, n + PROTO_HEADER_LEN);
+    expect_state(fd, TU_ON_HOOK, ext);
+    expect_state(fd, TU_DIAL_TONE, 0);
+    send_frame(fd, TU_HANGUP_CMD, 0, NULL, 0);
+    expect_state(fd, TU_ON_HOOK, ext);
+    close(fd);
+    test_server_fini(server_pid);
+}
+#undef TEST_NAME
+
+/*
+ * A frame is carried out once all of it has arrived, however it is split
+ * up, and chats pass both ways between binary and text clients.
+ */
+#define TEST_NAME binary_text_chat_test
+Test(SUITE, TEST_NAME, .init = init, .fini = test_killall, .timeout = 30) {
+    int bfd, bext, tfd, text;
+    binary_call(&bfd, &bext, &tfd, &text);
+    PROTO_HEADER hdr = { .op = TU_CHAT_CMD, .arg = htonl(5) };
+    write(bfd, &hdr, 3);
+    usleep(50000);
+    write(bfd, (char *)&hdr + 3, PROTO_HEADER_LEN - 3);
+    usleep(50000);
+    write(bfd, "hello", 5);
+    test_expect_line(tfd, "CHAT hello\r\n");
+    expect_state(bfd, TU_CONNECTED, text);
+    test_send_line(tfd, "chat hi there\r\n");
+    expect_chat(bfd, "hi there", 8);
+    char line[PBX_LINE_MAX];
+    sprintf(line, "CONNECTED %d\r\n", bext);
+    test_expect_line(tfd, line);
+    close(tfd);
+    close(bfd);
+    test_server_fini(server_pid);
+}
+#undef TEST_NAME
+
+/*
+ * A binary chat to a text client cannot end its CHAT line early, to send
+ * the text client lines of the sender's making.
+ */
+#define TEST_NAME binary_chat_injection_test
+Test(SUITE, TEST_NAME, .init = init, .fini = test_killall, .timeout = 30) {
+    int bfd, bext, tfd, text;
+    binary_call(&bfd, &bext, &tfd, &text);
+    char chat[] = "hi\r\nON HOOK 99\nBUSY SIGNAL\r\0x";
+    send_frame(bfd, TU_CHAT_CMD, 0, chat, sizeof(chat) - 1);
+    test_expect_line(tfd, "CHAT hi  ON HOOK 99 BUSY SIGNAL  x\r\n");
+    expect_state(bfd, TU_CONNECTED, text);
+    send_frame(bfd, TU_HANGUP_CMD, 0, NULL, 0);
+    expect_state(bfd, TU_ON_HOOK, bext);
+    test_expect_line(tfd, "DIAL TONE\r\n");
+    close(tfd);
+    close(bfd);
+    test_server_fini(server_pid);
+}
+#undef TEST_NAME
+
+/*
+ * A chat frame longer than PROTO_CHAT_MAX is skipped, payload and all, even
+ * when it is longer than the input buffer, and the frame after it is carried
+ * out.  The payload is zeros, which would read as pickup frames if any of it
+ * were taken for frames.
+ */
+#define TEST_NAME oversized_chat_skipped_test
+Test(SUITE, TEST_NAME, .init = init, .fini = test_killall, .timeout = 30) {
+    int bfd, bext, tfd, text;
+    static char chat[3 * PBX_LINE_MAX];
+    binary_call(&bfd, &bext, &tfd, &text);
+    send_frame(bfd, TU_CHAT_CMD, 0, chat, sizeof(chat));
+    send_frame(bfd, TU_HANGUP_CMD, 0, NULL, 0);
+    expect_state(bfd, TU_ON_HOOK, bext);
+    test_expect_line(tfd, "DIAL TONE\r\n");
+    send_frame(bfd, TU_CHAT_CMD, 0, chat, PROTO_CHAT_MAX + 1);
+    send_frame(bfd, TU_PICKUP_CMD, 0, NULL, 0);
+    expect_state(bfd, TU_DIAL_TONE, 0);
+    close(tfd);
+    close(bfd);
+    test_server_fini(server_pid);
+}
+#undef TEST_NAME
+
+/*
+ * Chats too long for the message pool, which are written straight from the
+ * sender's buffer, arrive whole both ways, and ahead of the notifications
+ * of commands sent after them.
+ */
+#define TEST_NAME long_chat_test
+#define LONG_CHAT 1500
+Test(SUITE, TEST_NAME, .init = init, .fini = test_killall, .timeout = 30) {
+    int bfd, bext, tfd, text;
+    static char chat[LONG_CHAT], line[PBX_LINE_MAX];
+    binary_call(&bfd, &bext, &tfd, &text);
+    for(int i = 0; i < LONG_CHAT; i++)
+	chat[i] = 'a' + i % 26;
+    send_frame(bfd, TU_CHAT_CMD, 0, chat, LONG_CHAT);
+    sprintf(line, "CHAT %.*s\r\n", LONG_CHAT, chat);
+    test_expect_line(tfd, line);
+    expect_state(bfd, TU_CONNECTED, text);
+    sprintf(line, "chat %.*s\r\nhangup\r\n", LONG_CHAT, chat);
+    test_send_line(tfd, line);
+    expect_chat(bfd, chat, LONG_CHAT);
+    expect_state(bfd, TU_DIAL_TONE, 0);
+    close(tfd);
+    close(bfd);
+    test_server_fini(server_pid);
+}
+#undef TEST_NAME
@@ -0,0 +1,119 @@
+/*
+ * Tests of extension numbering: the numbers the allocator assigns, and
+ * clients asking for numbers of their own.
+ * Like the other tests, these have to be run with -j1.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#include <criterion/criterion.h>
+
+#include "__test_includes.h"
+
+static int server_pid;
+
+static void init() {
+    server_pid = start_server(NULL);
+}
+
+#define SUITE extension_suite
+
+/*
+ * Clients are assigned the lowest free numbers, from 0 up.
+ */
+#define TEST_NAME dense_extensions_test
+Test(SUITE, TEST_NAME, .init = init, .fini = test_killall, .timeout = 30) {
+    int fd0 = test_client(0, NULL);
+    int fd1 = test_client(1, NULL);
+    int fd2 = test_client(2, NULL);
+    close(fd1);
+    close(fd2);
+    close(fd0);
+    test_server_fini(server_pid);
+}
+#undef TEST_NAME
+
+/*
+ * A client that asks for a free number is moved to it and can be dialed
+ * there, while the number it gave up is kept out of use for a while.
+ */
+#define TEST_NAME extension_command_test
+Test(SUITE, TEST_NAME, .init = init, .fini = test_killall, .timeout = 30) {
+    int fd0 = test_client(0, NULL);
+    test_send_line(fd0, PBX_EXTENSION_CMD" 42\r\n");
+    test_expect_line(fd0, "ON HOOK 42\r\n");
+    int fd1 = test_client(1, NULL);
+    test_send_line(fd1, "pickup\r\ndial 0\r\n");
+    test_expect_line(fd1, "DIAL TONE\r\n");
+    test_expect_line(fd1, "ERROR\r\n");
+    test_send_line(fd1, "hangup\r\npickup\r\ndial 42\r\n");
+    test_expect_line(fd1, "ON HOOK 1\r\n");
+    test_expect_line(fd1, "DIAL TONE\r\n");
+    test_expect_line(fd1, "RING BACK\r\n");
+    test_expect_line(fd0, "RINGING\r\n");
+    test_send_line(fd0, "pickup\r\n");
+    test_expect_line(fd0, "CONNECTED 1\r\n");
+    test_expect_line(fd1, "CONNECTED 42\r\n");
+    close(fd1);
+    close(fd0);
+    test_server_fini(server_pid);
+}
+#undef TEST_NAME
+
+/*
+ * A client that asks for a number that is not to be had, because it is
+ * assigned, in quarantine or out of range, keeps its own and is sent its
+ * current state.
+ */
+#define TEST_NAME extension_conflict_test
+Test(SUITE, TEST_NAME, .init = init, .fini = test_killall, .timeout = 30) {
+    int fd0 = test_client(0, NULL);
+    int fd1 = test_client(1, NULL);
+    test_send_line(fd1, PBX_EXTENSION_CMD" 0\r\n");
+    test_expect_line(fd1, "ON HOOK 1\r\n");
+    test_send_line(fd0, PBX_EXTENSION_CMD" 5\r\n");
+    test_expect_line(fd0, "ON HOOK 5\r\n");
+    test_send_line(fd1, PBX_EXTENSION_CMD" 0\r\n");
+    test_expect_line(fd1, "ON HOOK 1\r\n");
+    test_send_line(fd1, PBX_EXTENSION_CMD" 5\r\n");
+    test_expect_line(fd1, "ON HOOK 1\r\n");
+    test_send_line(fd1, PBX_EXTENSION_CMD" 1000000\r\n");
+    test_expect_line(fd1, "ON HOOK 1\r\n");
+    test_send_line(fd1, "pickup\r\n");
+    test_expect_line(fd1, "DIAL TONE\r\n");
+    close(fd1);
+    close(fd0);
+    test_server_fini(server_pid);
+}
+#undef TEST_NAME
+
+static void init_high_range() {
+    char *args[] = { "-x", "500000000-500000010", NULL };
+    server_pid = start_server(args);
+}
+
+/*
+ * Numbers are assigned, and can be dialed, however high the range starts.
+ */
+#define TEST_NAME high_range_test
+Test(SUITE, TEST_NAME, .init = init_high_range, .fini = test_killall, .timeout = 30) {
+    int fd0 = test_client(500000000, NULL);
+    test_send_line(fd0, PBX_EXTENSION_CMD" 500000010\r\n");
+    test_expect_line(fd0, "ON HOOK 500000010\r\n");
+    test_send_line(fd0, PBX_EXTENSION_CMD" 500000011\r\n");
+    test_expect_line(fd0, "ON HOOK 500000010\r\n");
+    int fd1 = test_client(500000001, NULL);
+    test_send_line(fd1, "pickup\r\ndial 500000010\r\n");
+    test_expect_line(fd1, "DIAL TONE\r\n");
+    test_expect_line(fd1, "RING BACK\r\n");
+    test_expect_line(fd0, "RINGING\r\n");
+    close(fd1);
+    close(fd0);
+    test_server_fini(server_pid);
+}
+#undef TEST_NAME
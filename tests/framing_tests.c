@@ -0,0 +1,146 @@
+/*
+ * Tests of how the server splits client input into command lines.
+ * Like the other tests, these have to be run with -j1.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#include <criterion/criterion.h>
+
+#include "__test_includes.h"
+
+static int server_pid;
+
+static void init() {
+    server_pid = start_server(NULL);
+}
+
+#define SUITE framing_suite
+
+/*
+ * Several commands in one write are each carried out, in order.
+ */
+#define TEST_NAME pipelined_commands_test
+static TEST_STEP SCRIPT(TEST_NAME)[] = {
+    // ID,  COMMAND,          ID_TO_DIAL,    RESPONSE,       TIMEOUT,   DATA
+    {   0,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   1,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   0,  TU_SEND_CMD,        1,           TU_DIAL_TONE,   HND_MSEC,  "pickup\r\ndial %d\r\n" },
+    {   0,  TU_EXPECT_CMD,     -1,           TU_RING_BACK,   HND_MSEC },
+    {   1,  TU_EXPECT_CMD,     -1,           TU_RINGING,     HND_MSEC },
+    {   1,  TU_PICKUP_CMD,     -1,           TU_CONNECTED,   HND_MSEC },
+    {   0,  TU_EXPECT_CMD,     -1,           TU_CONNECTED,   HND_MSEC },
+    {   0,  TU_DISCONNECT_CMD, -1,           -1,             HND_MSEC },
+    {   1,  TU_DISCONNECT_CMD, -1,           -1,             HND_MSEC },
+    {   -1, -1,                -1,           -1,             ZERO_SEC }
+};
+
+Test(SUITE, TEST_NAME, .init = init, .fini = test_killall, .timeout = 30) {
+    char *name = QUOTE(SUITE)"/"QUOTE(TEST_NAME);
+    int ret = run_test_script(name, SCRIPT(TEST_NAME), SERVER_PORT);
+    cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
+    test_server_fini(server_pid);
+}
+#undef TEST_NAME
+
+/*
+ * A line too long for the server's buffer is thrown away, all of it, and the
+ * line after it is read as usual.  The long line ends with a command, which
+ * would be carried out if only the part of the line that fit were dropped.
+ */
+#define TEST_NAME long_line_discarded_test
+static char long_line[2 * PBX_LINE_MAX + 64];
+static TEST_STEP SCRIPT(TEST_NAME)[] = {
+    // ID,  COMMAND,          ID_TO_DIAL,    RESPONSE,       TIMEOUT,   DATA
+    {   0,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   0,  TU_SEND_CMD,       -1,           TU_DIAL_TONE,   HND_MSEC,  long_line },
+    {   0,  TU_HANGUP_CMD,     -1,           TU_ON_HOOK,     HND_MSEC },
+    {   0,  TU_DISCONNECT_CMD, -1,           -1,             HND_MSEC },
+    {   -1, -1,                -1,           -1,             ZERO_SEC }
+};
+
+Test(SUITE, TEST_NAME, .init = init, .fini = test_killall, .timeout = 30) {
+    char *name = QUOTE(SUITE)"/"QUOTE(TEST_NAME);
+    memset(long_line, 'x', 2 * PBX_LINE_MAX);
+    strcpy(long_line + 2 * PBX_LINE_MAX, "hangup\r\npickup\r\n");
+    int ret = run_test_script(name, SCRIPT(TEST_NAME), SERVER_PORT);
+    cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
+    test_server_fini(server_pid);
+}
+#undef TEST_NAME
+
+/*
+ * Lines end with CRLF: a bare LF is part of the line, which here makes it
+ * a command the server does not know.
+ */
+#define TEST_NAME bare_lf_test
+static TEST_STEP SCRIPT(TEST_NAME)[] = {
+    // ID,  COMMAND,          ID_TO_DIAL,    RESPONSE,       TIMEOUT,   DATA
+    {   0,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   0,  TU_SEND_CMD,       -1,           -1,             ZERO_SEC,  "hangup\npickup\r\n" },
+    {   0,  TU_SEND_CMD,       -1,           TU_DIAL_TONE,   HND_MSEC,  "pickup\r\n" },
+    {   0,  TU_DISCONNECT_CMD, -1,           -1,             HND_MSEC },
+    {   -1, -1,                -1,           -1,             ZERO_SEC }
+};
+
+Test(SUITE, TEST_NAME, .init = init, .fini = test_killall, .timeout = 30) {
+    char *name = QUOTE(SUITE)"/"QUOTE(TEST_NAME);
+    int ret = run_test_script(name, SCRIPT(TEST_NAME), SERVER_PORT);
+    cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
+    test_server_fini(server_pid);
+}
+#undef TEST_NAME
+
+/*
+ * The notifications for a batch of commands, which the server writes out
+ * together, all arrive, in the order of the commands: both TUs' notifications
+ * are for the whole batch, with none coalesced away.
+ */
+#define TEST_NAME pipelined_notifications_test
+static TEST_STEP SCRIPT(TEST_NAME)[] = {
+    // ID,  COMMAND,          ID_TO_DIAL,    RESPONSE,       TIMEOUT,   DATA
+    {   0,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   1,  TU_CONNECT_CMD,    -1,           TU_ON_HOOK,     HND_MSEC },
+    {   0,  TU_SEND_CMD,        1,           TU_DIAL_TONE,   HND_MSEC,
+	"pickup\r\nhangup\r\npickup\r\ndial %d\r\nhangup\r\npickup\r\n" },
+    {   0,  TU_EXPECT_CMD,     -1,           TU_ON_HOOK,     HND_MSEC },
+    {   0,  TU_EXPECT_CMD,     -1,           TU_DIAL_TONE,   HND_MSEC },
+    {   0,  TU_EXPECT_CMD,     -1,           TU_RING_BACK,   HND_MSEC },
+    {   0,  TU_EXPECT_CMD,     -1,           TU_ON_HOOK,     HND_MSEC },
+    {   0,  TU_EXPECT_CMD,     -1,           TU_DIAL_TONE,   HND_MSEC },
+    {   1,  TU_EXPECT_CMD,     -1,           TU_RINGING,     HND_MSEC },
+    {   1,  TU_EXPECT_CMD,     -1,           TU_ON_HOOK,     HND_MSEC },
+    {   0,  TU_DISCONNECT_CMD, -1,           -1,             HND_MSEC },
+    {   1,  TU_DISCONNECT_CMD, -1,           -1,             HND_MSEC },
+    {   -1, -1,                -1,           -1,             ZERO_SEC }
+};
+
+Test(SUITE, TEST_NAME, .init = init, .fini = test_killall, .timeout = 30) {
+    char *name = QUOTE(SUITE)"/"QUOTE(TEST_NAME);
+    int ret = run_test_script(name, SCRIPT(TEST_NAME), SERVER_PORT);
+    cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
+    test_server_fini(server_pid);
+}
+#undef TEST_NAME
+
+static void init_uring() {
+    char *args[] = { "-m", "uring", NULL };
+    server_pid = start_server(args);
+}
+
+/*
+ * The same batch in io_uring mode, where the notifications go out by sends
+ * submitted on the ring that received the commands.
+ */
+#define TEST_NAME uring_notifications_test
+Test(SUITE, TEST_NAME, .init = init_uring, .fini = test_killall, .timeout = 30) {
+    char *name = QUOTE(SUITE)"/"QUOTE(TEST_NAME);
+    int ret = run_test_script(name, SCRIPT(pipelined_notifications_test), SERVER_PORT);
+    cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
+    test_server_fini(server_pid);
+}
+#undef TEST_NAME
@@ -6,8 +6,13 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <signal.h>
+#include <unistd.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/wait.h>
+
+#include <criterion/criterion.h>
 
 #include "pbx.h"
 #include "server.h"
@@ -293,6 +298,17 @@ int run_test_script(char *name, TEST_STEP *scr, int port) {
 	    // Process incoming messages until specified state seen
 	    // or timeout occurs.
 	    break;
+	case TU_SEND_CMD:
+	    if(ts->id_to_dial != -1)
+		ext = tus[ts->id_to_dial].extension;
+	    fprintf(stderr, "%s: [%ld] (step #%ld) TU_SEND_CMD (%zu bytes)\n",
+		    timestamp(), TU_ID(tu), ts - scr, strlen(ts->data));
+	    fprintf(tu->out, ts->data, ext);
+	    fflush(tu->out);
+	    break;
+	case TU_EXPECT_CMD:
+	    fprintf(stderr, "%s: [%ld] (step #%ld) TU_EXPECT_CMD\n", timestamp(), TU_ID(tu), ts - scr);
+	    break;
 	
 	// Real commands
 	case TU_PICKUP_CMD:
@@ -330,6 +346,13 @@ int run_test_script(char *name, TEST_STEP *scr, int port) {
 	    // when no previous command has actually been sent.
 	    tu->last_command = TU_HANGUP_CMD;
 	    tu->expected_states = next_states[tu->current_state][TU_HANGUP_CMD];
+	} else if(cmd == TU_SEND_CMD || cmd == TU_EXPECT_CMD) {
+	    // Exactly the response given must come next.
+	    if(ts->response == -1) {
+		ts++;
+		continue;
+	    }
+	    tu->expected_states = 1<<ts->response;
 	} else if(cmd == TU_DISCONNECT_CMD) {
 	    fprintf(stderr, "%s: [%ld] Disconnected, now expecting EOF\n", timestamp(), TU_ID(tu));
 	    tu->last_command = cmd;
@@ -640,3 +663,128 @@ static char *timestamp() {
     sprintf(buf, "%ld.%06ld", tv.tv_sec, tv.tv_usec);
     return buf;
 }
+
+static void wait_for_server(int listening) {
+    int ret;
+    int i = 0;
+    do {
+	if(i)
+	    sleep(SERVER_STARTUP_SLEEP);
+	ret = system("netstat -an | grep 'LISTEN[ ]*$' | grep -q ':"SERVER_PORT_STR"'");
+	if(!listening && WEXITSTATUS(ret) == 0)
+	    system("killall -s KILL pbx > /dev/null 2>&1");
+    } while(++i < 30 && (WEXITSTATUS(ret) == 0) != listening);
+}
+
+int start_server(char *const args[]) {
+    char *argv[20] = { "pbx", "-p", SERVER_PORT_STR };
+    int argc = 3;
+    while(args != NULL && *args != NULL && argc < 19)
+	argv[argc++] = *args++;
+    wait_for_server(0);
+    int pid;
+    if((pid = fork()) == 0) {
+	execv("bin/pbx", argv);
+	fprintf(stderr, "Failed to exec server\n");
+	abort();
+    }
+    fprintf(stderr, "***Started server, pid = %d\n", pid);
+    wait_for_server(1);
+    return pid;
+}
+
+int stop_server(int pid) {
+    int ret;
+    kill(pid, SIGHUP);
+    sleep(SERVER_SHUTDOWN_SLEEP);
+    kill(pid, SIGKILL);
+    waitpid(pid, &ret, 0);
+    fprintf(stderr, "***Server wait() returned = 0x%x\n", ret);
+    return ret;
+}
+
+int test_connect(int port) {
+    struct in_addr sa;
+    struct hostent *he;
+    if((he = gethostbyname(SERVER_HOSTNAME)) == NULL)
+	return -1;
+    memcpy(&sa, he->h_addr, sizeof(sa));
+    return connect_to_server(&sa, port);
+}
+
+/*
+ * Wait for input on a connection until a deadline.
+ * Returns nonzero if there is input (or EOF) to read.
+ */
+static int await_input(int fd, struct timeval *deadline) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    long ms = (deadline->tv_sec - now.tv_sec) * 1000 + (deadline->tv_usec - now.tv_usec) / 1000;
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    return ms > 0 && poll(&pfd, 1, ms) == 1;
+}
+
+static struct timeval deadline_after(struct timeval tv) {
+    struct timeval now, deadline;
+    gettimeofday(&now, NULL);
+    timeradd(&now, &tv, &deadline);
+    return deadline;
+}
+
+int test_read_line(int fd, char *buf, size_t size, struct timeval tv) {
+    struct timeval deadline = deadline_after(tv);
+    size_t n = 0;
+    while(n < size - 1 && await_input(fd, &deadline) && read(fd, buf + n, 1) == 1) {
+	if(buf[n++] == '\n')
+	    break;
+    }
+    buf[n] = '\0';
+    fprintf(stderr, "%s: Read line (%zu bytes): %s", timestamp(), n, n ? buf : "\n");
+    return n;
+}
+
+int test_read_bytes(int fd, void *buf, size_t len, struct timeval tv) {
+    struct timeval deadline = deadline_after(tv);
+    size_t n = 0;
+    ssize_t r;
+    while(n < len && await_input(fd, &deadline) && (r = read(fd, (char *)buf + n, len - n)) > 0)
+	n += r;
+    return n;
+}
+
+void test_server_fini(int pid) {
+    cr_assert(pid != 0, "No server was started!\n");
+    int ret = stop_server(pid);
+    if(WIFSIGNALED(ret))
+	cr_assert_fail("***Server terminated ungracefully with signal %d\n", WTERMSIG(ret));
+    cr_assert_eq(WEXITSTATUS(ret), 0, "Server exit status was not 0");
+}
+
+void test_killall(void) {
+    system("killall -s KILL pbx > /dev/null 2>&1");
+}
+
+int test_client(int ext, int *assigned) {
+    char line[MAX_MESSAGE_LEN];
+    int n;
+    int fd = test_connect(SERVER_PORT);
+    cr_assert(fd >= 0, "Failed to connect to server");
+    test_read_line(fd, line, sizeof(line), (struct timeval) TEST_READ_TIMEOUT);
+    cr_assert(sscanf(line, "ON HOOK %d\r\n", &n) == 1, "Expected ON HOOK, read \"%s\"", line);
+    if(ext != -1)
+	cr_assert_eq(n, ext, "Expected ON HOOK %d, read ON HOOK %d", ext, n);
+    if(assigned != NULL)
+	*assigned = n;
+    return fd;
+}
+
+void test_send_line(int fd, char *line) {
+    size_t len = strlen(line);
+    cr_assert_eq(write(fd, line, len), len, "Short write");
+}
+
+void test_expect_line(int fd, char *expected) {
+    char line[PBX_LINE_MAX];
+    test_read_line(fd, line, sizeof(line), (struct timeval) TEST_READ_TIMEOUT);
+    cr_assert_str_eq(line, expected, "Expected line \"%s\", read \"%s\"", expected, line);
+}
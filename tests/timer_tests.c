@@ -0,0 +1,131 @@
+/*
+ * Tests of the timing wheel, directly and through the idle timeout and
+ * keepalive probes that run on it.
+ * Like the other tests, these have to be run with -j1.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <semaphore.h>
+
+#include <criterion/criterion.h>
+
+#include "__test_includes.h"
+#include "timer.h"
+
+static int server_pid;
+
+static long ms_since(struct timespec *from) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - from->tv_sec) * 1000 + (now.tv_nsec - from->tv_nsec) / 1000000;
+}
+
+#define SUITE timer_suite
+
+/*
+ * A timer armed for a whole turn of the innermost wheel (256 ticks, less the
+ * tick being run) from the function of a timer that has just expired lands
+ * in the slot being run, and must wait for it to come round again rather
+ * than fire at once.
+ */
+#define TEST_NAME rearm_full_turn_test
+#define REARM_MS (255 * TIMER_TICK_MS)
+static TIMER rearm_timer;
+static int rearm_count;
+static struct timespec rearm_time;
+static long rearm_elapsed;
+static sem_t rearm_done;
+
+static void rearm_expired(TIMER *timer) {
+    if (rearm_count++ == 0) {
+	clock_gettime(CLOCK_MONOTONIC, &rearm_time);
+	timer_arm(timer, REARM_MS, rearm_expired);
+    } else {
+	rearm_elapsed = ms_since(&rearm_time);
+	sem_post(&rearm_done);
+    }
+}
+
+Test(SUITE, TEST_NAME, .timeout = 30) {
+    sem_init(&rearm_done, 0, 0);
+    cr_assert_eq(timer_init(), 0, "Failed to start timer thread");
+    timer_arm(&rearm_timer, TIMER_TICK_MS, rearm_expired);
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += 10;
+    cr_assert_eq(sem_timedwait(&rearm_done, &deadline), 0, "Re-armed timer did not fire");
+    cr_assert(rearm_elapsed >= REARM_MS - TIMER_TICK_MS,
+	      "Timer armed for %d ms fired after %ld ms", REARM_MS, rearm_elapsed);
+    cr_assert(rearm_elapsed < REARM_MS + 50 * TIMER_TICK_MS,
+	      "Timer armed for %d ms fired after %ld ms", REARM_MS, rearm_elapsed);
+}
+#undef TEST_NAME
+
+static void init_keepalive() {
+    char *args[] = { "-k", "2.55", NULL };
+    server_pid = start_server(args);
+}
+
+/*
+ * An idle client is sent its state every keepalive interval, and the probes
+ * keep coming.  The interval is the length of a turn of the innermost
+ * wheel, which the probe re-arms its timer for from the timer thread.
+ */
+#define TEST_NAME keepalive_test
+Test(SUITE, TEST_NAME, .init = init_keepalive, .fini = test_killall, .timeout = 30) {
+    char line[PBX_LINE_MAX], probe[PBX_LINE_MAX];
+    int ext;
+    struct timespec last;
+    int fd = test_client(-1, &ext);
+    clock_gettime(CLOCK_MONOTONIC, &last);
+    sprintf(probe, "ON HOOK %d\r\n", ext);
+    for(int i = 0; i < 3; i++) {
+	test_read_line(fd, line, sizeof(line), (struct timeval) { 4, 0 });
+	long ms = ms_since(&last);
+	clock_gettime(CLOCK_MONOTONIC, &last);
+	cr_assert_str_eq(line, probe, "Probe %d: expected \"%s\", read \"%s\"", i, probe, line);
+	cr_assert(ms >= 2500 && ms < 3000, "Probe %d came after %ld ms, not 2550", i, ms);
+    }
+    close(fd);
+    test_server_fini(server_pid);
+}
+#undef TEST_NAME
+
+static void init_idle() {
+    char *args[] = { "-i", "1", NULL };
+    server_pid = start_server(args);
+}
+
+/*
+ * A client that sends nothing for the idle timeout is disconnected, and one
+ * that keeps sending is not.
+ */
+#define TEST_NAME idle_timeout_test
+Test(SUITE, TEST_NAME, .init = init_idle, .fini = test_killall, .timeout = 30) {
+    char line[PBX_LINE_MAX], on_hook[PBX_LINE_MAX];
+    struct timespec start;
+    int ext;
+    int idle = test_client(-1, NULL);
+    int busy = test_client(-1, &ext);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    sprintf(on_hook, "ON HOOK %d\r\n", ext);
+    for(int i = 0; i < 3; i++) {
+	usleep(500000);
+	test_send_line(busy, i % 2 ? "hangup\r\n" : "pickup\r\n");
+	test_expect_line(busy, i % 2 ? on_hook : "DIAL TONE\r\n");
+    }
+    cr_assert_eq(test_read_bytes(idle, line, 1, (struct timeval) { 2, 0 }), 0,
+		 "Expected EOF on idle connection");
+    long ms = ms_since(&start);
+    cr_assert(ms >= 900 && ms < 1600, "Idle connection was closed after %ld ms, not 1000", ms);
+    test_send_line(busy, "pickup\r\n");
+    test_expect_line(busy, "DIAL TONE\r\n");
+    close(idle);
+    close(busy);
+    test_server_fini(server_pid);
+}
+#undef TEST_NAME
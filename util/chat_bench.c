@@ -0,0 +1,105 @@
+/*
+ * Benchmark of chat throughput between two connected TUs, comparing the
+ * relay path, which writes each message straight from the sender's buffer
+ * once the claims are released, with the path that copies it into the peer's
+ * outbound queue first.  Each message is flushed as it would be after a
+ * command batch.
+ *
+ * The TUs are attached to socket pairs whose far ends are drained by reader
+ * threads.  For each message size, the time measured runs from the first
+ * chat until the peer's reader has received every message.
+ *
+ * Usage: bin/chat_bench [messages-per-size]
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/socket.h>
+
+#include "pbx.h"
+
+static long received;
+
+static long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static void *drain(void *arg) {
+    char buf[65536];
+    while (read((int) (long) arg, buf, sizeof(buf)) > 0)
+        ;
+    return NULL;
+}
+
+static void *count(void *arg) {
+    char buf[65536];
+    ssize_t n;
+    while ((n = read((int) (long) arg, buf, sizeof(buf))) > 0)
+        __atomic_fetch_add(&received, n, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+static TU *attach(int ext, int counted) {
+    int sv[2];
+    pthread_t tid;
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        perror("socketpair");
+        exit(1);
+    }
+    TU *tu = tu_init(sv[0]);
+    pbx_register(pbx, tu, ext);
+    // Only the peer's reader counts what it receives; the sender's just drains.
+    pthread_create(&tid, NULL, counted ? count : drain, (void *) (long) sv[1]);
+    pthread_detach(tid);
+    return tu;
+}
+
+static double run(TU *sender, char *msg, int n) {
+    long expected = __atomic_load_n(&received, __ATOMIC_RELAXED) + (long) n * (strlen(msg) + 7);
+    long start = now_ns();
+    for (int i = 0; i < n; i++) {
+        tu_chat(sender, msg);
+        tu_flush_pending();
+    }
+    while (__atomic_load_n(&received, __ATOMIC_RELAXED) < expected)
+        sched_yield();
+    return (double) (now_ns() - start) / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+    int n = argc > 1 ? atoi(argv[1]) : 200000;
+    int sizes[] = { 16, 256, 1024, 2000 };
+    int nsizes = sizeof(sizes) / sizeof(sizes[0]);
+
+    // Nothing may be dropped, however far the readers fall behind.
+    tu_output_limit = (size_t) 1 << 40;
+    pbx = pbx_init();
+    TU *a = attach(0, 0);
+    TU *b = attach(1, 1);
+    tu_pickup(a);
+    pbx_dial(pbx, a, 1);
+    tu_pickup(b);
+    tu_flush_pending();
+    usleep(100000);
+
+    printf("%8s %16s %16s\n", "bytes", "queued MB/s", "relayed MB/s");
+    for (int s = 0; s < nsizes; s++) {
+        char *msg = malloc(sizes[s] + 1);
+        memset(msg, 'x', sizes[s]);
+        msg[sizes[s]] = '\0';
+        double mb = (double) n * (sizes[s] + 7) / 1e6;
+        tu_relay_chat = 0;
+        double queued = run(a, msg, n);
+        tu_relay_chat = 1;
+        double relayed = run(a, msg, n);
+        printf("%8d %16.1f %16.1f\n", sizes[s], mb / queued, mb / relayed);
+        free(msg);
+    }
+    return 0;
+}
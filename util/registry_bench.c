@@ -0,0 +1,68 @@
+/*
+ * Benchmark of dial latency as a function of the number of registered TUs.
+ *
+ * For each registry size, registers that many TUs and then times dials to
+ * randomly chosen extensions from a TU that is on hook.  A dial from a TU
+ * that is not in the TU_DIAL_TONE state only looks up the target and sends
+ * the caller its current state, so the time measured is dominated by the
+ * registry lookup and the notification write (to /dev/null).  The time to
+ * unregister each TU is reported as well.
+ *
+ * Usage: bin/registry_bench [dials-per-size]
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include "pbx.h"
+
+static long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+int main(int argc, char *argv[]) {
+    int dials = argc > 1 ? atoi(argv[1]) : 200000;
+    int sizes[] = { 10, 100, 1000, 10000, 100000 };
+    int nsizes = sizeof(sizes) / sizeof(sizes[0]);
+    int devnull = open("/dev/null", O_WRONLY);
+    if (devnull < 0) {
+        perror("open");
+        return 1;
+    }
+
+    printf("%12s %12s %14s\n", "registered", "ns/dial", "ns/unregister");
+    for (int s = 0; s < nsizes; s++) {
+        int n = sizes[s];
+        pbx = pbx_init();
+        TU **tus = malloc(n * sizeof(TU *));
+        for (int i = 0; i < n; i++) {
+            // Hold an extra reference so that unregistering does not free the
+            // TU and close the shared descriptor.
+            tus[i] = tu_init(devnull);
+            tu_ref(tus[i], "Benchmark");
+            pbx_register(pbx, tus[i], i);
+        }
+        TU *caller = tus[0];
+
+        srand(n);
+        long start = now_ns();
+        for (int i = 0; i < dials; i++) {
+            pbx_dial(pbx, caller, rand() % n);
+            tu_flush_pending();
+        }
+        long elapsed = now_ns() - start;
+
+        start = now_ns();
+        for (int i = 0; i < n; i++)
+            pbx_unregister(pbx, tus[i]);
+        tu_flush_pending();
+        long unreg = now_ns() - start;
+        printf("%12d %12.1f %14.1f\n", n, (double) elapsed / dials, (double) unreg / n);
+        free(tus);
+        pbx_shutdown(pbx);
+    }
+    return 0;
+}
@@ -0,0 +1,61 @@
+/*
+ * Benchmark of the timing wheel: the cost of arming, moving and cancelling
+ * timers with a large number of them armed, and how promptly they expire.
+ *
+ * Usage: bin/timer_bench [timers]
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <sched.h>
+
+#include "timer.h"
+
+static unsigned long expired;
+
+static long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static void count_expiry(TIMER *timer) {
+    __atomic_fetch_add(&expired, 1, __ATOMIC_RELAXED);
+}
+
+int main(int argc, char *argv[]) {
+    int n = argc > 1 ? atoi(argv[1]) : 500000;
+    TIMER *timers = calloc(n, sizeof(TIMER));
+    if (timers == NULL || timer_init()) {
+        fprintf(stderr, "Failed to set up timers\n");
+        return 1;
+    }
+    srandom(1);
+
+    // Spread over ten minutes, so that every wheel is in use.
+    long start = now_ns();
+    for (int i = 0; i < n; i++)
+        timer_arm(&timers[i], random() % 600000, count_expiry);
+    printf("arm %d timers:    %6.1f ns/timer\n", n, (double) (now_ns() - start) / n);
+
+    start = now_ns();
+    for (int i = 0; i < n; i++)
+        timer_arm(&timers[i], random() % 600000, count_expiry);
+    printf("move %d timers:   %6.1f ns/timer\n", n, (double) (now_ns() - start) / n);
+
+    start = now_ns();
+    for (int i = 0; i < n; i++)
+        timer_cancel(&timers[i]);
+    printf("cancel %d timers: %6.1f ns/timer\n", n, (double) (now_ns() - start) / n);
+
+    // Then all due within the next second.
+    __atomic_store_n(&expired, 0, __ATOMIC_RELAXED);
+    for (int i = 0; i < n; i++)
+        timer_arm(&timers[i], 500 + random() % 500, count_expiry);
+    start = now_ns();
+    while (__atomic_load_n(&expired, __ATOMIC_RELAXED) < (unsigned long) n)
+        sched_yield();
+    printf("expire %d timers due in 0.5-1s: done after %.3f s\n", n, (double) (now_ns() - start) / 1e9);
+    timer_stats(stdout);
+    return 0;
+}